@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include "arch_buf.h"
+#include "stats.h"
+
+#define ZERO_SIZE 4096
+
+static const uint8_t zeros[ZERO_SIZE];
+
+/* once the kernel or filesystem says no to a transfer method
+ * stop asking for the rest of the run */
+static int use_copy_range = 1;
+static int use_sendfile = 1;
+static int use_splice = 1;
+static int splice_pipe[2] = {-1, -1};
+
+/* errors meaning "this method can't do it here" rather than a real
+ * I/O failure, so the next method should get a try */
+static int unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+    err == EBADF || err == ENOTSUP;
+}
+
+/* returns a buffer writing to fd on success NULL on failure */
+arch_buf *buf_init(int fd, size_t cap) {
+  arch_buf *b;
+  if (cap < ZERO_SIZE) {
+    cap = ZERO_SIZE;
+  }
+  if ((b = malloc(sizeof(arch_buf))) == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  if ((b -> data = malloc(cap)) == NULL) {
+    perror("malloc");
+    free(b);
+    return NULL;
+  }
+  b -> fd = fd;
+  b -> cap = cap;
+  b -> len = 0;
+  b -> iovcnt = 0;
+  b -> written = 0;
+  b -> pos = 0;
+  b -> reserved = 0;
+  /* stdout may come in partway into a file, >> or a shell group. with
+   * O_APPEND every write goes to the end whatever the offset says */
+  b -> start = lseek(fd, 0, (fcntl(fd, F_GETFL) & O_APPEND) ? SEEK_END : SEEK_CUR);
+  if (b -> start == -1) {
+    b -> start = 0;
+  }
+  io_trail_init(&b -> trail, fd, 1, b -> start);
+  return b;
+}
+
+/* write out every queued segment, 0 on success -1 on failure */
+int buf_flush(arch_buf *b) {
+  struct iovec *iov = b -> iov;
+  int iovcnt = b -> iovcnt;
+  ssize_t num_write;
+  uint64_t t0 = STATS_START(), calls = 0, before = b -> written;
+  while (iovcnt > 0) {
+    calls++;
+    if ((num_write = writev(b -> fd, iov, iovcnt)) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      perror("writev");
+      return -1;
+    }
+    b -> written += num_write;
+    io_trail_moved(&b -> trail, num_write);
+    /* step past whatever made it out, a short write can stop
+     * in the middle of a segment */
+    while (iovcnt > 0 && (size_t) num_write >= iov -> iov_len) {
+      num_write -= iov -> iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov -> iov_base = (uint8_t *) iov -> iov_base + num_write;
+      iov -> iov_len -= num_write;
+    }
+  }
+  b -> len = 0;
+  b -> iovcnt = 0;
+  if (calls) {
+    STATS_END(PH_WRITE, t0, calls, b -> written - before);
+  }
+  return 0;
+}
+
+/* most to move in one call, a window at a time when the archive is
+ * being dropped behind so it can keep up */
+static size_t step(off_t left) {
+  return io_nocache && left > IO_WINDOW ? IO_WINDOW : left;
+}
+
+/* empty the splice pipe of the left bytes still in it, through user
+ * space. with keep they go on to the archive, otherwise they are
+ * thrown away. returns how many made it to the archive */
+static ssize_t drain_pipe(arch_buf *b, ssize_t left, int keep) {
+  uint8_t chunk[ZERO_SIZE];
+  ssize_t n, m, got, moved = 0;
+  while (left > 0) {
+    if ((n = read(splice_pipe[0], chunk, left < ZERO_SIZE ? left : ZERO_SIZE)) <= 0) {
+      if (n == -1 && errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    left -= n;
+    for (got = 0; keep && got < n; got += m) {
+      if ((m = write(b -> fd, chunk + got, n - got)) == -1) {
+	if (errno == EINTR) {
+	  m = 0;
+	  continue;
+	}
+	perror("write");
+	keep = 0;
+	break;
+      }
+      moved += m;
+      b -> written += m;
+      b -> pos += m;
+      io_trail_moved(&b -> trail, m);
+    }
+  }
+  return moved;
+}
+
+/* the transfer behind buf_copy_fd, counting syscalls into *calls */
+static off_t copy_fd(arch_buf *b, int src_fd, off_t len, uint64_t *calls) {
+  off_t done = 0;
+  ssize_t n;
+
+  while (use_copy_range && done < len) {
+    ++*calls;
+    if ((n = copy_file_range(src_fd, NULL, b -> fd, NULL, step(len - done), 0)) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      if (!unsupported(errno)) {
+	perror("copy_file_range");
+	return done;
+      }
+      use_copy_range = 0;
+      break;
+    }
+    if (n == 0) {
+      return done;
+    }
+    done += n;
+    b -> written += n;
+    b -> pos += n;
+    io_trail_moved(&b -> trail, n);
+  }
+
+  while (use_sendfile && done < len) {
+    ++*calls;
+    if ((n = sendfile(b -> fd, src_fd, NULL, step(len - done))) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      if (!unsupported(errno)) {
+	perror("sendfile");
+	return done;
+      }
+      use_sendfile = 0;
+      break;
+    }
+    if (n == 0) {
+      return done;
+    }
+    done += n;
+    b -> written += n;
+    b -> pos += n;
+    io_trail_moved(&b -> trail, n);
+  }
+
+  if (use_splice && done < len && splice_pipe[0] == -1 && pipe(splice_pipe)) {
+    use_splice = 0;
+  }
+  while (use_splice && done < len) {
+    ++*calls;
+    if ((n = splice(src_fd, NULL, splice_pipe[1], NULL, step(len - done),
+		    SPLICE_F_MOVE)) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      if (!unsupported(errno)) {
+	perror("splice");
+	return done;
+      }
+      use_splice = 0;
+      break;
+    }
+    if (n == 0) {
+      return done;
+    }
+    /* drain the pipe completely so it is empty for the next call */
+    ssize_t left = n, m;
+    while (left > 0) {
+      ++*calls;
+      if ((m = splice(splice_pipe[0], NULL, b -> fd, NULL, left, SPLICE_F_MOVE)) == -1) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	if (!unsupported(errno)) {
+	  perror("splice");
+	  drain_pipe(b, left, 0);
+	  return -1;
+	}
+	/* the archive side won't take a splice (O_APPEND for one),
+	 * what is in the pipe goes the slow way and so does the rest */
+	use_splice = 0;
+	m = drain_pipe(b, left, 1);
+	done += m;
+	if (m < left) {
+	  return -1;
+	}
+	break;
+      }
+      left -= m;
+      done += m;
+      b -> written += m;
+      b -> pos += m;
+      io_trail_moved(&b -> trail, m);
+    }
+  }
+
+  return done;
+}
+
+/* move up to len bytes from the current position of src_fd to the
+ * archive without them passing through user space. tries
+ * copy_file_range, then sendfile, then splice through a pipe.
+ * returns the number of bytes moved (short on EOF or when every method
+ * is unsupported, the caller reads the rest), -1 on failure */
+off_t buf_copy_fd(arch_buf *b, int src_fd, off_t len) {
+  uint64_t t0, calls = 0;
+  off_t done;
+
+  /* everything queued so far has to land before the body does */
+  if (buf_flush(b)) {
+    return -1;
+  }
+  t0 = STATS_START();
+  done = copy_fd(b, src_fd, len, &calls);
+  STATS_END(PH_COPY, t0, calls, done > 0 ? done : 0);
+  return done;
+}
+
+/* free space at the end of the arena, flushing first if there is none.
+ * always leaves room for the segment buf_commit will need */
+uint8_t *buf_space(arch_buf *b, size_t *avail) {
+  if (b -> len == b -> cap || b -> iovcnt == ARCH_BUF_IOV) {
+    if (buf_flush(b)) {
+      return NULL;
+    }
+  }
+  *avail = b -> cap - b -> len;
+  return b -> data + b -> len;
+}
+
+/* queue n bytes that were filled in at buf_space */
+int buf_commit(arch_buf *b, size_t n) {
+  struct iovec *last;
+  if (n == 0) {
+    return 0;
+  }
+  last = b -> iovcnt > 0 ? &b -> iov[b -> iovcnt - 1] : NULL;
+  if (last && (uint8_t *) last -> iov_base + last -> iov_len == b -> data + b -> len) {
+    last -> iov_len += n;
+  } else {
+    b -> iov[b -> iovcnt].iov_base = b -> data + b -> len;
+    b -> iov[b -> iovcnt].iov_len = n;
+    b -> iovcnt++;
+  }
+  b -> len += n;
+  b -> pos += n;
+  return 0;
+}
+
+/* copy n bytes from src into the arena */
+int buf_append(arch_buf *b, const void *src, size_t n) {
+  uint8_t *dst;
+  size_t avail;
+  const uint8_t *from = src;
+  while (n > 0) {
+    if ((dst = buf_space(b, &avail)) == NULL) {
+      return -1;
+    }
+    if (avail > n) {
+      avail = n;
+    }
+    memcpy(dst, from, avail);
+    buf_commit(b, avail);
+    from += avail;
+    n -= avail;
+  }
+  return 0;
+}
+
+/* queue n bytes of zeros without copying anything */
+int buf_zeros(arch_buf *b, size_t n) {
+  size_t len;
+  while (n > 0) {
+    if (b -> iovcnt == ARCH_BUF_IOV && buf_flush(b)) {
+      return -1;
+    }
+    len = n < ZERO_SIZE ? n : ZERO_SIZE;
+    b -> iov[b -> iovcnt].iov_base = (void *) zeros;
+    b -> iov[b -> iovcnt].iov_len = len;
+    b -> iovcnt++;
+    b -> pos += len;
+    n -= len;
+  }
+  return 0;
+}
+
+/* allocate the next len bytes of the archive file in one go so the
+ * filesystem can lay it out in one piece. the size stays put, an
+ * O_APPEND stdout would otherwise write after the reservation.
+ * whatever isn't used is given back by buf_free. 1 if it was done, 0 if the fd isn't a plain
+ * file or the filesystem can't */
+int buf_reserve(arch_buf *b, off_t len) {
+  struct stat st;
+  off_t next = b -> start + b -> written;
+  int i;
+  /* the file offset the next queued byte lands at */
+  for (i = 0; i < b -> iovcnt; i++) {
+    next += b -> iov[i].iov_len;
+  }
+  if (len <= 0 || fstat(b -> fd, &st) || !S_ISREG(st.st_mode) ||
+      fallocate(b -> fd, FALLOC_FL_KEEP_SIZE, next, len)) {
+    return 0;
+  }
+  b -> reserved = 1;
+  return 1;
+}
+
+/* flush what is left and free the buffer, 0 on success -1 on failure */
+int buf_free(arch_buf *b) {
+  int err;
+  err = buf_flush(b);
+  /* the reservation may have overshot, the archive ends where the
+   * last write did */
+  if (b -> reserved && !err && ftruncate(b -> fd, b -> start + b -> written)) {
+    perror("ftruncate");
+    err = -1;
+  }
+  io_trail_end(&b -> trail, 1);
+  free(b -> data);
+  free(b);
+  return err;
+}
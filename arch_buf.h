@@ -0,0 +1,50 @@
+#ifndef ARCH_BUF
+#define ARCH_BUF
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "io_policy.h"
+
+#define ARCH_BUF_DEFAULT (4 << 20)
+#define ARCH_BUF_IOV 1024
+
+/* bodies smaller than this are cheaper to batch through the arena
+ * than to hand to the kernel one file at a time */
+#define ZERO_COPY_MIN (64 << 10)
+
+/* staging area for everything headed to the archive. headers and file
+ * data are collected in one big arena, padding points at a shared zero
+ * block, and the whole lot goes out in a single writev per flush */
+typedef struct arch_buf {
+  int fd;
+  uint8_t *data;
+  size_t cap;
+  size_t len;
+  struct iovec iov[ARCH_BUF_IOV];
+  int iovcnt;
+  off_t start;    /* file offset the first write went to, 0 for a pipe */
+  off_t written;
+  off_t pos;      /* archive offset of the next byte queued */
+  int reserved;   /* the file was grown ahead with buf_reserve */
+  io_trail trail; /* --no-cache, what we wrote leaves the cache */
+} arch_buf;
+
+arch_buf *buf_init(int fd, size_t cap);
+
+uint8_t *buf_space(arch_buf *b, size_t *avail);
+
+int buf_commit(arch_buf *b, size_t n);
+
+int buf_append(arch_buf *b, const void *src, size_t n);
+
+int buf_zeros(arch_buf *b, size_t n);
+
+int buf_flush(arch_buf *b);
+
+off_t buf_copy_fd(arch_buf *b, int src_fd, off_t len);
+
+int buf_reserve(arch_buf *b, off_t len);
+
+int buf_free(arch_buf *b);
+#endif
@@ -11,10 +11,15 @@
 #include <pwd.h>
 #include <grp.h>
 #include <errno.h>
+#include <sys/sysmacros.h>
+#include "id_cache.h"
+#include "arena.h"
+#include "chksum.h"
+#include "stats.h"
 
 
 #define UIDMAX 0x1FFFFF
-#define PATHMAX 256
+#define PATHMAX 4096
 
 #ifndef BITMASKS
 #define BITMASKS
@@ -26,10 +31,15 @@
 #define FMASK 0x01
 #endif
 
+// lengths of the string fields, none nul terminated when full
+#define NAME_LEN 100
+#define UGNAME_LEN 32
+#define PREFIX_LEN 155
+
 #ifndef HEADER
 #define HEADER
 typedef struct __attribute__((__packed__)) header {
-  uint8_t name[100];
+  uint8_t name[NAME_LEN];
   uint8_t mode[8];
   uint8_t uid[8];
   uint8_t gid[8];
@@ -40,88 +50,133 @@ typedef struct __attribute__((__packed__)) header {
   uint8_t linkname[100];
   uint8_t magic[6];
   uint8_t version[2];
-  uint8_t uname[32];
-  uint8_t gname[32];
+  uint8_t uname[UGNAME_LEN];
+  uint8_t gname[UGNAME_LEN];
   uint8_t devmajor[8];
   uint8_t devminor[8];
-  uint8_t prefix[155];
-  uint8_t pad[8];
+  uint8_t prefix[PREFIX_LEN];
+  uint8_t pad[12];
 } header;
 #endif
 
 
 
-// init name and prefix using path and header
+// init name and prefix using path and header. a path over 100 chars
+// is split at a '/' into prefix and name, one that can't be split
+// that way gets as much as fits and needs an extended header
 // return header on success NULL on failure
 header *init_name_pre(char *path, header *h) {
-  int len;
-  if ((len = strlen(path)) > 256) {
-    fprintf(stderr, "file path %s too long", path);
-    return NULL;
+  size_t len = strlen(path), i;
+  if (len <= sizeof(h -> name)) {
+    memcpy(h -> name, (uint8_t *) path, len);
+    return h;
   }
 
-  if (len <= 100) {
-    memcpy(h -> name, (uint8_t *) path, len);
-  } else {
-    memcpy(h -> prefix, (uint8_t *) path, len - 100);
-    memcpy(h -> name, (uint8_t *) path + (len - 100), 100);
+  /* the first '/' that leaves no more than 100 chars of name */
+  for (i = len - sizeof(h -> name) - 1; i <= sizeof(h -> prefix) && i + 1 < len; i++) {
+    if (path[i] == '/' && i > 0) {
+      memcpy(h -> prefix, (uint8_t *) path, i);
+      memcpy(h -> name, (uint8_t *) path + i + 1, len - i - 1);
+      return h;
+    }
   }
+  memcpy(h -> name, (uint8_t *) path, sizeof(h -> name));
   return h;
 }
 
-uint32_t extract_special_int(char *where, int len) {
-  /* For interoperability with GNU tar. GNU seems to
-   * set the high–order bit of the first byte, then
-   * treat the rest of the field as a binary integer
-   * in network byte order.
-   * I don’t know for sure if it’s a 32 or 64–bit int, but for
-   * this version, we’ll only support 32. (well, 31)
-   * returns the integer on success, –1 on failure.
-   * In spite of the name of htonl(), it converts int32 t
+int64_t extract_special_int(char *where, int len) {
+  /* For interoperability with GNU tar. GNU sets the
+   * high–order bit of the first byte, then treats the
+   * rest of the field as a binary integer in network
+   * byte order (base-256), whatever the field's width.
+   * The next bit down is the sign, negative values are
+   * not supported here.
+   * returns the integer on success, –1 on failure (not
+   * special, negative or more than 63 bits)
    */
-  int32_t val = -1;
-  if ((len >= sizeof(val)) && (where[0] & 0x80)) {
-    /* the top bit is set and we have space
-     * extract the last four bytes */
-    val = *(int32_t *)(where+len-sizeof(val));
-    val = ntohl(val); /* convert to host byte order */
+  uint64_t val;
+  int i;
+  if (len < 1 || !(where[0] & 0x80) || (where[0] & 0x40)) {
+    return -1;
   }
-  return val;
+  val = where[0] & 0x3f;
+  for (i = 1; i < len; i++) {
+    if (val >> 55) {
+      return -1;
+    }
+    val = val << 8 | (uint8_t) where[i];
+  }
+  return (int64_t) val;
 }
 
 
-int insert_special_int(char *where, size_t size, int32_t val) {
-  /* For interoperability with GNU tar. GNU seems to
-   * set the high–order bit of the first byte, then
-   * treat the rest of the field as a binary integer
-   * in network byte order.
-   * Insert the given integer into the given field
-   * using this technique. Returns 0 on success, nonzero
-   * otherwise
+int insert_special_int(char *where, size_t size, int64_t val) {
+  /* For interoperability with GNU tar. Insert the given
+   * integer into the given field base-256: the high–order
+   * bit of the first byte set and the value big endian in
+   * the rest. Returns 0 on success, nonzero otherwise
    */
-  int err=0;
-  if ( val < 0 || ( size < sizeof(val)) ) {
-    /* if it’s negative, bit 31 is set and we can’t use the flag
-     * if len is too small, we can’t write it. Either way, we’re
-     * done.
-     */
-    err++;
-  } else {
-    /* game on....*/
-    memset(where, 0, size); /* Clear out the buffer */
-    *(int32_t *)(where+size-sizeof(val)) = htonl(val); /* place the int*/
-    *where |= 0x80; /* set that high–order bit */
+  size_t i;
+  if (val < 0 || size < 2) {
+    /* negative values would need the sign bit */
+    return 1;
+  }
+  memset(where, 0, size); /* Clear out the buffer */
+  for (i = size - 1; i > 0; i--) {
+    where[i] = val & 0xff;
+    val >>= 8;
+  }
+  if (val > 0x3f) {
+    return 1;
   }
-  return err;
+  where[0] = 0x80 | val; /* set that high–order bit */
+  return 0;
+}
+
+// read a numeric field, octal digits or base-256, without needing it
+// to be terminated. returns the value, -1 if it is out of range
+int64_t get_num(uint8_t *field, size_t len) {
+  int64_t val = 0;
+  size_t i = 0;
+  if (field[0] & 0x80) {
+    return extract_special_int((char *) field, len);
+  }
+  while (i < len && field[i] == ' ') {
+    i++;
+  }
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    val = val << 3 | (field[i] - '0');
+  }
+  return val;
+}
+
+// write val into a numeric field, as octal when it fits in len - 1
+// digits and base-256 when it doesn't. 0 on success -1 on failure
+int put_num(uint8_t *field, size_t len, int64_t val) {
+  if (val >= 0 && (len - 1) * 3 < 63 && val < (int64_t) 1 << (3 * (len - 1))) {
+    if (snprintf((char *) field, len, "%0*lo", (int) len - 1, (unsigned long) val) < 0) {
+      perror("snprintf");
+      return -1;
+    }
+    return 0;
+  }
+  if (insert_special_int((char *) field, len, val)) {
+    fprintf(stderr, "insert_special_int: %lld doesn't fit\n", (long long) val);
+    return -1;
+  }
+  return 0;
 }
 
 
 // init stat given fields for header and others that use said fields
+// uses known_st when the caller already has it, lstats path otherwise
 // return header on success NULL on failure
-header *init_stat(char *path, header *h, uint8_t params) {
+header *init_stat(char *path, header *h, uint8_t params, struct stat *known_st) {
   // init stat-given fields
   struct stat st;
-  if (lstat(path, &st)) {
+  if (known_st) {
+    st = *known_st;
+  } else if (lstat(path, &st)) {
     perror("stat");
     return NULL;
   }
@@ -136,39 +191,32 @@ header *init_stat(char *path, header *h, uint8_t params) {
   }
   
   // uid
-  if (st.st_uid > UIDMAX) {
-    if (params & SMASK) {
-      fprintf(stderr, "UID too long, unable to create conforming header, skipping...\n");
-      return NULL;
-    }
-    if (insert_special_int((char *) (h -> uid), 8, st.st_uid)) {
-      fprintf(stderr, "insert_special_int");
-      return NULL;
-    }
-  } else {
-    if (snprintf((char *) (h -> uid), 8, "%07o", st.st_uid) < 0) {
-      perror("snprintf");
-      return NULL;
-    }
+  if (st.st_uid > UIDMAX && (params & SMASK)) {
+    fprintf(stderr, "UID too long, unable to create conforming header, skipping...\n");
+    return NULL;
+  }
+  if (put_num(h -> uid, sizeof(h -> uid), st.st_uid)) {
+    return NULL;
   }
   
   // gid
-  if (snprintf((char *) (h -> gid), 8, "%07o", st.st_gid) < 0) {
-    perror("snprintf");
+  if (st.st_gid > UIDMAX && (params & SMASK)) {
+    fprintf(stderr, "GID too long, unable to create conforming header, skipping...\n");
+    return NULL;
+  }
+  if (put_num(h -> gid, sizeof(h -> gid), st.st_gid)) {
     return NULL;
   }
 
-  // size
+  // size, past 8G it goes base-256 (and into an extended header)
   if (S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)) {
     strcat((char *) (h -> size), "00000000000");
-  } else if (snprintf((char *) (h -> size), 12, "%011o", st.st_size) < 0) {
-    perror("snprintf");
+  } else if (put_num(h -> size, sizeof(h -> size), st.st_size)) {
     return NULL;
   }
 
   // mtime
-  if (snprintf((char *) (h -> mtime), 12, "%o%o", st.st_mtim.tv_sec, st.st_mtim.tv_nsec) < 0) {
-    perror("snprintf");
+  if (put_num(h -> mtime, sizeof(h -> mtime), st.st_mtim.tv_sec < 0 ? 0 : st.st_mtim.tv_sec)) {
     return NULL;
   }
 
@@ -177,29 +225,26 @@ header *init_stat(char *path, header *h, uint8_t params) {
     (h -> typeflag)[0] = (uint8_t) '0';
   } else if (S_ISLNK(st.st_mode)) {
     (h -> typeflag)[0] = (uint8_t) '2';
-    if (readlink(path, (char *) (h -> linkname), 100) == -1) {
+    // a longer target is cut short here, the extended header has it all
+    char target[PATHMAX];
+    ssize_t n;
+    if ((n = readlink(path, target, sizeof(target))) == -1) {
       perror("readlink");
       return NULL;
     }
+    memcpy(h -> linkname, target, (size_t) n < sizeof(h -> linkname) ? (size_t) n : sizeof(h -> linkname));
   } else if (S_ISDIR(st.st_mode)) {
     (h -> typeflag)[0] = (uint8_t) '5';
   }
 
-  // uname
-  struct passwd *pw;
-  if ((pw = getpwuid(st.st_uid)) == NULL) {
-    perror("getpwuid");
-    return NULL;
-  }
-  memcpy(h -> uname, pw -> pw_name, strlen(pw -> pw_name));
+  // uname (left empty if the id has no name, the numeric uid is there)
+  char *name;
+  name = uid_to_name(st.st_uid);
+  memcpy(h -> uname, name, strnlen(name, sizeof(h -> uname)));
 
   // gname 
-  struct group *gr;
-  if ((gr = getgrgid(st.st_gid)) == NULL) {
-    perror("getgrgid");
-    return NULL;
-  }
-  memcpy(h -> gname, gr -> gr_name, strlen(gr -> gr_name));
+  name = gid_to_name(st.st_gid);
+  memcpy(h -> gname, name, strnlen(name, sizeof(h -> gname)));
 
   // dev major and minor
   if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
@@ -217,36 +262,11 @@ header *init_stat(char *path, header *h, uint8_t params) {
 }
 
 
-int sum_of_member(uint8_t member[], int size) {
-  int i, sum;
-  for (i = 0, sum = 0; i < size; i++) {
-    sum += member[i];
-  }
-  return sum;
-} 
-
 // init checksum field of a header
-// add all bytes and then 256 more for "spaces" 
+// all bytes with the checksum field itself counted as "spaces"
 header *init_chksum(header *h) {
   int sum;
-  sum = 0;
-  sum += sum_of_member(h -> name, 100);
-  sum += sum_of_member(h -> mode, 8);
-  sum += sum_of_member(h -> uid, 8);
-  sum += sum_of_member(h -> gid, 8);
-  sum += sum_of_member(h -> size, 12);
-  sum += sum_of_member(h -> mtime, 12);
-  sum += sum_of_member(h -> typeflag, 1);
-  sum += sum_of_member(h -> linkname, 100);
-  sum += sum_of_member(h -> magic, 6);
-  sum += sum_of_member(h -> version, 2);
-  sum += sum_of_member(h -> uname, 32);
-  sum += sum_of_member(h -> gname, 32);
-  sum += sum_of_member(h -> devmajor, 8);
-  sum += sum_of_member(h -> devminor, 8);
-  sum += sum_of_member(h -> prefix, 155);
-  sum += 256;
-  
+  sum = header_chksum((uint8_t *) h);
 
   if (snprintf((char *) (h -> chksum), 8, "%07o", sum) < 0) {
     perror("snprintf");
@@ -258,26 +278,16 @@ header *init_chksum(header *h) {
 
 
 // returns NULL on failure header on success
-header *create_header(char *fname, char *path, uint8_t params) {
-  header *h = malloc(sizeof(header));
+// the header comes out of the calling thread's arena, the caller rolls
+// the arena back when done with it instead of freeing
+header *create_header(char *fname, char *path, uint8_t params, struct stat *st) {
+  uint64_t t0 = STATS_START(), t1;
+  header *h;
+  if ((h = arena_alloc(thread_arena(), sizeof(header))) == NULL) {
+    return NULL;
+  }
   // init everything to nul first
-  memset(h -> name, '\0', 100);
-  memset(h -> mode, '\0', 8);
-  memset(h -> uid, '\0', 8);
-  memset(h -> gid, '\0', 8);
-  memset(h -> size, '\0', 12);
-  memset(h -> mtime, '\0', 12);
-  memset(h -> chksum, '\0', 8);
-  memset(h -> typeflag, '\0', 1);
-  memset(h -> linkname, '\0', 100);
-  memset(h -> magic, '\0', 6);
-  memset(h -> version, '\0', 2);
-  memset(h -> uname, '\0', 32);
-  memset(h -> gname, '\0', 32);
-  memset(h -> devmajor, '\0', 8);
-  memset(h -> devminor, '\0', 8);
-  memset(h -> prefix, '\0', 155);
-  memset(h -> pad, '\0', 8);
+  memset(h, '\0', sizeof(header));
     
   // name and prefix
   if (init_name_pre(path, h) == NULL) {
@@ -285,9 +295,11 @@ header *create_header(char *fname, char *path, uint8_t params) {
   }
   
   // fields that use stat values
-  if (init_stat(fname, h, params) == NULL) {
+  t1 = STATS_START();
+  if (init_stat(fname, h, params, st) == NULL) {
     return NULL;
   }
+  STATS_END(PH_META, t1, st ? 0 : 1, 0);
 
   // magic
   strcat((char *) (h -> magic), "ustar");
@@ -297,32 +309,66 @@ header *create_header(char *fname, char *path, uint8_t params) {
   (h -> version)[1] = '0';
   
   // now check sum
+  t1 = STATS_START();
+  init_chksum(h);
+  STATS_END(PH_CHKSUM, t1, 0, sizeof(header));
+
+  STATS_END(PH_HEADER, t0, 0, sizeof(header));
+  return h;
+}
+
+// header for path as a hard link to target, which is already in the
+// archive. the link has no body, it shares target's. a target over
+// 100 chars is cut short, the extended header has it all
+// returns NULL on failure header on success, from the arena like
+// create_header
+header *create_link_header(char *fname, char *path, char *target, uint8_t params, struct stat *st) {
+  header *h;
+  size_t len = strlen(target);
+  if (len > sizeof(h -> linkname)) {
+    len = sizeof(h -> linkname);
+  }
+  if ((h = create_header(fname, path, params, st)) == NULL) {
+    return NULL;
+  }
+  (h -> typeflag)[0] = (uint8_t) '1';
+  memset(h -> size, '\0', sizeof(h -> size));
+  strcat((char *) (h -> size), "00000000000");
+  memset(h -> linkname, '\0', sizeof(h -> linkname));
+  memcpy(h -> linkname, target, len);
   init_chksum(h);
-  
   return h;
 }
 
+// a copy of h under another name, type and size, for the extra
+// headers in front of a member (pax extended headers and the like)
+// returns NULL on failure header on success, from the arena like
+// create_header
+header *derive_header(header *h, char *name, char type, off_t size) {
+  header *d;
+  if ((d = arena_alloc(thread_arena(), sizeof(header))) == NULL) {
+    return NULL;
+  }
+  memcpy(d, h, sizeof(header));
+  memset(d -> name, '\0', sizeof(d -> name));
+  memset(d -> prefix, '\0', sizeof(d -> prefix));
+  memset(d -> linkname, '\0', sizeof(d -> linkname));
+  if (init_name_pre(name, d) == NULL) {
+    return NULL;
+  }
+  (d -> typeflag)[0] = (uint8_t) type;
+  if (put_num(d -> size, sizeof(d -> size), size)) {
+    return NULL;
+  }
+  init_chksum(d);
+  return d;
+}
+
 /* check if header is valid, valid -> return 0
  * else return -> -1 */
 int check_valid(header *h, uint8_t params) {
   int sum;
-  sum = 0;
-  sum += sum_of_member(h -> name, 100);
-  sum += sum_of_member(h -> mode, 8);
-  sum += sum_of_member(h -> uid, 8);
-  sum += sum_of_member(h -> gid, 8);
-  sum += sum_of_member(h -> size, 12);
-  sum += sum_of_member(h -> mtime, 12);
-  sum += sum_of_member(h -> typeflag, 1);
-  sum += sum_of_member(h -> linkname, 100);
-  sum += sum_of_member(h -> magic, 6);
-  sum += sum_of_member(h -> version, 2);
-  sum += sum_of_member(h -> uname, 32);
-  sum += sum_of_member(h -> gname, 32);
-  sum += sum_of_member(h -> devmajor, 8);
-  sum += sum_of_member(h -> devminor, 8);
-  sum += sum_of_member(h -> prefix, 155);
-  sum += 256;
+  sum = header_chksum((uint8_t *) h);
 
   /* check sum and magic number */
   if (strtol((char *) (h -> chksum), NULL, 8) != sum) {
@@ -352,12 +398,14 @@ int check_valid(header *h, uint8_t params) {
 
 char *get_str_perm(header *h) {
   static char perms[11];
-  int mode = strtol((char *) (h -> mode), NULL, 8);
+  int mode = get_num(h -> mode, sizeof(h -> mode));
   /* type */
   if ((char)(h -> typeflag)[0] == '5') {
     perms[0] = 'd';
   } else if ((char)(h -> typeflag)[0] == '2') {
     perms[0] = 'l';
+  } else if ((char)(h -> typeflag)[0] == '1') {
+    perms[0] = 'h';
   } else {
     perms[0] = '-';
   }
@@ -417,13 +465,30 @@ char *get_str_perm(header *h) {
   return perms;
 }
 
-/* get user and groupname as one string */
+// tack the len byte field onto the end of dst, up to its nul if it
+// has one
+static void append_field(char *dst, uint8_t *field, size_t len) {
+  size_t used = strlen(dst), n = strnlen((char *) field, len);
+  memcpy(dst + used, field, n);
+  dst[used + n] = '\0';
+}
+
+/* get user and groupname as one string, falling back on the
+ * numeric ids when the archive has no names for them */
 char *get_str_ugname(header *h) {
-  static char ugname[64];
-  memset(ugname, '\0', 64);
-  strcat(ugname, (char *) (h -> uname));
+  static char ugname[80];
+  memset(ugname, '\0', sizeof(ugname));
+  if ((h -> uname)[0]) {
+    append_field(ugname, h -> uname, UGNAME_LEN);
+  } else {
+    snprintf(ugname, 21, "%lld", (long long) get_num(h -> uid, sizeof(h -> uid)));
+  }
   strcat(ugname, "/");
-  strcat(ugname, (char *) (h -> gname));
+  if ((h -> gname)[0]) {
+    append_field(ugname, h -> gname, UGNAME_LEN);
+  } else {
+    snprintf(ugname + strlen(ugname), 21, "%lld", (long long) get_num(h -> gid, sizeof(h -> gid)));
+  }
   return ugname;
 }
 
@@ -432,7 +497,7 @@ char *get_str_mtime(header *h) {
   time_t seconds;
   struct tm *time;
   static char mtime[17];
-  seconds = (time_t) strtol((char *) (h -> mtime), NULL, 8);
+  seconds = (time_t) get_num(h -> mtime, sizeof(h -> mtime));
   time = localtime(&seconds);
   strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", time);
   return mtime;
@@ -442,8 +507,12 @@ char *get_str_mtime(header *h) {
 char *get_str_fname(header *h) {
   static char fname[PATHMAX];
   memset(fname, '\0', PATHMAX);
-  strcat(fname, (char *) (h -> prefix));
-  strcat(fname, (char *) (h -> name));
+  /* neither field has to be nul terminated when full */
+  append_field(fname, h -> prefix, PREFIX_LEN);
+  if (fname[0]) {
+    strcat(fname, "/");
+  }
+  append_field(fname, h -> name, NAME_LEN);
   return fname;
 }
 
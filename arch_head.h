@@ -1,6 +1,10 @@
 #ifndef ARCH_HEAD
 #define ARCH_HEAD
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
 #ifndef HEADER
 #define HEADER
 typedef struct __attribute__((__packed__)) header {
@@ -10,7 +14,7 @@ typedef struct __attribute__((__packed__)) header {
   uint8_t gid[8];
   uint8_t size[12];
   uint8_t mtime[12];
-  uint8_t chksum[12];
+  uint8_t chksum[8];
   uint8_t typeflag[1];
   uint8_t linkname[100];
   uint8_t magic[6];
@@ -20,14 +24,25 @@ typedef struct __attribute__((__packed__)) header {
   uint8_t devmajor[8];
   uint8_t devminor[8];
   uint8_t prefix[155];
-  uint8_t pad[8];
+  uint8_t pad[12];
 } header;
 #endif
 
-header *create_header(char *fname, char *path, uint8_t params);
+header *create_header(char *fname, char *path, uint8_t params, struct stat *st);
+
+header *create_link_header(char *fname, char *path, char *target, uint8_t params, struct stat *st);
+
+header *derive_header(header *h, char *name, char type, off_t size);
 
 int check_valid(header *h, uint8_t params);
 
+int64_t get_num(uint8_t *field, size_t len);
+
+int put_num(uint8_t *field, size_t len, int64_t val);
+
+/* a numeric field of h, octal or base-256 */
+#define HEADER_NUM(h, field) get_num((h) -> field, sizeof((h) -> field))
+
 char *get_str_perm(header *h);
 
 char *get_str_ugname(header *h);
@@ -0,0 +1,332 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "arch_index.h"
+
+#define PATHMAX 4096
+#define BLOCK_SIZE 512
+
+/* names the qsort comparator resolves name_off against */
+static char *sort_names;
+
+/* by name, then copies of one name (u and r add them) in archive order */
+static int rec_cmp(const void *a, const void *b) {
+  const index_rec *x = a, *y = b;
+  int c = strcmp(sort_names + x -> name_off, sort_names + y -> name_off);
+  if (c) {
+    return c;
+  }
+  return (x -> offset > y -> offset) - (x -> offset < y -> offset);
+}
+
+static int off_cmp(const void *a, const void *b) {
+  off_t x = *(off_t *) a, y = *(off_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* build the sidecar file name for arch_name into buff */
+static int index_name(char *arch_name, char *buff, size_t len) {
+  if (snprintf(buff, len, "%s%s", arch_name, INDEX_SUFFIX) >= (int) len) {
+    fprintf(stderr, "%s: archive name too long for an index\n", arch_name);
+    return -1;
+  }
+  return 0;
+}
+
+/* returns an empty index to add members to, NULL on failure */
+arch_index *index_new(void) {
+  arch_index *ix;
+  if ((ix = calloc(1, sizeof(arch_index))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  return ix;
+}
+
+/* record one member, 0 on success -1 on failure */
+int index_add(arch_index *ix, char *name, off_t offset, off_t size, uint8_t type, time_t mtime) {
+  size_t len = strlen(name);
+  if (ix -> count == ix -> cap) {
+    ix -> cap = ix -> cap ? ix -> cap * 2 : 1024;
+    if ((ix -> recs = realloc(ix -> recs, ix -> cap * sizeof(index_rec))) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+  }
+  if (ix -> names_len + len + 1 > ix -> names_cap) {
+    ix -> names_cap = ix -> names_cap ? ix -> names_cap * 2 : 64 * 1024;
+    while (ix -> names_len + len + 1 > ix -> names_cap) {
+      ix -> names_cap *= 2;
+    }
+    if ((ix -> names = realloc(ix -> names, ix -> names_cap)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+  }
+
+  index_rec *rec = &ix -> recs[ix -> count++];
+  rec -> offset = offset;
+  rec -> size = size;
+  rec -> mtime = mtime;
+  rec -> name_off = ix -> names_len;
+  rec -> name_len = len;
+  rec -> type = type;
+  rec -> pad = 0;
+  memcpy(ix -> names + ix -> names_len, name, len + 1);
+  ix -> names_len += len + 1;
+  return 0;
+}
+
+/* sort the members being built up by name, the order lookups need */
+void index_sort(arch_index *ix) {
+  sort_names = ix -> names;
+  qsort(ix -> recs, ix -> count, sizeof(index_rec), rec_cmp);
+}
+
+/* sort the members by name and write them next to arch_name, which
+ * must be complete by now. 0 on success -1 on failure */
+int index_write(arch_index *ix, char *arch_name) {
+  char idx_name[PATHMAX + 8], tmp_name[PATHMAX + 16];
+  struct stat st;
+  index_head head;
+  FILE *fp;
+
+  if (index_name(arch_name, idx_name, sizeof(idx_name))) {
+    return -1;
+  }
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", idx_name);
+  if (stat(arch_name, &st)) {
+    perror("index stat");
+    return -1;
+  }
+
+  index_sort(ix);
+
+  memset(&head, '\0', sizeof(head));
+  memcpy(head.magic, INDEX_MAGIC, sizeof(head.magic));
+  head.version = INDEX_VERSION;
+  head.count = ix -> count;
+  head.arch_size = st.st_size;
+  head.arch_mtime_sec = st.st_mtim.tv_sec;
+  head.arch_mtime_nsec = st.st_mtim.tv_nsec;
+  head.arch_ino = st.st_ino;
+  head.names_len = ix -> names_len;
+
+  if ((fp = fopen(tmp_name, "w")) == NULL) {
+    perror(tmp_name);
+    return -1;
+  }
+  if (fwrite(&head, sizeof(head), 1, fp) != 1 ||
+      fwrite(ix -> recs, sizeof(index_rec), ix -> count, fp) != ix -> count ||
+      fwrite(ix -> names, 1, ix -> names_len, fp) != ix -> names_len) {
+    perror("index write");
+    fclose(fp);
+    unlink(tmp_name);
+    return -1;
+  }
+  if (fclose(fp)) {
+    perror("index close");
+    unlink(tmp_name);
+    return -1;
+  }
+  /* only ever replace a good index with another good index */
+  if (rename(tmp_name, idx_name)) {
+    perror("index rename");
+    unlink(tmp_name);
+    return -1;
+  }
+  return 0;
+}
+
+/* every record of the mapped index at map has its name, nul terminated,
+ * inside the names and its header inside an archive of arch_size bytes.
+ * the head has already been checked against the file size */
+static int recs_valid(void *map, uint64_t arch_size) {
+  index_head *head = map;
+  index_rec *recs = (index_rec *) ((char *) map + sizeof(index_head));
+  char *names = (char *) (recs + head -> count);
+  uint32_t r;
+  for (r = 0; r < head -> count; r++) {
+    if ((uint64_t) recs[r].name_off + recs[r].name_len >= head -> names_len ||
+	names[recs[r].name_off + recs[r].name_len] != '\0' ||
+	recs[r].offset > arch_size || arch_size - recs[r].offset < BLOCK_SIZE) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* map the index sitting next to arch_name. returns NULL (quietly) if
+ * there isn't one, it doesn't belong to the archive as it is now or
+ * anything in it points outside of where it should, the caller scans
+ * the archive instead */
+arch_index *index_load(char *arch_name) {
+  char idx_name[PATHMAX + 8];
+  struct stat arch_st, idx_st;
+  index_head *head;
+  arch_index *ix;
+  int fd;
+  void *map;
+
+  if (index_name(arch_name, idx_name, sizeof(idx_name))) {
+    return NULL;
+  }
+  if (stat(arch_name, &arch_st) || (fd = open(idx_name, O_RDONLY)) == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &idx_st) || idx_st.st_size < (off_t) sizeof(index_head)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, idx_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  head = map;
+  if (memcmp(head -> magic, INDEX_MAGIC, sizeof(head -> magic)) ||
+      head -> version != INDEX_VERSION ||
+      head -> arch_size != (uint64_t) arch_st.st_size ||
+      head -> arch_mtime_sec != arch_st.st_mtim.tv_sec ||
+      head -> arch_mtime_nsec != arch_st.st_mtim.tv_nsec ||
+      head -> arch_ino != (uint64_t) arch_st.st_ino ||
+      head -> names_len > (uint64_t) idx_st.st_size ||
+      sizeof(index_head) + (uint64_t) head -> count * sizeof(index_rec) + head -> names_len
+      != (uint64_t) idx_st.st_size ||
+      !recs_valid(map, (uint64_t) arch_st.st_size)) {
+    munmap(map, idx_st.st_size);
+    return NULL;
+  }
+  madvise(map, idx_st.st_size, MADV_RANDOM);
+
+  if ((ix = index_new()) == NULL) {
+    munmap(map, idx_st.st_size);
+    return NULL;
+  }
+  ix -> map = map;
+  ix -> map_len = idx_st.st_size;
+  ix -> count = head -> count;
+  ix -> recs = (index_rec *) ((char *) map + sizeof(index_head));
+  ix -> names = (char *) (ix -> recs + ix -> count);
+  ix -> names_len = head -> names_len;
+  return ix;
+}
+
+/* first record whose name is >= key */
+static uint32_t lower_bound(arch_index *ix, char *key) {
+  uint32_t lo = 0, hi = ix -> count, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(ix -> names + ix -> recs[mid].name_off, key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* offset just past the last member, where the EOA starts */
+off_t index_end(arch_index *ix) {
+  off_t end = 0, e;
+  uint32_t r;
+  for (r = 0; r < ix -> count; r++) {
+    e = ix -> recs[r].offset + BLOCK_SIZE +
+      (ix -> recs[r].size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (e > end) {
+      end = e;
+    }
+  }
+  return end;
+}
+
+/* mtime of the newest copy of name in the archive, -1 if it has none.
+ * the index has to be sorted */
+time_t index_newest(arch_index *ix, char *name) {
+  time_t newest = -1;
+  uint32_t r;
+  for (r = lower_bound(ix, name); r < ix -> count &&
+	 strcmp(ix -> names + ix -> recs[r].name_off, name) == 0; r++) {
+    if (ix -> recs[r].mtime > newest) {
+      newest = ix -> recs[r].mtime;
+    }
+  }
+  return newest;
+}
+
+/* collect the header offsets of every member named in LOF and all of
+ * their decendents, in archive order and without repeats. *offs is
+ * malloc'd for the caller. returns the count or -1 on failure */
+int index_select(arch_index *ix, char **LOF, int size, off_t **offs) {
+  int n = 0, cap = 64, i;
+  uint32_t r;
+  size_t len;
+  char key[PATHMAX + 1];
+  char *name;
+
+  if ((*offs = malloc(cap * sizeof(off_t))) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i < size; i++) {
+    len = strlen(LOF[i]);
+    if (len == 0 || len >= PATHMAX) {
+      continue;
+    }
+    memcpy(key, LOF[i], len + 1);
+
+    /* the member itself, every copy of it */
+    for (r = lower_bound(ix, key); r < ix -> count &&
+	   strcmp(ix -> names + ix -> recs[r].name_off, key) == 0; r++) {
+      if (n == cap) {
+	cap *= 2;
+	*offs = realloc(*offs, cap * sizeof(off_t));
+      }
+      (*offs)[n++] = ix -> recs[r].offset;
+    }
+
+    /* everything under it (directory entries themselves end in '/'
+     * so they land in this range too) */
+    if (key[len - 1] != '/') {
+      key[len++] = '/';
+      key[len] = '\0';
+    }
+    for (r = lower_bound(ix, key); r < ix -> count; r++) {
+      name = ix -> names + ix -> recs[r].name_off;
+      if (strncmp(name, key, len) != 0) {
+	break;
+      }
+      if (n == cap) {
+	cap *= 2;
+	*offs = realloc(*offs, cap * sizeof(off_t));
+      }
+      (*offs)[n++] = ix -> recs[r].offset;
+    }
+  }
+
+  qsort(*offs, n, sizeof(off_t), off_cmp);
+  int j = 0;
+  for (i = 0; i < n; i++) {
+    if (j == 0 || (*offs)[j - 1] != (*offs)[i]) {
+      (*offs)[j++] = (*offs)[i];
+    }
+  }
+  return j;
+}
+
+void index_free(arch_index *ix) {
+  if (ix -> map) {
+    munmap(ix -> map, ix -> map_len);
+  } else {
+    free(ix -> recs);
+    free(ix -> names);
+  }
+  free(ix);
+}
@@ -0,0 +1,65 @@
+#ifndef ARCH_INDEX
+#define ARCH_INDEX
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define INDEX_MAGIC "MYTARIDX"
+#define INDEX_VERSION 2
+#define INDEX_SUFFIX ".idx"
+
+/* on disk layout of <archive>.idx, host byte order:
+ * index_head, count index_recs sorted by name, then the names
+ * themselves nul terminated. arch_* pin the index to the exact
+ * archive it was written for */
+typedef struct index_head {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t arch_size;
+  int64_t arch_mtime_sec;
+  int64_t arch_mtime_nsec;
+  uint64_t arch_ino;
+  uint64_t names_len;
+} index_head;
+
+typedef struct index_rec {
+  uint64_t offset;   /* of the header, the body follows it */
+  uint64_t size;
+  int64_t mtime;
+  uint32_t name_off;
+  uint16_t name_len;
+  uint8_t type;
+  uint8_t pad;
+} index_rec;
+
+typedef struct arch_index {
+  /* loaded from disk (mapped) or being built up by c */
+  void *map;
+  size_t map_len;
+  index_rec *recs;
+  char *names;
+  uint32_t count;
+  uint32_t cap;
+  uint64_t names_len;
+  uint64_t names_cap;
+} arch_index;
+
+arch_index *index_new(void);
+
+int index_add(arch_index *ix, char *name, off_t offset, off_t size, uint8_t type, time_t mtime);
+
+void index_sort(arch_index *ix);
+
+off_t index_end(arch_index *ix);
+
+time_t index_newest(arch_index *ix, char *name);
+
+int index_write(arch_index *ix, char *arch_name);
+
+arch_index *index_load(char *arch_name);
+
+int index_select(arch_index *ix, char **LOF, int size, off_t **offs);
+
+void index_free(arch_index *ix);
+#endif
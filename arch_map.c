@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "arch_map.h"
+#include "stats.h"
+
+static const uint8_t nul_block[BLOCK_SIZE];
+
+static ssize_t refill(arch_map *m);
+
+/* from here on read the tar stream coming out of the gunzip thread */
+static void gz_switch(arch_map *m) {
+  /* the gunzip thread reads the file now */
+  io_trail_end(&m -> trail, 0);
+  m -> raw_fd = m -> fd;
+  m -> fd = gunzip_fd(m -> gz);
+  m -> buf_pos = m -> buf_len = 0;
+  m -> eof = 0;
+}
+
+/* map arch_name and tell the kernel how we are going to walk it
+ * (MADV_SEQUENTIAL for full scans, MADV_RANDOM for lookups), or set
+ * up a stream if it is "-" or can't be mapped
+ * returns the map on success NULL on failure */
+arch_map *map_open(char *arch_name, int advice) {
+  arch_map *m;
+  struct stat st;
+  if ((m = calloc(1, sizeof(arch_map))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  m -> trail.fd = -1;
+  if (strcmp(arch_name, "-") == 0) {
+    m -> fd = STDIN_FILENO;
+  } else if ((m -> fd = open(arch_name, O_RDONLY)) == -1) {
+    perror("map open");
+    free(m);
+    return NULL;
+  }
+  if (fstat(m -> fd, &st)) {
+    perror("fstat");
+    map_close(m);
+    return NULL;
+  }
+
+  m -> size = st.st_size;
+  if (S_ISREG(st.st_mode)) {
+    if (m -> size == 0) {
+      return m;
+    }
+    if ((m -> base = mmap(NULL, m -> size, PROT_READ, MAP_SHARED, m -> fd, 0)) != MAP_FAILED) {
+      if (m -> size >= 2 && GZ_MAGIC(m -> base)) {
+	/* inflate straight out of the mapping */
+	madvise(m -> base, m -> size, MADV_SEQUENTIAL);
+	if ((m -> buf = malloc(STREAM_BUF)) == NULL ||
+	    (m -> gz = gunzip_start(-1, m -> base, m -> size)) == NULL) {
+	  map_close(m);
+	  return NULL;
+	}
+	m -> stream = 1;
+	gz_switch(m);
+      } else if (madvise(m -> base, m -> size, advice)) {
+	perror("madvise");
+      }
+      return m;
+    }
+    m -> base = NULL;
+  }
+
+  m -> stream = 1;
+  if ((m -> buf = malloc(STREAM_BUF)) == NULL) {
+    perror("malloc");
+    map_close(m);
+    return NULL;
+  }
+  io_trail_init(&m -> trail, m -> fd, 0, 0);
+  while (m -> buf_len < 2 && !m -> eof) {
+    if (refill(m) == -1) {
+      map_close(m);
+      return NULL;
+    }
+  }
+  if (m -> buf_len >= 2 && GZ_MAGIC(m -> buf)) {
+    if ((m -> gz = gunzip_start(m -> fd, m -> buf, m -> buf_len)) == NULL) {
+      map_close(m);
+      return NULL;
+    }
+    gz_switch(m);
+  }
+  return m;
+}
+
+/* read more of the stream into buf, keeping what is left unread
+ * returns bytes added, 0 at EOF, -1 on failure */
+static ssize_t refill(arch_map *m) {
+  ssize_t n;
+  if (m -> buf_pos > 0) {
+    memmove(m -> buf, m -> buf + m -> buf_pos, m -> buf_len - m -> buf_pos);
+    m -> buf_len -= m -> buf_pos;
+    m -> buf_pos = 0;
+  }
+  while ((n = read(m -> fd, m -> buf + m -> buf_len, STREAM_BUF - m -> buf_len)) == -1) {
+    if (errno != EINTR) {
+      perror("read");
+      return -1;
+    }
+  }
+  if (n == 0) {
+    m -> eof = 1;
+  }
+  m -> buf_len += n;
+  io_trail_moved(&m -> trail, n);
+  return n;
+}
+
+/* move the stream forward to archive offset off, 0 on success */
+static int skip_to(arch_map *m, off_t off) {
+  off_t left = off - m -> pos;
+  size_t have = m -> buf_len - m -> buf_pos;
+  ssize_t n;
+  static int null_fd = -2;
+
+  if (left < 0) {
+    fprintf(stderr, "can't seek backwards in a stream\n");
+    return -1;
+  }
+  if ((off_t) have >= left) {
+    m -> buf_pos += left;
+    m -> pos = off;
+    return 0;
+  }
+  /* whatever is buffered goes first */
+  left -= have;
+  m -> pos += have;
+  m -> buf_pos = m -> buf_len = 0;
+
+  /* a seekable stdin can just jump, a pipe gets spliced into
+   * /dev/null, and failing both we read through the buffer */
+  if (lseek(m -> fd, left, SEEK_CUR) != -1) {
+    m -> pos += left;
+    return 0;
+  }
+  if (null_fd == -2) {
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  }
+  while (left > 0 && null_fd >= 0 &&
+	 (n = splice(m -> fd, NULL, null_fd, NULL, left, SPLICE_F_MOVE)) > 0) {
+    left -= n;
+    m -> pos += n;
+  }
+  while (left > 0) {
+    if ((n = refill(m)) <= 0) {
+      return -1;
+    }
+    if ((off_t) m -> buf_len > left) {
+      m -> buf_pos = left;
+      m -> pos += left;
+      return 0;
+    }
+    left -= m -> buf_len;
+    m -> pos += m -> buf_len;
+    m -> buf_pos = m -> buf_len = 0;
+  }
+  return 0;
+}
+
+/* pointer to len (<= STREAM_BUF) bytes at off, or NULL at EOF */
+static uint8_t *stream_at(arch_map *m, off_t off, size_t len) {
+  if (skip_to(m, off)) {
+    return NULL;
+  }
+  while (m -> buf_len - m -> buf_pos < len) {
+    if (m -> eof || refill(m) <= 0) {
+      return NULL;
+    }
+  }
+  return m -> buf + m -> buf_pos;
+}
+
+/* copy up to len bytes of the archive at off into dst. a stream can
+ * only be read forward. returns bytes copied, 0 at EOF, -1 on failure */
+ssize_t map_read(arch_map *m, off_t off, uint8_t *dst, size_t len) {
+  if (!m -> stream) {
+    if (off >= m -> size) {
+      return 0;
+    }
+    if ((off_t) len > m -> size - off) {
+      len = m -> size - off;
+    }
+    memcpy(dst, m -> base + off, len);
+    return len;
+  }
+
+  if (skip_to(m, off)) {
+    return -1;
+  }
+  if (m -> buf_pos == m -> buf_len && refill(m) <= 0) {
+    return m -> eof ? 0 : -1;
+  }
+  if (len > m -> buf_len - m -> buf_pos) {
+    len = m -> buf_len - m -> buf_pos;
+  }
+  memcpy(dst, m -> buf + m -> buf_pos, len);
+  m -> buf_pos += len;
+  m -> pos += len;
+  return len;
+}
+
+/* 1 if h only says something about the member after it */
+static int is_ext(header *h) {
+  return h -> typeflag[0] == 'x' || h -> typeflag[0] == 'g' ||
+    h -> typeflag[0] == 'L' || h -> typeflag[0] == 'K';
+}
+
+/* read the extended header h at *off into m -> pax and step past it
+ * 0 on success -1 on failure */
+static int read_pax(arch_map *m, off_t *off, header *h) {
+  off_t len = HEADER_NUM(h, size);
+  uint8_t *body;
+  if (len < 0 || len > PAX_MAX) {
+    fprintf(stderr, "extended header too big\n");
+    return -1;
+  }
+  if (m -> stream) {
+    body = stream_at(m, *off + BLOCK_SIZE, len);
+  } else {
+    body = *off + BLOCK_SIZE + len > m -> size ? NULL : m -> base + *off + BLOCK_SIZE;
+  }
+  if (body == NULL) {
+    fprintf(stderr, "archive ended without EOA\n");
+    return -1;
+  }
+  /* a global header ('g') only sets defaults we don't use */
+  if ((h -> typeflag)[0] == 'x' && pax_parse(body, len, &m -> pax)) {
+    fprintf(stderr, "bad extended header\n");
+    return -1;
+  }
+  if ((h -> typeflag)[0] == 'L' || (h -> typeflag)[0] == 'K') {
+    pax_long_name(body, len, (h -> typeflag)[0] == 'L' ? m -> pax.name : m -> pax.linkname);
+    m -> pax.present = 1;
+  }
+  *off += BLOCK_SIZE + BLOCK_ROUND(len);
+  return 0;
+}
+
+/* point h at the header at off, checked
+ * 1 for a header, 0 at the end of archive, -1 on failure */
+static int header_at(arch_map *m, off_t off, header **h, uint8_t params) {
+  uint8_t *second;
+  if (m -> stream) {
+    *h = (header *) stream_at(m, off, BLOCK_SIZE);
+  } else {
+    *h = off + BLOCK_SIZE > m -> size ? NULL : (header *) (m -> base + off);
+  }
+  if (*h == NULL) {
+    fprintf(stderr, "archive ended without EOA\n");
+    return -1;
+  }
+
+  /* if we are at EOA then quit successfully, a lone zero block
+   * right at the end of the file is taken as EOA too */
+  if (memcmp(*h, nul_block, BLOCK_SIZE) == 0) {
+    if (m -> stream) {
+      second = stream_at(m, off, 2 * BLOCK_SIZE);
+      second = second ? second + BLOCK_SIZE : NULL;
+    } else {
+      second = off + 2 * BLOCK_SIZE > m -> size ? NULL : m -> base + off + BLOCK_SIZE;
+    }
+    if (second == NULL || memcmp(second, nul_block, BLOCK_SIZE) == 0) {
+      return 0;
+    }
+    fprintf(stderr, "bad header: lost and quiting...\n");
+    return -1;
+  }
+
+  /* if bad header then we are lost so quit */
+  if (check_valid(*h, params)) {
+    fprintf(stderr, "bad header: lost and quiting...\n");
+    return -1;
+  }
+  return 1;
+}
+
+/* point h at the header found at *off and step *off past its body.
+ * extended headers are read into m -> pax on the way and h is left on
+ * the member they describe, with m -> pax.present clear if it has none.
+ * returns 1 for a member, 0 at the end of archive, -1 if the archive
+ * is damaged and we are lost. when streaming h is only good until the
+ * next call */
+int map_next(arch_map *m, off_t *off, header **h, uint8_t params) {
+  uint64_t t0 = STATS_START();
+  int ret;
+  pax_clear(&m -> pax);
+  while ((ret = header_at(m, *off, h, params)) == 1 && is_ext(*h)) {
+    if (read_pax(m, off, *h)) {
+      return -1;
+    }
+  }
+  if (ret != 1) {
+    return ret;
+  }
+
+  m -> body = *off + BLOCK_SIZE;
+  m -> body_size = m -> pax.size >= 0 ? m -> pax.size : HEADER_NUM(*h, size);
+  if (m -> body_size < 0) {
+    fprintf(stderr, "bad header: lost and quiting...\n");
+    return -1;
+  }
+  *off += BLOCK_SIZE + BLOCK_ROUND(m -> body_size);
+  STATS_END(PH_SCAN, t0, 1, BLOCK_SIZE);
+  return 1;
+}
+
+/* nothing before off is going to be looked at again. with --no-cache
+ * a mapped archive is dropped from the page cache behind off a window
+ * at a time, and the kernel is asked for the window after it */
+void map_release(arch_map *m, off_t off) {
+  off_t from, to;
+  if (!io_nocache || m -> base == NULL || m -> stream) {
+    return;
+  }
+  if (off + IO_WINDOW > m -> ahead) {
+    from = off > m -> ahead ? off : m -> ahead;
+    io_willneed(m -> fd, from, IO_WINDOW);
+    m -> ahead = from + IO_WINDOW;
+  }
+  if (off - m -> dropped >= IO_WINDOW) {
+    /* our own mapping holds on to the pages, let go of it first.
+     * dropped stays page aligned */
+    to = off & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    madvise(m -> base + m -> dropped, to - m -> dropped, MADV_DONTNEED);
+    io_drop(m -> fd, m -> dropped, to - m -> dropped);
+    m -> dropped = to;
+  }
+}
+
+void map_close(arch_map *m) {
+  if (m -> gz) {
+    /* the pipe is the reader's to close */
+    gunzip_finish(m -> gz);
+    m -> fd = m -> raw_fd;
+  }
+  if (m -> base) {
+    munmap(m -> base, m -> size);
+    io_drop(m -> fd, m -> dropped, m -> size - m -> dropped);
+  }
+  io_trail_end(&m -> trail, 0);
+  if (m -> fd != STDIN_FILENO) {
+    close(m -> fd);
+  }
+  free(m -> buf);
+  free(m);
+}
@@ -0,0 +1,55 @@
+#ifndef ARCH_MAP
+#define ARCH_MAP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "arch_head.h"
+#include "gz.h"
+#include "pax.h"
+#include "io_policy.h"
+
+#define BLOCK_SIZE 512
+#define STREAM_BUF (1 << 20)
+
+/* bytes a body of n bytes takes up in the archive */
+#define BLOCK_ROUND(n) ((((off_t) (n)) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+
+/* archive reader. a regular file is mapped read only and headers are
+ * used in place. anything else ("-" for stdin, pipes, tapes) is
+ * streamed: forward only, headers are read into buf and bodies nobody
+ * asks for are skipped by seeking, splicing or reading past them.
+ * a gzip archive is always streamed, out of a gunzip thread */
+typedef struct arch_map {
+  int fd;
+  uint8_t *base;
+  off_t size;
+
+  int stream;
+  uint8_t *buf;
+  size_t buf_pos;
+  size_t buf_len;
+  off_t pos;       /* archive offset of buf[buf_pos] */
+  int eof;
+
+  gz_reader *gz;
+  int raw_fd;      /* the compressed archive when gz is set */
+
+  pax_attrs pax;   /* extended header of the member map_next is on */
+  off_t body;      /* and where that member's body starts */
+  off_t body_size;
+
+  io_trail trail;  /* --no-cache: a stream read off a plain file */
+  off_t dropped;   /* and for a mapping, what's out of the cache */
+  off_t ahead;     /* and how far we asked for */
+} arch_map;
+
+arch_map *map_open(char *arch_name, int advice);
+
+int map_next(arch_map *m, off_t *off, header **h, uint8_t params);
+
+ssize_t map_read(arch_map *m, off_t off, uint8_t *dst, size_t len);
+
+void map_release(arch_map *m, off_t off);
+
+void map_close(arch_map *m);
+#endif
@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ALIGN 16
+
+static __thread arena local;
+
+static arena_chunk *chunk_new(size_t size) {
+  arena_chunk *c;
+  size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+  if ((c = malloc(sizeof(arena_chunk) + ALIGN + cap)) == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  c -> next = NULL;
+  c -> cap = cap;
+  c -> used = 0;
+  return c;
+}
+
+static uint8_t *chunk_data(arena_chunk *c) {
+  uintptr_t p = (uintptr_t) (c + 1);
+  return (uint8_t *) ((p + ALIGN - 1) & ~(uintptr_t) (ALIGN - 1));
+}
+
+/* the calling thread's own arena, nothing to lock */
+arena *thread_arena(void) {
+  return &local;
+}
+
+/* size bytes, 16 byte aligned, NULL on failure */
+void *arena_alloc(arena *a, size_t size) {
+  arena_chunk *c;
+  void *p;
+  size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+  if (a -> head == NULL) {
+    if ((a -> head = a -> cur = chunk_new(size)) == NULL) {
+      return NULL;
+    }
+  }
+
+  /* move on to the next chunk (reusing one left over from an
+   * earlier member if there is one) until something fits */
+  for (c = a -> cur; c -> cap - c -> used < size; c = c -> next) {
+    if (c -> next == NULL || c -> next -> cap < size) {
+      arena_chunk *n;
+      if ((n = chunk_new(size)) == NULL) {
+	return NULL;
+      }
+      n -> next = c -> next;
+      c -> next = n;
+    }
+    c -> next -> used = 0;
+  }
+  a -> cur = c;
+  p = chunk_data(c) + c -> used;
+  c -> used += size;
+  return p;
+}
+
+/* where the arena is now, to roll back to later */
+arena_mark arena_save(arena *a) {
+  arena_mark mark;
+  mark.chunk = a -> cur;
+  mark.used = a -> cur ? a -> cur -> used : 0;
+  return mark;
+}
+
+/* give back everything allocated since mark was saved */
+void arena_release(arena *a, arena_mark mark) {
+  if (mark.chunk == NULL) {
+    arena_reset(a);
+    return;
+  }
+  a -> cur = mark.chunk;
+  a -> cur -> used = mark.used;
+}
+
+/* give back everything */
+void arena_reset(arena *a) {
+  if (a -> head) {
+    a -> cur = a -> head;
+    a -> head -> used = 0;
+  }
+}
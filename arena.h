@@ -0,0 +1,38 @@
+#ifndef ARENA
+#define ARENA
+
+#include <stddef.h>
+
+#define ARENA_CHUNK (64 << 10)
+
+/* bump allocator for short lived per member scratch (headers, path
+ * buffers). nothing is freed one by one, the owner rolls the arena
+ * back to a mark once the member is done and the chunks get reused,
+ * so memory stays flat however many members go by */
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t cap;
+  size_t used;
+  /* data follows */
+} arena_chunk;
+
+typedef struct arena {
+  arena_chunk *head;   /* chunks are kept and reused, never freed */
+  arena_chunk *cur;
+} arena;
+
+typedef struct arena_mark {
+  arena_chunk *chunk;
+  size_t used;
+} arena_mark;
+
+arena *thread_arena(void);
+
+void *arena_alloc(arena *a, size_t size);
+
+arena_mark arena_save(arena *a);
+
+void arena_release(arena *a, arena_mark mark);
+
+void arena_reset(arena *a);
+#endif
@@ -0,0 +1,131 @@
+#!/bin/sh
+# bench.sh: time mytar on a synthetic tree and write one JSON object per
+# measurement, so runs can be diffed or fed to a regression check.
+#
+# usage: bench/bench.sh [-s scale] [-r runs] [-g] [-o file] [-k] [mytar]
+#
+#   -s scale  size of the tree, passed to gentree (default 1, ~250 MB)
+#   -r runs   repeat every measurement and keep the fastest (default 3)
+#   -g        time GNU tar on the same operations too
+#   -o file   where the results go (default bench_output.txt)
+#   -k        keep the scratch directory
+#   mytar     binary to time, built from the sources next to bench/ if
+#             not given
+#
+# the environment can also set BENCH_DIR (scratch space, default a new
+# directory under /tmp) and BENCH_SEED.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SCALE=1
+RUNS=3
+GNU=0
+KEEP=0
+OUT=bench_output.txt
+
+while getopts s:r:go:k opt; do
+  case $opt in
+    s) SCALE=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    g) GNU=1 ;;
+    o) OUT=$OPTARG ;;
+    k) KEEP=1 ;;
+    *) sed -n '4,16p' "$0" >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+WORK=${BENCH_DIR:-$(mktemp -d /tmp/mytar-bench.XXXXXX)}
+mkdir -p "$WORK"
+cleanup() {
+  if [ "$KEEP" = 0 ]; then
+    rm -rf "$WORK"
+  else
+    echo "scratch kept in $WORK" >&2
+  fi
+}
+trap cleanup EXIT
+
+CC=${CC:-cc}
+if [ $# -gt 0 ]; then
+  MYTAR=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+else
+  MYTAR=$WORK/mytar
+  SRCS=$(ls "$ROOT"/*.c)
+  $CC -O2 -o "$MYTAR" $SRCS -lpthread -lz
+fi
+$CC -O2 -o "$WORK/gentree" "$ROOT/bench/gentree.c"
+
+echo "generating tree (scale $SCALE)" >&2
+rm -rf "$WORK/tree"
+"$WORK/gentree" "$WORK/tree" "$SCALE" "${BENCH_SEED:-1}"
+cd "$WORK/tree"
+FILES=$(find . -mindepth 1 | wc -l)
+BYTES=$(find . -type f -printf '%s\n' | awk '{ s += $1 } END { print s }')
+SEL_FILES=$(find tiny/d07 deep long | wc -l)
+SEL_BYTES=$(find tiny/d07 deep long -type f -printf '%s\n' | awk '{ s += $1 } END { print s }')
+HOST=$(uname -n)
+STAMP=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+REV=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+now() {
+  date +%s.%N
+}
+
+# record tool op files bytes seconds
+record() {
+  awk -v tool="$1" -v op="$2" -v files="$3" -v bytes="$4" -v secs="$5" \
+      -v host="$HOST" -v stamp="$STAMP" -v rev="$REV" -v scale="$SCALE" 'BEGIN {
+    if (secs <= 0) secs = 0.000001
+    printf "{\"time\":\"%s\",\"host\":\"%s\",\"rev\":\"%s\",\"scale\":%d,\"tool\":\"%s\",\"op\":\"%s\",\"files\":%d,\"bytes\":%d,\"seconds\":%.4f,\"files_per_s\":%.1f,\"mb_per_s\":%.2f}\n",
+      stamp, host, rev, scale, tool, op, files, bytes, secs, files / secs, bytes / secs / 1048576
+  }' >> "$OUT"
+  awk -v tool="$1" -v op="$2" -v secs="$5" -v files="$3" -v bytes="$4" 'BEGIN {
+    if (secs <= 0) secs = 0.000001
+    printf "%-6s %-9s %8.3fs %10.0f files/s %8.1f MB/s\n", tool, op, secs, files / secs, bytes / secs / 1048576
+  }' >&2
+}
+
+# best of RUNS: time_op tool op files bytes setup command...
+# setup runs before every timed run (outside the timing)
+time_op() {
+  tool=$1 op=$2 files=$3 bytes=$4 setup=$5
+  shift 5
+  best=
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    eval "$setup"
+    sync
+    t0=$(now)
+    "$@" > /dev/null
+    t1=$(now)
+    secs=$(awk -v a="$t0" -v b="$t1" 'BEGIN { print b - a }')
+    best=$(awk -v a="$best" -v b="$secs" 'BEGIN { print (a == "" || b < a) ? b : a }')
+    i=$((i + 1))
+  done
+  record "$tool" "$op" "$files" "$bytes" "$best"
+}
+
+case $OUT in
+  /*) ;;
+  *) OUT=$ROOT/$OUT ;;
+esac
+
+run_suite() {
+  tool=$1 bin=$2 arch=$WORK/$1.tar
+  time_op "$tool" create "$FILES" "$BYTES" "rm -f $arch" \
+    "$bin" cf "$arch" tiny huge deep long links
+  time_op "$tool" list "$FILES" "$BYTES" ":" \
+    "$bin" tf "$arch"
+  time_op "$tool" list_sel "$SEL_FILES" "$SEL_BYTES" ":" \
+    "$bin" tf "$arch" tiny/d07 deep long
+  time_op "$tool" extract "$FILES" "$BYTES" "rm -rf $WORK/x && mkdir $WORK/x" \
+    sh -c "cd $WORK/x && exec $bin xf $arch"
+}
+
+run_suite mytar "$MYTAR"
+if [ "$GNU" = 1 ]; then
+  run_suite gnutar tar
+fi
+echo "results appended to $OUT" >&2
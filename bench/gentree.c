@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* gentree: build the same synthetic tree every time for a given seed
+ * and scale, for bench.sh to archive.
+ *
+ *   tiny/   many small files (0-4 KiB) spread over 100 directories
+ *   huge/   a few big files
+ *   deep/   one chain of nested directories close to the 256 char limit
+ *   long/   paths over 100 chars, so they go through the prefix field
+ *   links/  symlinks into tiny/, some dangling
+ *
+ * usage: gentree dir [scale [seed]] */
+
+#define PATHMAX 256
+#define CHUNK (1 << 20)
+
+static uint64_t rng;
+
+/* xorshift64*, plenty for file contents and sizes */
+static uint64_t next_rand(void) {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ULL;
+}
+
+static uint8_t chunk[CHUNK];
+
+static void die(char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static void make_dir(char *path) {
+  if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) && errno != EEXIST) {
+    die(path);
+  }
+}
+
+/* write size bytes: half random, half repeated text, so compression
+ * has something to do without being trivial */
+static void make_file(char *path, off_t size) {
+  int fd;
+  off_t left;
+  size_t len, i;
+  uint64_t r;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+    die(path);
+  }
+  for (left = size; left > 0; left -= len) {
+    len = left < CHUNK ? (size_t) left : CHUNK;
+    for (i = 0; i + 8 <= len / 2; i += 8) {
+      r = next_rand();
+      memcpy(chunk + i, &r, 8);
+    }
+    for (; i < len; i++) {
+      chunk[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+    }
+    if (write(fd, chunk, len) != (ssize_t) len) {
+      die(path);
+    }
+  }
+  /* a fixed mtime so the same seed gives the same files */
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = 1700000000;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  futimens(fd, times);
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  char path[PATHMAX + 1];
+  int scale, i, j, n;
+  size_t len;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: gentree dir [scale [seed]]\n");
+    exit(EXIT_FAILURE);
+  }
+  scale = argc > 2 ? atoi(argv[2]) : 1;
+  rng = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+  if (scale < 1 || rng == 0) {
+    fprintf(stderr, "gentree: scale and seed have to be positive\n");
+    exit(EXIT_FAILURE);
+  }
+  make_dir(argv[1]);
+  if (chdir(argv[1])) {
+    die(argv[1]);
+  }
+
+  /* tiny */
+  make_dir("tiny");
+  for (i = 0; i < 100; i++) {
+    snprintf(path, sizeof(path), "tiny/d%02d", i);
+    make_dir(path);
+    for (j = 0; j < 200 * scale; j++) {
+      snprintf(path, sizeof(path), "tiny/d%02d/f%05d", i, j);
+      make_file(path, next_rand() % 4097);
+    }
+  }
+
+  /* huge */
+  make_dir("huge");
+  for (i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "huge/big%d", i);
+    make_file(path, (off_t) (64 << 20) * scale + next_rand() % 4096);
+  }
+
+  /* deep, every level gets a file */
+  strcpy(path, "deep");
+  make_dir(path);
+  for (i = 0; (len = strlen(path)) + 4 + 6 < PATHMAX - 1; i++) {
+    snprintf(path + len, sizeof(path) - len, "/l%02d", i);
+    make_dir(path);
+    len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/f");
+    make_file(path, next_rand() % 1024);
+    path[len] = '\0';
+  }
+
+  /* long, file names from 50 to 100 chars under a 100 char directory */
+  make_dir("long");
+  n = snprintf(path, sizeof(path), "long/");
+  for (i = 0; n < 100; i++) {
+    path[n++] = 'a' + i % 26;
+  }
+  path[n] = '\0';
+  make_dir(path);
+  for (i = 0; i < 50 * scale; i++) {
+    len = snprintf(path + n, sizeof(path) - n, "/%03d_", i);
+    for (j = 0; j < 45 + i % 51; j++) {
+      path[n + len + j] = 'A' + (i + j) % 26;
+    }
+    path[n + len + j] = '\0';
+    make_file(path, next_rand() % 8192);
+  }
+
+  /* links */
+  make_dir("links");
+  for (i = 0; i < 100 * scale; i++) {
+    snprintf(path, sizeof(path), "links/l%04d", i);
+    char target[64];
+    if (i % 10 == 9) {
+      snprintf(target, sizeof(target), "../tiny/nowhere%d", i);
+    } else {
+      snprintf(target, sizeof(target), "../tiny/d%02d/f%05d", i % 100, i % (200 * scale));
+    }
+    unlink(path);
+    if (symlink(target, path)) {
+      die(path);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "chksum.h"
+
+#define BLOCK_SIZE 512
+#define CHKSUM_OFF 148
+#define CHKSUM_LEN 8
+
+/* the block is summed whole and the chksum field is swapped for
+ * spaces afterwards, so every kernel only needs a plain byte sum */
+static int fix_chksum_field(const uint8_t *block, int sum) {
+  int i;
+  for (i = 0; i < CHKSUM_LEN; i++) {
+    sum -= block[CHKSUM_OFF + i];
+  }
+  return sum + CHKSUM_LEN * ' ';
+}
+
+static int sum_scalar(const uint8_t *block) {
+  uint64_t sum = 0, word;
+  int i;
+  /* eight bytes at a time, folding the byte lanes together with
+   * a multiply keeps this reasonable without any vector unit */
+  for (i = 0; i < BLOCK_SIZE; i += 8) {
+    /* byte order doesn't matter to a sum */
+    memcpy(&word, block + i, sizeof(word));
+    /* pairwise add bytes into 16 bit lanes then sum the lanes */
+    word = (word & 0x00ff00ff00ff00ffULL) + ((word >> 8) & 0x00ff00ff00ff00ffULL);
+    sum += (word * 0x0001000100010001ULL) >> 48;
+  }
+  return (int) sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int sum_sse2(const uint8_t *block) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  int i;
+  /* psadbw against zero sums each 8 byte half into a 64 bit lane */
+  for (i = 0; i < BLOCK_SIZE; i += 16) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (block + i)), zero));
+  }
+  acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+  return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2")))
+static int sum_avx2(const uint8_t *block) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  __m128i half;
+  int i;
+  for (i = 0; i < BLOCK_SIZE; i += 32) {
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (block + i)), zero));
+  }
+  half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+  return _mm_cvtsi128_si32(half);
+}
+#endif
+
+static int sum_pick(const uint8_t *block);
+
+/* resolved on first use to the best kernel this cpu runs */
+static int (*sum_block)(const uint8_t *) = sum_pick;
+
+static int sum_pick(const uint8_t *block) {
+  int (*best)(const uint8_t *) = sum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    best = sum_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    best = sum_sse2;
+  }
+#endif
+  /* every thread picks the same answer, so racing on this is fine */
+  __atomic_store_n(&sum_block, best, __ATOMIC_RELAXED);
+  return best(block);
+}
+
+int header_chksum(const uint8_t *block) {
+  return fix_chksum_field(block, sum_block(block));
+}
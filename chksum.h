@@ -0,0 +1,9 @@
+#ifndef CHKSUM
+#define CHKSUM
+
+#include <stdint.h>
+
+/* ustar header checksum: the unsigned sum of all 512 bytes of the
+ * header block with the 8 byte chksum field counted as spaces */
+int header_chksum(const uint8_t *block);
+#endif
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "dir_cache.h"
+
+#define PATHMAX 4096
+
+#define BUCKET(hash) ((hash) & (DIR_CACHE_SLOTS - 1))
+
+/* returns the cache on success NULL on failure */
+dir_cache *dcache_new(void) {
+  dir_cache *c;
+  int i;
+  if ((c = calloc(1, sizeof(dir_cache))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  for (i = DIR_CACHE_SLOTS - 1; i >= 0; i--) {
+    c -> slots[i].fd = -1;
+    c -> slots[i].chain = c -> free;
+    c -> free = &c -> slots[i];
+  }
+  return c;
+}
+
+static uint32_t hash_path(char *path) {
+  uint32_t h = 2166136261u;
+  for (; *path; path++) {
+    h = (h ^ (uint8_t) *path) * 16777619u;
+  }
+  return h;
+}
+
+/* take s out of the use order */
+static void unlist(dir_cache *c, dir_slot *s) {
+  if (s -> newer) {
+    s -> newer -> older = s -> older;
+  } else {
+    c -> newest = s -> older;
+  }
+  if (s -> older) {
+    s -> older -> newer = s -> newer;
+  } else {
+    c -> oldest = s -> newer;
+  }
+  s -> newer = s -> older = NULL;
+}
+
+/* put s at the newest end of the use order */
+static void list_newest(dir_cache *c, dir_slot *s) {
+  s -> older = c -> newest;
+  s -> newer = NULL;
+  if (c -> newest) {
+    c -> newest -> newer = s;
+  } else {
+    c -> oldest = s;
+  }
+  c -> newest = s;
+}
+
+/* take s out of its hash bucket */
+static void unhash(dir_cache *c, dir_slot *s) {
+  dir_slot **p;
+  for (p = &c -> buckets[BUCKET(s -> hash)]; *p != s; p = &(*p) -> chain);
+  *p = s -> chain;
+  s -> chain = NULL;
+}
+
+/* the slot dir is open in, NULL if it isn't. members come a directory
+ * at a time so the last one found is tried first */
+static dir_slot *find(dir_cache *c, char *dir, uint32_t hash) {
+  dir_slot *s = c -> last;
+  if (s && s -> path && s -> hash == hash && strcmp(s -> path, dir) == 0) {
+    return s;
+  }
+  for (s = c -> buckets[BUCKET(hash)]; s; s = s -> chain) {
+    if (s -> hash == hash && strcmp(s -> path, dir) == 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/* a slot to open a directory in: a free one, or else the least recently
+ * used one nothing is held in any more, closed first. the held ones are
+ * the newest as a rule, so that is found near the old end. NULL if
+ * every slot is still held */
+static dir_slot *take_slot(dir_cache *c) {
+  dir_slot *s;
+  if ((s = c -> free) != NULL) {
+    c -> free = s -> chain;
+    s -> chain = NULL;
+    return s;
+  }
+  for (s = c -> oldest; s; s = s -> newer) {
+    if (__atomic_load_n(&s -> refs, __ATOMIC_ACQUIRE) == 0) {
+      break;
+    }
+  }
+  if (s) {
+    if (s -> path) {
+      unhash(c, s);
+      free(s -> path);
+      s -> path = NULL;
+    }
+    unlist(c, s);
+    close(s -> fd);
+    s -> fd = -1;
+    if (c -> last == s) {
+      c -> last = NULL;
+    }
+  }
+  return s;
+}
+
+/* dir open and held, made first if it isn't there, its parents the
+ * same way. dir is cut up and put back along the way. a symlink is
+ * never followed, one the archive made could point anywhere: that
+ * fails with errno ELOOP or ENOTDIR, same as a file in the way. other
+ * failures are left for the caller to retry by path and report, NULL
+ * either way */
+static dir_slot *get(dir_cache *c, char *dir) {
+  uint32_t hash = hash_path(dir);
+  dir_slot *s, *parent = NULL;
+  char *slash, *name = dir;
+  int pfd = AT_FDCWD, fd, err;
+
+  if ((s = find(c, dir, hash)) == NULL) {
+    if ((slash = strrchr(dir, '/')) != NULL) {
+      if (slash == dir) {
+	return NULL;
+      }
+      *slash = '\0';
+      parent = get(c, dir);
+      *slash = '/';
+      if (parent == NULL) {
+	return NULL;
+      }
+      pfd = parent -> fd;
+      name = slash + 1;
+    }
+    fd = -1;
+    errno = 0;
+    if ((mkdirat(pfd, name, S_IRWXU) && errno != EEXIST) ||
+	(fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 ||
+	(s = take_slot(c)) == NULL || (s -> path = strdup(dir)) == NULL) {
+      err = errno == EEXIST ? 0 : errno;
+      if (fd != -1) {
+	close(fd);
+      }
+      if (s) {
+	s -> chain = c -> free;
+	c -> free = s;
+      }
+      dcache_put(parent);
+      errno = err;
+      return NULL;
+    }
+    dcache_put(parent);
+    s -> hash = hash;
+    s -> fd = fd;
+    s -> refs = 0;
+    s -> chain = c -> buckets[BUCKET(hash)];
+    c -> buckets[BUCKET(hash)] = s;
+  } else {
+    unlist(c, s);
+  }
+  list_newest(c, s);
+  __atomic_add_fetch(&s -> refs, 1, __ATOMIC_RELAXED);
+  c -> last = s;
+  return s;
+}
+
+/* the directory dir open and held, made if missing. NULL if it
+ * couldn't be, errno as for get */
+dir_slot *dcache_get(dir_cache *c, char *dir) {
+  char buf[PATHMAX];
+  if (strlen(dir) >= PATHMAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(buf, dir);
+  return get(c, buf);
+}
+
+/* the directory path goes in, held in *slot, with *name pointed at the
+ * part of path below it. a name without a '/' goes in the cwd and
+ * *slot is NULL. returns the fd to openat name against, -1 when the
+ * parents have to be made by path instead, or can't be at all when
+ * errno is ELOOP or ENOTDIR */
+int dcache_parent(dir_cache *c, char *path, dir_slot **slot, char **name) {
+  char dir[PATHMAX];
+  char *slash = strrchr(path, '/');
+  *slot = NULL;
+  *name = path;
+  if (slash == NULL) {
+    return AT_FDCWD;
+  }
+  if (slash - path >= PATHMAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(dir, path, slash - path);
+  dir[slash - path] = '\0';
+  if ((*slot = get(c, dir)) == NULL) {
+    return -1;
+  }
+  *name = slash + 1;
+  return (*slot) -> fd;
+}
+
+/* done with a directory dcache_get or dcache_parent handed out, from
+ * any thread. NULL is fine */
+void dcache_put(dir_slot *s) {
+  if (s) {
+    __atomic_sub_fetch(&s -> refs, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* forget everything, the directories may be gone. ones still held stay
+ * open until they are taken over again */
+void dcache_flush(dir_cache *c) {
+  dir_slot *s, *newer;
+  for (s = c -> oldest; s; s = newer) {
+    newer = s -> newer;
+    free(s -> path);
+    s -> path = NULL;
+    s -> chain = NULL;
+    if (__atomic_load_n(&s -> refs, __ATOMIC_ACQUIRE) == 0) {
+      unlist(c, s);
+      close(s -> fd);
+      s -> fd = -1;
+      s -> chain = c -> free;
+      c -> free = s;
+    }
+  }
+  memset(c -> buckets, '\0', sizeof(c -> buckets));
+  c -> last = NULL;
+}
+
+/* close everything, nothing may be held any more */
+void dcache_free(dir_cache *c) {
+  int i;
+  for (i = 0; i < DIR_CACHE_SLOTS; i++) {
+    if (c -> slots[i].fd != -1) {
+      close(c -> slots[i].fd);
+    }
+    free(c -> slots[i].path);
+  }
+  free(c);
+}
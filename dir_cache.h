@@ -0,0 +1,47 @@
+#ifndef DIR_CACHE
+#define DIR_CACHE
+
+#include <stdint.h>
+
+/* directories held open at once. has to be more than the extract
+ * queue can have pinned, or lookups start falling back to paths.
+ * a power of two, it is the hash table size as well */
+#define DIR_CACHE_SLOTS 1024
+
+/* one open directory. refs counts the members still to be made in it,
+ * it is only closed once that is back to 0 */
+typedef struct dir_slot {
+  char *path;          /* NULL once dropped from the cache */
+  uint32_t hash;
+  int fd;              /* -1 when the slot is free */
+  int refs;
+  struct dir_slot *chain;  /* next in its hash bucket, or on the free list */
+  struct dir_slot *newer;  /* use order of the open ones */
+  struct dir_slot *older;
+} dir_slot;
+
+/* fds of the directories x has been putting members in, so each file
+ * is opened with openat against its parent instead of having its
+ * whole path walked again, and the parents are only made once. only
+ * the extracting thread looks things up, workers just hand refs back */
+typedef struct dir_cache {
+  dir_slot slots[DIR_CACHE_SLOTS];
+  dir_slot *buckets[DIR_CACHE_SLOTS];
+  dir_slot *free;
+  dir_slot *newest;
+  dir_slot *oldest;
+  dir_slot *last;
+} dir_cache;
+
+dir_cache *dcache_new(void);
+
+dir_slot *dcache_get(dir_cache *c, char *dir);
+
+int dcache_parent(dir_cache *c, char *path, dir_slot **slot, char **name);
+
+void dcache_put(dir_slot *s);
+
+void dcache_flush(dir_cache *c);
+
+void dcache_free(dir_cache *c);
+#endif
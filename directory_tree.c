@@ -1,4 +1,217 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "directory_tree.h"
+#include "arena.h"
 
-DIR *build_dir_tree(DIR *) {
+/* linux/fs.h has a BLOCK_SIZE of its own */
+#define TAR_BLOCK 512
+
+/* returns the catalog on success NULL on failure */
+dir_tree *tree_new(void) {
+  dir_tree *t;
+  if ((t = calloc(1, sizeof(dir_tree))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  return t;
+}
+
+/* note path at the end of the catalog, 0 on success -1 on failure */
+int tree_add(dir_tree *t, char *path, struct stat *st) {
+  size_t len = strlen(path) + 1;
+  tree_ent *e;
+  off_t body;
+
+  if (t -> count == t -> cap) {
+    t -> cap = t -> cap ? t -> cap * 2 : 1024;
+    if ((e = realloc(t -> ents, t -> cap * sizeof(tree_ent))) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    t -> ents = e;
+  }
+  if (t -> names_len + len > t -> names_cap) {
+    t -> names_cap = t -> names_cap ? t -> names_cap * 2 : 64 * 1024;
+    while (t -> names_len + len > t -> names_cap) {
+      t -> names_cap *= 2;
+    }
+    char *names;
+    if ((names = realloc(t -> names, t -> names_cap)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    t -> names = names;
+  }
+
+  e = &t -> ents[t -> count];
+  e -> path_off = t -> names_len;
+  e -> key = 0;
+  e -> seq = t -> count++;
+  e -> dev = st -> st_dev;
+  e -> ino = st -> st_ino;
+  e -> size = st -> st_size;
+  e -> blocks = st -> st_blocks;
+  e -> mtime_sec = st -> st_mtim.tv_sec;
+  e -> mtime_nsec = st -> st_mtim.tv_nsec;
+  e -> mode = st -> st_mode;
+  e -> uid = st -> st_uid;
+  e -> gid = st -> st_gid;
+  e -> nlink = st -> st_nlink;
+  memcpy(t -> names + t -> names_len, path, len);
+  t -> names_len += len;
+
+  /* a header, and a body for a regular file. files with holes only
+   * take their data */
+  body = 0;
+  if (S_ISREG(st -> st_mode)) {
+    body = (off_t) st -> st_blocks * 512 < st -> st_size ? (off_t) st -> st_blocks * 512 :
+      st -> st_size;
+  }
+  t -> total += TAR_BLOCK + (body + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+  return 0;
+}
+
+/* add the directory node and everything under it to the catalog, in
+ * the same preorder DFS input_DIR archives them in. skip says what to
+ * leave out. 0 on success -1 on failure */
+int build_dir_tree(dir_tree *t, walker *w, walk_node *node, struct stat *st,
+		   tree_skip_fn skip) {
+  int err = 0;
+  if (!skip(node -> path, st) && tree_add(t, node -> path, st)) {
+    err = -1;
+  }
+  walk_wait(w, node);
+
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  walk_entry *e;
+  char *fpath;
+  int i;
+  if ((fpath = arena_alloc(scratch, PATHMAX)) == NULL) {
+    walk_node_free(w, node);
+    return -1;
+  }
+  for (i = 0; i < node -> nents; i++) {
+    e = &node -> ents[i];
+    if (S_ISDIR(e -> st.st_mode)) {
+      /* the children get freed as they are walked, keep going even
+       * after a failure so none are left behind */
+      if (e -> child && build_dir_tree(t, w, e -> child, &e -> st, skip)) {
+	err = -1;
+      }
+    } else if (S_ISREG(e -> st.st_mode) || S_ISLNK(e -> st.st_mode)) {
+      snprintf(fpath, PATHMAX, "%s%s", node -> path, e -> name);
+      if (!err && !skip(fpath, &e -> st) && tree_add(t, fpath, &e -> st)) {
+	err = -1;
+      }
+    }
+  }
+
+  arena_release(scratch, mark);
+  walk_node_free(w, node);
+  return err;
+}
+
+/* the lstat e was made from, as far as the archive cares */
+void tree_stat(tree_ent *e, struct stat *st) {
+  memset(st, '\0', sizeof(struct stat));
+  st -> st_dev = e -> dev;
+  st -> st_ino = e -> ino;
+  st -> st_size = e -> size;
+  st -> st_blocks = e -> blocks;
+  st -> st_mtim.tv_sec = e -> mtime_sec;
+  st -> st_mtim.tv_nsec = e -> mtime_nsec;
+  st -> st_mode = e -> mode;
+  st -> st_uid = e -> uid;
+  st -> st_gid = e -> gid;
+  st -> st_nlink = e -> nlink;
+}
+
+/* physical byte path's data starts at, 0 for a file with none
+ * -1 if the filesystem can't tell */
+static int64_t first_extent(char *path) {
+  uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+  struct fiemap *fm = (struct fiemap *) buf;
+  int fd, ret;
+
+  memset(buf, '\0', sizeof(buf));
+  fm -> fm_length = FIEMAP_MAX_OFFSET;
+  fm -> fm_extent_count = 1;
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return 0;
+  }
+  ret = ioctl(fd, FS_IOC_FIEMAP, fm);
+  close(fd);
+  if (ret == -1) {
+    return errno == EOPNOTSUPP || errno == ENOTTY ? -1 : 0;
+  }
+  return fm -> fm_mapped_extents ? (int64_t) fm -> fm_extents[0].fe_physical : 0;
+}
+
+/* directories first, in the order they were walked so every one is
+ * in before anything under it. then everything else by device and
+ * key, ties in walk order */
+static int by_key(const void *a, const void *b) {
+  const tree_ent *x = a, *y = b;
+  int x_dir = S_ISDIR(x -> mode), y_dir = S_ISDIR(y -> mode);
+  if (x_dir != y_dir) {
+    return y_dir - x_dir;
+  }
+  if (!x_dir) {
+    if (x -> dev != y -> dev) {
+      return x -> dev < y -> dev ? -1 : 1;
+    }
+    if (x -> key != y -> key) {
+      return x -> key < y -> key ? -1 : 1;
+    }
+  }
+  return x -> seq < y -> seq ? -1 : x -> seq > y -> seq;
+}
+
+/* put the catalog in the order its files sit on disk: by inode, which
+ * on most filesystems follows where they were allocated, or by where
+ * their data actually starts according to FIEMAP */
+void tree_sort(dir_tree *t, int order) {
+  tree_ent *e;
+  int64_t phys;
+  uint64_t i, j;
+
+  if (order == SORT_NONE) {
+    return;
+  }
+  for (i = 0; i < t -> count; i++) {
+    e = &t -> ents[i];
+    e -> key = e -> ino;
+    if (order != SORT_EXTENT) {
+      continue;
+    }
+    /* anything without data goes ahead of the files that have some */
+    phys = S_ISREG(e -> mode) && e -> size > 0 ? first_extent(TREE_PATH(t, e)) : 0;
+    if (phys == -1) {
+      fprintf(stderr, "%s: no extent map here, sorting by inode\n", TREE_PATH(t, e));
+      order = SORT_INODE;
+      for (j = 0; j < i; j++) {
+	t -> ents[j].key = t -> ents[j].ino;
+      }
+    } else {
+      e -> key = phys;
+    }
+  }
+  qsort(t -> ents, t -> count, sizeof(tree_ent), by_key);
+}
+
+void tree_free(dir_tree *t) {
+  free(t -> ents);
+  free(t -> names);
+  free(t);
 }
@@ -0,0 +1,61 @@
+#ifndef DIRECTORY_TREE
+#define DIRECTORY_TREE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "walk.h"
+
+#define SORT_NONE 0
+#define SORT_INODE 1
+#define SORT_EXTENT 2
+
+/* one member of the catalog, just the parts of its lstat the archive
+ * needs. the path lives in the catalog's names */
+typedef struct tree_ent {
+  uint64_t path_off;
+  uint64_t key;        /* inode or first physical byte, once sorted */
+  uint64_t seq;        /* where the walk found it */
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t blocks;
+  int64_t mtime_sec;
+  int32_t mtime_nsec;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+} tree_ent;
+
+/* everything c is about to archive, walked before any of it is read
+ * so it can be put in an order that is kind to the disk. one flat
+ * array and one buffer of nul terminated paths */
+typedef struct dir_tree {
+  tree_ent *ents;
+  uint64_t count;
+  uint64_t cap;
+  char *names;
+  uint64_t names_len;
+  uint64_t names_cap;
+  off_t total;         /* archive bytes the members take up */
+} dir_tree;
+
+#define TREE_PATH(t, e) ((t) -> names + (e) -> path_off)
+
+/* 1 to leave path out of the catalog */
+typedef int (*tree_skip_fn)(char *path, struct stat *st);
+
+dir_tree *tree_new(void);
+
+int tree_add(dir_tree *t, char *path, struct stat *st);
+
+int build_dir_tree(dir_tree *t, walker *w, walk_node *node, struct stat *st,
+		   tree_skip_fn skip);
+
+void tree_stat(tree_ent *e, struct stat *st);
+
+void tree_sort(dir_tree *t, int order);
+
+void tree_free(dir_tree *t);
+#endif
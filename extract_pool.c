@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "extract_pool.h"
+#include "arch_map.h"
+#include "stats.h"
+#include "sparse.h"
+#include "io_policy.h"
+#include "dir_cache.h"
+
+#define QUEUE_SIZE 256
+
+/* counts of the jobs queued or running by hash of their path, so a
+ * submit only looks through them when one might have its name. more
+ * than QUEUE_SIZE plus the workers, a power of two */
+#define INFLIGHT_SLOTS 1024
+#define CHUNK_SIZE (1 << 20)
+
+/* a mapped body needs no buffer, it goes out in writes this big */
+#define MAP_CHUNK (8 << 20)
+
+struct extract_pool {
+  arch_map *m;
+  uint8_t *inline_buff;   /* streams are written by the submitter */
+  int nthreads;
+  pthread_t *threads;
+
+  /* ring of pending jobs, guarded by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  extract_job queue[QUEUE_SIZE];
+  int head;
+  int count;
+  int done;
+  int failures;
+  off_t *busy;            /* body each worker is on, -1 when idle */
+  extract_job **running;  /* job each worker is on, NULL when idle */
+  int inflight[INFLIGHT_SLOTS];
+  pthread_cond_t job_done;
+  int waiting;            /* someone sleeps on job_done */
+  int next_id;
+};
+
+static uint32_t hash_path(char *path) {
+  uint32_t h = 2166136261u;
+  for (; *path; path++) {
+    h = (h ^ (uint8_t) *path) * 16777619u;
+  }
+  return h;
+}
+
+/* write len bytes of the archive from off to out_fd where it is. a
+ * mapped archive is written straight from the mapping, a stream is
+ * read through buff. out follows the writes for --no-cache, NULL if
+ * they aren't in order. returns the writes it took, -1 on failure */
+static int64_t copy_out(arch_map *m, int out_fd, char *path, off_t off, off_t len, uint8_t *buff,
+			io_trail *out) {
+  ssize_t num_read, num_write;
+  size_t want;
+  uint8_t *src;
+  int64_t writes = 0;
+  while (len > 0) {
+    want = m -> stream ? CHUNK_SIZE : MAP_CHUNK;
+    want = len < (off_t) want ? (size_t) len : want;
+    if (m -> stream) {
+      num_read = map_read(m, off, buff, want);
+      src = buff;
+    } else {
+      num_read = off + (off_t) want > m -> size ? m -> size - off : (ssize_t) want;
+      src = m -> base + off;
+    }
+    if (num_read <= 0) {
+      fprintf(stderr, "%s: archive truncated\n", path);
+      return -1;
+    }
+    if ((num_write = write(out_fd, src, num_read)) != num_read) {
+      perror("write");
+      return -1;
+    }
+    if (out) {
+      io_trail_moved(out, num_write);
+    }
+    off += num_read;
+    len -= num_read;
+    writes++;
+  }
+  return writes;
+}
+
+/* write the data runs of a sparse member where they go and leave the
+ * holes as holes, the file is new so seeking over them is enough
+ * returns the writes it took, -1 on failure */
+static int64_t copy_sparse(arch_map *m, int out_fd, extract_job *job, uint8_t *buff) {
+  sparse_ext *exts = NULL;
+  int n, i;
+  ssize_t map_len = 0;
+  off_t off = job -> offset, have = 0, end = job -> offset + job -> size;
+  int64_t writes = 0, w;
+  const uint8_t *text;
+
+  /* the map is at the front of the body, a stream is read a block at
+   * a time until all of it is in */
+  if (m -> stream) {
+    while (map_len == 0 && have + BLOCK_SIZE <= CHUNK_SIZE && off + have < end &&
+	   map_read(m, off + have, buff + have, BLOCK_SIZE) == BLOCK_SIZE) {
+      have += BLOCK_SIZE;
+      map_len = sparse_map_parse(buff, have, &exts, &n);
+    }
+  } else {
+    text = m -> base + off;
+    have = end > m -> size ? m -> size - off : job -> size;
+    map_len = sparse_map_parse(text, have, &exts, &n);
+  }
+  if (map_len <= 0) {
+    fprintf(stderr, "%s: bad sparse map\n", job -> path);
+    return -1;
+  }
+
+  off += map_len;
+  for (i = 0; i < n; i++) {
+    if (off + exts[i].size > end) {
+      fprintf(stderr, "%s: bad sparse map\n", job -> path);
+      free(exts);
+      return -1;
+    }
+    if (lseek(out_fd, exts[i].offset, SEEK_SET) == -1) {
+      perror(job -> path);
+      free(exts);
+      return -1;
+    }
+    if ((w = copy_out(m, out_fd, job -> path, off, exts[i].size, buff, NULL)) == -1) {
+      free(exts);
+      return -1;
+    }
+    off += exts[i].size;
+    writes += w;
+  }
+  free(exts);
+
+  /* a trailing hole is only there in the size */
+  if (ftruncate(out_fd, job -> realsize)) {
+    perror(job -> path);
+    return -1;
+  }
+  return writes + 1;
+}
+
+/* copy one member body out of the archive into a freshly created file.
+ * 0 on success, -1 on failure */
+static int write_member(arch_map *m, extract_job *job, uint8_t *buff) {
+  int out_fd, dfd = job -> dir ? job -> dir -> fd : job -> dfd;
+  char *name = job -> path + job -> name_off;
+  uint64_t t0 = STATS_START(), t1;
+  int64_t writes;
+  io_trail trail;
+  /* a symlink where the file goes is replaced, never written through */
+  out_fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+  if (out_fd == -1 && errno == ELOOP && unlinkat(dfd, name, 0) == 0) {
+    out_fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+  }
+  if (job -> dir) {
+    dcache_put(job -> dir);
+  } else if (dfd != AT_FDCWD) {
+    close(dfd);
+  }
+  if (out_fd == -1) {
+    perror(job -> path);
+    return -1;
+  }
+
+  /* get the whole body its space in one go rather than a write at a
+   * time, so it lands in as few extents as the filesystem can manage.
+   * one write's worth gets that anyway. where it isn't supported we
+   * just go without */
+  if (!job -> sparse && job -> size > (m -> stream ? CHUNK_SIZE : MAP_CHUNK)) {
+    fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, job -> size);
+  }
+
+  io_trail_init(&trail, out_fd, 1, 0);
+  if (job -> sparse) {
+    writes = copy_sparse(m, out_fd, job, buff);
+  } else {
+    writes = copy_out(m, out_fd, job -> path, job -> offset, job -> size, buff, &trail);
+  }
+  /* waiting for every file to reach the disk would make extraction
+   * synchronous, the last window is left to writeback */
+  io_trail_end(&trail, 0);
+  if (writes == -1) {
+    close(out_fd);
+    return -1;
+  }
+  STATS_END(PH_BODY, t0, writes + 1, job -> size);
+
+  /* metadata goes on last so a read only mode can't get in our way,
+   * owner before mode since chown drops the set-id bits */
+  t1 = STATS_START();
+  struct timespec times[2];
+  times[0].tv_sec = job -> mtime;
+  times[0].tv_nsec = 0;
+  times[1] = times[0];
+  if (job -> same_owner && fchown(out_fd, job -> uid, job -> gid)) {
+    perror("fchown");
+  }
+  if (fchmod(out_fd, job -> mode)) {
+    perror("fchmod");
+  }
+  if (futimens(out_fd, times)) {
+    perror("futimens");
+  }
+
+  if (close(out_fd)) {
+    perror("close");
+    return -1;
+  }
+  STATS_END(PH_SET_META, t1, job -> same_owner ? 4 : 3, 0);
+  STATS_MEMBER(t0);
+  return 0;
+}
+
+static void *worker(void *arg) {
+  extract_pool *pool = arg;
+  extract_job job;
+  int id, err;
+
+  pthread_mutex_lock(&pool -> lock);
+  id = pool -> next_id++;
+  pthread_mutex_unlock(&pool -> lock);
+
+  for (;;) {
+    pthread_mutex_lock(&pool -> lock);
+    pool -> busy[id] = -1;
+    while (pool -> count == 0 && !pool -> done) {
+      pthread_cond_wait(&pool -> not_empty, &pool -> lock);
+    }
+    if (pool -> count == 0) {
+      pthread_mutex_unlock(&pool -> lock);
+      break;
+    }
+    job = pool -> queue[pool -> head];
+    pool -> head = (pool -> head + 1) % QUEUE_SIZE;
+    pool -> count--;
+    pool -> busy[id] = job.offset;
+    pool -> running[id] = &job;
+    pthread_cond_signal(&pool -> not_full);
+    pthread_mutex_unlock(&pool -> lock);
+
+    err = write_member(pool -> m, &job, NULL);
+    pthread_mutex_lock(&pool -> lock);
+    if (err) {
+      pool -> failures++;
+    }
+    pool -> running[id] = NULL;
+    pool -> inflight[job.hash & (INFLIGHT_SLOTS - 1)]--;
+    if (pool -> waiting) {
+      pthread_cond_broadcast(&pool -> job_done);
+    }
+    pthread_mutex_unlock(&pool -> lock);
+  }
+
+  return NULL;
+}
+
+/* start nthreads workers pulling bodies out of the mapped archive. a
+ * stream can only be read in order by one thread, so then no workers
+ * are started and bodies are written as they are submitted
+ * returns the pool on success NULL on failure */
+extract_pool *pool_init(arch_map *m, int nthreads) {
+  extract_pool *pool;
+  if ((pool = calloc(1, sizeof(extract_pool))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  pool -> m = m;
+  if (m -> stream) {
+    if ((pool -> inline_buff = malloc(CHUNK_SIZE)) == NULL) {
+      perror("malloc");
+      free(pool);
+      return NULL;
+    }
+    return pool;
+  }
+  int i;
+  pool -> threads = malloc(nthreads * sizeof(pthread_t));
+  pool -> busy = malloc(nthreads * sizeof(off_t));
+  pool -> running = calloc(nthreads, sizeof(extract_job *));
+  for (i = 0; i < nthreads; i++) {
+    pool -> busy[i] = -1;
+  }
+  pthread_mutex_init(&pool -> lock, NULL);
+  pthread_cond_init(&pool -> not_empty, NULL);
+  pthread_cond_init(&pool -> not_full, NULL);
+  pthread_cond_init(&pool -> job_done, NULL);
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool -> threads[i], NULL, worker, pool)) {
+      break;
+    }
+  }
+  pool -> nthreads = i;
+  if (i == 0) {
+    fprintf(stderr, "pool_init: unable to start workers\n");
+    free(pool -> threads);
+    free(pool -> busy);
+    free(pool -> running);
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* is a job for path queued or running, caller holds pool -> lock */
+static int in_flight(extract_pool *pool, char *path, uint32_t hash) {
+  extract_job *j;
+  int i;
+  if (pool -> inflight[hash & (INFLIGHT_SLOTS - 1)] == 0) {
+    return 0;
+  }
+  for (i = 0; i < pool -> count; i++) {
+    j = &pool -> queue[(pool -> head + i) % QUEUE_SIZE];
+    if (j -> hash == hash && strcmp(j -> path, path) == 0) {
+      return 1;
+    }
+  }
+  for (i = 0; i < pool -> nthreads; i++) {
+    j = pool -> running[i];
+    if (j && j -> hash == hash && strcmp(j -> path, path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* wait out every job on path handed over so far, caller holds
+ * pool -> lock */
+static void wait_path(extract_pool *pool, char *path, uint32_t hash) {
+  while (in_flight(pool, path, hash)) {
+    pool -> waiting++;
+    pthread_cond_wait(&pool -> job_done, &pool -> lock);
+    pool -> waiting--;
+  }
+}
+
+/* hand a job to the workers, blocks while the queue is full. a name
+ * the archive holds more than once has to be written in archive order
+ * for the last copy to win, so the job first waits out any earlier one
+ * on its path */
+int pool_submit(extract_pool *pool, extract_job *job) {
+  if (pool -> inline_buff) {
+    if (write_member(pool -> m, job, pool -> inline_buff)) {
+      pool -> failures++;
+    }
+    return 0;
+  }
+  job -> hash = hash_path(job -> path);
+  pthread_mutex_lock(&pool -> lock);
+  wait_path(pool, job -> path, job -> hash);
+  while (pool -> count == QUEUE_SIZE) {
+    pthread_cond_wait(&pool -> not_full, &pool -> lock);
+  }
+  pool -> queue[(pool -> head + pool -> count) % QUEUE_SIZE] = *job;
+  pool -> inflight[job -> hash & (INFLIGHT_SLOTS - 1)]++;
+  pool -> count++;
+  pthread_cond_signal(&pool -> not_empty);
+  pthread_mutex_unlock(&pool -> lock);
+  return 0;
+}
+
+/* block until nothing handed over for path is still being written,
+ * before something else is made under that name */
+void pool_settle(extract_pool *pool, char *path) {
+  if (pool -> inline_buff) {
+    return;
+  }
+  pthread_mutex_lock(&pool -> lock);
+  wait_path(pool, path, hash_path(path));
+  pthread_mutex_unlock(&pool -> lock);
+}
+
+/* lowest archive offset the workers still need, off if nothing before it */
+off_t pool_low(extract_pool *pool, off_t off) {
+  int i;
+  if (pool -> inline_buff) {
+    return off;
+  }
+  pthread_mutex_lock(&pool -> lock);
+  /* the queue goes in archive order, its head is the oldest */
+  if (pool -> count > 0 && pool -> queue[pool -> head].offset < off) {
+    off = pool -> queue[pool -> head].offset;
+  }
+  for (i = 0; i < pool -> nthreads; i++) {
+    if (pool -> busy[i] != -1 && pool -> busy[i] < off) {
+      off = pool -> busy[i];
+    }
+  }
+  pthread_mutex_unlock(&pool -> lock);
+  return off;
+}
+
+/* drain the queue, join the workers and free the pool
+ * returns the number of members that failed to extract */
+int pool_finish(extract_pool *pool) {
+  int i, failures;
+  if (pool -> inline_buff) {
+    failures = pool -> failures;
+    free(pool -> inline_buff);
+    free(pool);
+    return failures;
+  }
+  pthread_mutex_lock(&pool -> lock);
+  pool -> done = 1;
+  pthread_cond_broadcast(&pool -> not_empty);
+  pthread_mutex_unlock(&pool -> lock);
+
+  for (i = 0; i < pool -> nthreads; i++) {
+    pthread_join(pool -> threads[i], NULL);
+  }
+
+  failures = pool -> failures;
+  pthread_mutex_destroy(&pool -> lock);
+  pthread_cond_destroy(&pool -> not_empty);
+  pthread_cond_destroy(&pool -> not_full);
+  pthread_cond_destroy(&pool -> job_done);
+  free(pool -> threads);
+  free(pool -> busy);
+  free(pool -> running);
+  free(pool);
+  return failures;
+}
@@ -0,0 +1,42 @@
+#ifndef EXTRACT_POOL
+#define EXTRACT_POOL
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PATHMAX 4096
+
+/* one regular file member waiting to be written out, the body lives
+ * at [offset, offset + size) of the archive */
+typedef struct extract_job {
+  char path[PATHMAX];
+  struct dir_slot *dir; /* parent held open in the cache, or NULL */
+  int dfd;          /* the parent opened for this file alone when dir is
+		     * NULL, closed by the worker. AT_FDCWD for the cwd */
+  int name_off;     /* where path is below the parent */
+  off_t offset;
+  off_t size;
+  int sparse;       /* body is a GNU 1.0 sparse map then the data runs */
+  off_t realsize;
+  mode_t mode;
+  time_t mtime;
+  int same_owner;   /* chown to uid/gid, only done as root */
+  uid_t uid;
+  gid_t gid;
+  uint32_t hash;    /* of path, filled in by pool_submit */
+} extract_job;
+
+typedef struct extract_pool extract_pool;
+
+struct arch_map;
+
+extract_pool *pool_init(struct arch_map *m, int nthreads);
+
+int pool_submit(extract_pool *pool, extract_job *job);
+
+void pool_settle(extract_pool *pool, char *path);
+
+off_t pool_low(extract_pool *pool, off_t off);
+
+int pool_finish(extract_pool *pool);
+#endif
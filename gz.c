@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "gz.h"
+#include "stats.h"
+#include "io_policy.h"
+
+#define GZ_IN (256 << 10)
+#define GZ_OUT (256 << 10)
+#define GZ_PIPE (1 << 20)
+
+#define SLOT_EMPTY 0
+#define SLOT_FILLED 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+
+/* one block on its way through the writer, slot i carries every
+ * block whose sequence number is i mod nslots */
+typedef struct gz_slot {
+  int state;
+  uint8_t *in;
+  size_t in_len;
+  uint8_t *out;
+  size_t out_len;
+} gz_slot;
+
+struct gz_writer {
+  int pipe_r;
+  int pipe_w;
+  int out_fd;
+  int level;
+  size_t out_cap;
+  io_trail trail;      /* the writer's, for --no-cache */
+
+  /* everything below is guarded by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  gz_slot *slots;
+  int nslots;
+  long next_fill;      /* sequence number the splitter fills next */
+  long next_write;     /* sequence number the writer waits on */
+  int eof;
+  int failed;
+
+  pthread_t splitter;
+  pthread_t writer;
+  pthread_t *workers;
+  int nworkers;
+};
+
+struct gz_reader {
+  int src_fd;
+  const uint8_t *mem;
+  size_t mem_len;
+  uint8_t *in;
+  int pipe_r;
+  int pipe_w;
+  int failed;
+  pthread_t thread;
+};
+
+/* write all of len bytes, 0 on success -1 on failure */
+static int write_all(int fd, const uint8_t *p, size_t len) {
+  ssize_t n;
+  while (len > 0) {
+    if ((n = write(fd, p, len)) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* a bigger pipe means fewer wakeups between the stages */
+static int open_pipe(int fds[2]) {
+  if (pipe2(fds, O_CLOEXEC)) {
+    perror("pipe");
+    return -1;
+  }
+  fcntl(fds[1], F_SETPIPE_SZ, GZ_PIPE);
+  return 0;
+}
+
+/* cut the tar stream coming down the pipe into blocks */
+static void *gz_split(void *arg) {
+  gz_writer *z = arg;
+  gz_slot *s;
+  size_t len;
+  ssize_t n;
+  int done = 0;
+
+  while (!done) {
+    pthread_mutex_lock(&z -> lock);
+    s = &z -> slots[z -> next_fill % z -> nslots];
+    while (s -> state != SLOT_EMPTY) {
+      pthread_cond_wait(&z -> cond, &z -> lock);
+    }
+    pthread_mutex_unlock(&z -> lock);
+
+    /* always hand out full blocks, short reads off the pipe are
+     * normal */
+    for (len = 0; len < GZ_BLOCK; len += n) {
+      if ((n = read(z -> pipe_r, s -> in + len, GZ_BLOCK - len)) == -1) {
+	if (errno == EINTR) {
+	  n = 0;
+	  continue;
+	}
+	perror("gzip read");
+	done = 1;
+	break;
+      }
+      if (n == 0) {
+	done = 1;
+	break;
+      }
+    }
+
+    pthread_mutex_lock(&z -> lock);
+    if (len > 0) {
+      s -> in_len = len;
+      s -> state = SLOT_FILLED;
+      z -> next_fill++;
+    }
+    if (done) {
+      z -> eof = 1;
+    }
+    pthread_cond_broadcast(&z -> cond);
+    pthread_mutex_unlock(&z -> lock);
+  }
+  return NULL;
+}
+
+/* compress whichever filled block is oldest into a gzip member */
+static void *gz_work(void *arg) {
+  gz_writer *z = arg;
+  gz_slot *s;
+  z_stream zs;
+  long seq;
+  int ok;
+
+  memset(&zs, '\0', sizeof(zs));
+  ok = deflateInit2(&zs, z -> level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+  pthread_mutex_lock(&z -> lock);
+  for (;;) {
+    s = NULL;
+    for (seq = z -> next_write; seq < z -> next_fill; seq++) {
+      if (z -> slots[seq % z -> nslots].state == SLOT_FILLED) {
+	s = &z -> slots[seq % z -> nslots];
+	break;
+      }
+    }
+    if (s == NULL) {
+      if (z -> eof) {
+	break;
+      }
+      pthread_cond_wait(&z -> cond, &z -> lock);
+      continue;
+    }
+    s -> state = SLOT_BUSY;
+    pthread_mutex_unlock(&z -> lock);
+
+    s -> out_len = 0;
+    uint64_t t0 = STATS_START();
+    if (ok && deflateReset(&zs) == Z_OK) {
+      zs.next_in = s -> in;
+      zs.avail_in = s -> in_len;
+      zs.next_out = s -> out;
+      zs.avail_out = z -> out_cap;
+      if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+	s -> out_len = z -> out_cap - zs.avail_out;
+      }
+    }
+    STATS_END(PH_COMPRESS, t0, 1, s -> in_len);
+
+    pthread_mutex_lock(&z -> lock);
+    if (s -> out_len == 0) {
+      fprintf(stderr, "gzip: unable to compress block\n");
+      z -> failed = 1;
+    }
+    s -> state = SLOT_DONE;
+    pthread_cond_broadcast(&z -> cond);
+  }
+  pthread_mutex_unlock(&z -> lock);
+
+  if (ok) {
+    deflateEnd(&zs);
+  }
+  return NULL;
+}
+
+/* write the compressed blocks out in the order they came in. after a
+ * failure blocks are still taken off so nothing upstream blocks */
+static void *gz_write(void *arg) {
+  gz_writer *z = arg;
+  gz_slot *s;
+  int failed;
+
+  pthread_mutex_lock(&z -> lock);
+  for (;;) {
+    s = &z -> slots[z -> next_write % z -> nslots];
+    if (z -> next_write == z -> next_fill && z -> eof) {
+      break;
+    }
+    if (z -> next_write == z -> next_fill || s -> state != SLOT_DONE) {
+      pthread_cond_wait(&z -> cond, &z -> lock);
+      continue;
+    }
+    failed = z -> failed;
+    pthread_mutex_unlock(&z -> lock);
+
+    if (!failed && write_all(z -> out_fd, s -> out, s -> out_len)) {
+      perror("gzip write");
+      failed = 1;
+    }
+    io_trail_moved(&z -> trail, s -> out_len);
+
+    pthread_mutex_lock(&z -> lock);
+    if (failed) {
+      z -> failed = 1;
+    }
+    s -> state = SLOT_EMPTY;
+    z -> next_write++;
+    pthread_cond_broadcast(&z -> cond);
+  }
+  pthread_mutex_unlock(&z -> lock);
+  return NULL;
+}
+
+/* start compressing into out_fd with nthreads workers, the tar stream
+ * goes into gz_fd() and has to be closed with gz_finish()
+ * returns the writer on success NULL on failure */
+gz_writer *gz_start(int out_fd, int nthreads, int level) {
+  gz_writer *z;
+  z_stream zs;
+  int fds[2], i;
+
+  if ((z = calloc(1, sizeof(gz_writer))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  z -> out_fd = out_fd;
+  z -> level = level;
+  io_trail_init(&z -> trail, out_fd, 1, lseek(out_fd, 0, SEEK_CUR));
+
+  /* worst case size of one compressed block */
+  memset(&zs, '\0', sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "gzip: bad compression level %d\n", level);
+    free(z);
+    return NULL;
+  }
+  z -> out_cap = deflateBound(&zs, GZ_BLOCK);
+  deflateEnd(&zs);
+
+  /* two blocks per worker keeps everyone busy while the writer
+   * catches up */
+  z -> nslots = 2 * nthreads;
+  if ((z -> slots = calloc(z -> nslots, sizeof(gz_slot))) == NULL ||
+      (z -> workers = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+    perror("calloc");
+    free(z -> slots);
+    free(z);
+    return NULL;
+  }
+  for (i = 0; i < z -> nslots; i++) {
+    z -> slots[i].in = malloc(GZ_BLOCK);
+    z -> slots[i].out = malloc(z -> out_cap);
+    if (z -> slots[i].in == NULL || z -> slots[i].out == NULL) {
+      perror("malloc");
+      z -> nslots = i + 1;
+      gz_finish(z);
+      return NULL;
+    }
+  }
+  if (open_pipe(fds)) {
+    z -> pipe_r = z -> pipe_w = -1;
+    gz_finish(z);
+    return NULL;
+  }
+  z -> pipe_r = fds[0];
+  z -> pipe_w = fds[1];
+  pthread_mutex_init(&z -> lock, NULL);
+  pthread_cond_init(&z -> cond, NULL);
+
+  if (pthread_create(&z -> splitter, NULL, gz_split, z)) {
+    fprintf(stderr, "gz_start: unable to start threads\n");
+    close(z -> pipe_r);
+    close(z -> pipe_w);
+    z -> pipe_r = z -> pipe_w = -1;
+    gz_finish(z);
+    return NULL;
+  }
+  pthread_create(&z -> writer, NULL, gz_write, z);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&z -> workers[i], NULL, gz_work, z)) {
+      break;
+    }
+  }
+  z -> nworkers = i;
+  return z;
+}
+
+/* the end of the pipe the tar stream gets written to */
+int gz_fd(gz_writer *z) {
+  return z -> pipe_w;
+}
+
+/* end the stream, wait for the last block to be written and free
+ * everything. 0 on success, -1 if anything went wrong */
+int gz_finish(gz_writer *z) {
+  int i, failed;
+  if (z -> pipe_w > 0) {
+    close(z -> pipe_w);
+    pthread_join(z -> splitter, NULL);
+    for (i = 0; i < z -> nworkers; i++) {
+      pthread_join(z -> workers[i], NULL);
+    }
+    pthread_join(z -> writer, NULL);
+    close(z -> pipe_r);
+    pthread_mutex_destroy(&z -> lock);
+    pthread_cond_destroy(&z -> cond);
+  }
+  io_trail_end(&z -> trail, 1);
+  failed = z -> failed;
+  for (i = 0; i < z -> nslots; i++) {
+    free(z -> slots[i].in);
+    free(z -> slots[i].out);
+  }
+  free(z -> slots);
+  free(z -> workers);
+  free(z);
+  return failed ? -1 : 0;
+}
+
+/* inflate every member of the input into the pipe. anything after the
+ * last member that isn't another member (tape padding) is ignored */
+static void *gunzip_run(void *arg) {
+  gz_reader *r = arg;
+  uint8_t *out;
+  z_stream zs;
+  ssize_t n;
+  int ret, in_member = 0, src_eof = r -> src_fd == -1;
+  io_trail trail;
+
+  memset(&zs, '\0', sizeof(zs));
+  if ((out = malloc(GZ_OUT)) == NULL || inflateInit2(&zs, 15 + 32) != Z_OK) {
+    fprintf(stderr, "gzip: unable to start inflating\n");
+    free(out);
+    r -> failed = 1;
+    close(r -> pipe_w);
+    return NULL;
+  }
+  zs.next_in = (uint8_t *) r -> mem;
+  zs.avail_in = r -> mem_len;
+  io_trail_init(&trail, src_eof ? -1 : r -> src_fd, 0, 0);
+
+  for (;;) {
+    if (zs.avail_in == 0 && !src_eof) {
+      if ((n = read(r -> src_fd, r -> in, GZ_IN)) == -1) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	perror("gzip read");
+	r -> failed = 1;
+	break;
+      }
+      src_eof = n == 0;
+      io_trail_moved(&trail, n);
+      zs.next_in = r -> in;
+      zs.avail_in = n;
+    }
+    if (zs.avail_in == 0 && src_eof) {
+      if (in_member) {
+	fprintf(stderr, "gzip: archive truncated\n");
+	r -> failed = 1;
+      }
+      break;
+    }
+
+    zs.next_out = out;
+    zs.avail_out = GZ_OUT;
+    uint64_t t0 = STATS_START();
+    ret = inflate(&zs, Z_NO_FLUSH);
+    STATS_END(PH_INFLATE, t0, 1, GZ_OUT - zs.avail_out);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      if (in_member) {
+	fprintf(stderr, "gzip: %s\n", zs.msg ? zs.msg : "corrupt data");
+	r -> failed = 1;
+      }
+      break;
+    }
+    if (write_all(r -> pipe_w, out, GZ_OUT - zs.avail_out)) {
+      perror("gzip write");
+      r -> failed = 1;
+      break;
+    }
+    in_member = ret != Z_STREAM_END;
+    if (ret == Z_STREAM_END) {
+      inflateReset(&zs);
+    }
+  }
+
+  io_trail_end(&trail, 0);
+  inflateEnd(&zs);
+  free(out);
+  close(r -> pipe_w);
+  return NULL;
+}
+
+/* start inflating pre and then src_fd, see gz.h
+ * returns the reader on success NULL on failure */
+gz_reader *gunzip_start(int src_fd, const uint8_t *pre, size_t pre_len) {
+  gz_reader *r;
+  int fds[2];
+
+  if ((r = calloc(1, sizeof(gz_reader))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  r -> src_fd = src_fd;
+  if (src_fd == -1) {
+    r -> mem = pre;
+    r -> mem_len = pre_len;
+  } else {
+    if ((r -> in = malloc(pre_len > GZ_IN ? pre_len : GZ_IN)) == NULL) {
+      perror("malloc");
+      free(r);
+      return NULL;
+    }
+    memcpy(r -> in, pre, pre_len);
+    r -> mem = r -> in;
+    r -> mem_len = pre_len;
+  }
+
+  if (open_pipe(fds)) {
+    free(r -> in);
+    free(r);
+    return NULL;
+  }
+  r -> pipe_r = fds[0];
+  r -> pipe_w = fds[1];
+  if (pthread_create(&r -> thread, NULL, gunzip_run, r)) {
+    fprintf(stderr, "gunzip_start: unable to start thread\n");
+    close(r -> pipe_r);
+    close(r -> pipe_w);
+    free(r -> in);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* the end of the pipe the tar stream comes out of */
+int gunzip_fd(gz_reader *r) {
+  return r -> pipe_r;
+}
+
+/* throw away whatever the reader didn't get to, wait for the thread and
+ * free everything. 0 on success, -1 if the input was bad */
+int gunzip_finish(gz_reader *r) {
+  uint8_t scratch[4096];
+  int failed;
+  while (read(r -> pipe_r, scratch, sizeof(scratch)) > 0);
+  pthread_join(r -> thread, NULL);
+  close(r -> pipe_r);
+  failed = r -> failed;
+  free(r -> in);
+  free(r);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef GZ
+#define GZ
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GZ_BLOCK (1 << 20)
+#define GZ_LEVEL 6
+
+/* true if the bytes at p start a gzip member */
+#define GZ_MAGIC(p) ((p)[0] == 0x1f && (p)[1] == 0x8b)
+
+/* compressing end of a pipe. everything written to gz_fd() is cut
+ * into GZ_BLOCK pieces, each compressed on its own by a pool of
+ * threads into a complete gzip member, and the members are written to
+ * out_fd in order. concatenated members are still one valid .gz file */
+typedef struct gz_writer gz_writer;
+
+gz_writer *gz_start(int out_fd, int nthreads, int level);
+
+int gz_fd(gz_writer *z);
+
+int gz_finish(gz_writer *z);
+
+/* decompressing end of a pipe. a thread inflates every member found
+ * in pre followed by the rest of src_fd and writes the tar stream to
+ * gunzip_fd(). pre is copied, unless src_fd is -1 in which case it is
+ * the whole input (a mapped file) and has to outlive the reader */
+typedef struct gz_reader gz_reader;
+
+gz_reader *gunzip_start(int src_fd, const uint8_t *pre, size_t pre_len);
+
+int gunzip_fd(gz_reader *r);
+
+int gunzip_finish(gz_reader *r);
+#endif
@@ -0,0 +1,210 @@
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "id_cache.h"
+
+#define TABLE_START 256
+
+/* one open addressed slot, keyed by id or by name depending on
+ * which table it lives in */
+typedef struct id_slot {
+  uint8_t used;
+  uint8_t found;
+  uint32_t id;
+  char name[ID_NAME_LEN + 1];
+} id_slot;
+
+typedef struct id_table {
+  id_slot *slots;
+  size_t cap;
+  size_t count;
+} id_table;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static id_table uid_names, gid_names, uname_ids, gname_ids;
+static unsigned long hits, misses;
+
+static uint32_t hash_id(uint32_t id) {
+  /* ids come in runs, spread them out */
+  id ^= id >> 16;
+  id *= 0x45d9f3b;
+  id ^= id >> 16;
+  return id;
+}
+
+static uint32_t hash_name(char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (uint8_t) *name) * 16777619u;
+  }
+  return h;
+}
+
+/* slot for the key, either the one holding it or the empty one it
+ * would go in. by_name picks which key to compare. NULL on failure */
+static id_slot *probe(id_table *t, uint32_t id, char *name, int by_name);
+
+static int grow(id_table *t, int by_name) {
+  id_table old = *t;
+  size_t i;
+  id_slot *s;
+  t -> cap = old.cap ? old.cap * 2 : TABLE_START;
+  t -> count = 0;
+  if ((t -> slots = calloc(t -> cap, sizeof(id_slot))) == NULL) {
+    perror("calloc");
+    *t = old;
+    return -1;
+  }
+  for (i = 0; i < old.cap; i++) {
+    if (old.slots[i].used) {
+      s = probe(t, old.slots[i].id, old.slots[i].name, by_name);
+      *s = old.slots[i];
+      t -> count++;
+    }
+  }
+  free(old.slots);
+  return 0;
+}
+
+static id_slot *probe(id_table *t, uint32_t id, char *name, int by_name) {
+  size_t i, mask;
+  id_slot *s;
+  if (t -> cap == 0 && grow(t, by_name)) {
+    return NULL;
+  }
+  mask = t -> cap - 1;
+  for (i = (by_name ? hash_name(name) : hash_id(id)) & mask; ; i = (i + 1) & mask) {
+    s = &t -> slots[i];
+    if (!s -> used) {
+      return s;
+    }
+    if (by_name ? strcmp(s -> name, name) == 0 : s -> id == id) {
+      return s;
+    }
+  }
+}
+
+/* new slot for the key, growing at half full. caller holds the lock */
+static id_slot *insert(id_table *t, uint32_t id, char *name, int by_name) {
+  id_slot *s;
+  if ((t -> count + 1) * 2 > t -> cap && grow(t, by_name)) {
+    return NULL;
+  }
+  if ((s = probe(t, id, name, by_name)) == NULL) {
+    return NULL;
+  }
+  s -> used = 1;
+  s -> id = id;
+  strncpy(s -> name, name, ID_NAME_LEN);
+  s -> name[ID_NAME_LEN] = '\0';
+  t -> count++;
+  return s;
+}
+
+/* copy of a cached name so the caller doesn't hold a pointer into a
+ * table that can move. one per thread and per kind */
+static __thread char uname_buff[ID_NAME_LEN + 1];
+static __thread char gname_buff[ID_NAME_LEN + 1];
+
+/* name for uid, "" if the passwd database doesn't know it */
+char *uid_to_name(uid_t uid) {
+  id_slot *s;
+  struct passwd *pw;
+  pthread_mutex_lock(&cache_lock);
+  if ((s = probe(&uid_names, uid, NULL, 0)) != NULL && s -> used) {
+    hits++;
+  } else {
+    misses++;
+    pw = getpwuid(uid);
+    if ((s = insert(&uid_names, uid, pw ? pw -> pw_name : "", 0)) != NULL) {
+      s -> found = pw != NULL;
+    }
+  }
+  strcpy(uname_buff, s ? s -> name : "");
+  pthread_mutex_unlock(&cache_lock);
+  return uname_buff;
+}
+
+/* name for gid, "" if the group database doesn't know it */
+char *gid_to_name(gid_t gid) {
+  id_slot *s;
+  struct group *gr;
+  pthread_mutex_lock(&cache_lock);
+  if ((s = probe(&gid_names, gid, NULL, 0)) != NULL && s -> used) {
+    hits++;
+  } else {
+    misses++;
+    gr = getgrgid(gid);
+    if ((s = insert(&gid_names, gid, gr ? gr -> gr_name : "", 0)) != NULL) {
+      s -> found = gr != NULL;
+    }
+  }
+  strcpy(gname_buff, s ? s -> name : "");
+  pthread_mutex_unlock(&cache_lock);
+  return gname_buff;
+}
+
+/* uid for name, 0 on success -1 if there is no such user */
+int name_to_uid(char *name, uid_t *uid) {
+  id_slot *s;
+  struct passwd *pw;
+  int found;
+  if (name[0] == '\0') {
+    return -1;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if ((s = probe(&uname_ids, 0, name, 1)) != NULL && s -> used) {
+    hits++;
+  } else {
+    misses++;
+    pw = getpwnam(name);
+    if ((s = insert(&uname_ids, pw ? pw -> pw_uid : 0, name, 1)) != NULL) {
+      s -> found = pw != NULL;
+    }
+  }
+  found = s && s -> found;
+  if (found) {
+    *uid = s -> id;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return found ? 0 : -1;
+}
+
+/* gid for name, 0 on success -1 if there is no such group */
+int name_to_gid(char *name, gid_t *gid) {
+  id_slot *s;
+  struct group *gr;
+  int found;
+  if (name[0] == '\0') {
+    return -1;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if ((s = probe(&gname_ids, 0, name, 1)) != NULL && s -> used) {
+    hits++;
+  } else {
+    misses++;
+    gr = getgrnam(name);
+    if ((s = insert(&gname_ids, gr ? gr -> gr_gid : 0, name, 1)) != NULL) {
+      s -> found = gr != NULL;
+    }
+  }
+  found = s && s -> found;
+  if (found) {
+    *gid = s -> id;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return found ? 0 : -1;
+}
+
+/* lookups answered from the cache and lookups that had to ask, for --stats */
+void id_cache_counts(unsigned long *hit, unsigned long *miss) {
+  pthread_mutex_lock(&cache_lock);
+  *hit = hits;
+  *miss = misses;
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,22 @@
+#ifndef ID_CACHE
+#define ID_CACHE
+
+#include <sys/types.h>
+
+/* uname/gname fields are 32 bytes in a ustar header */
+#define ID_NAME_LEN 32
+
+/* process wide uid/gid <-> name cache in front of the passwd and group
+ * databases. misses are cached too, a host that can't resolve an id
+ * once won't be asked again. safe to call from any thread */
+
+char *uid_to_name(uid_t uid);
+
+char *gid_to_name(gid_t gid);
+
+int name_to_uid(char *name, uid_t *uid);
+
+int name_to_gid(char *name, gid_t *gid);
+
+void id_cache_counts(unsigned long *hit, unsigned long *miss);
+#endif
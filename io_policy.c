@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "io_policy.h"
+
+int io_nocache = 0;
+
+/* start following fd from offset pos, reading or writing. a reader
+ * also tells the kernel to read ahead harder. pipes and the like have
+ * no page cache to spare, those are left alone */
+void io_trail_init(io_trail *t, int fd, int writing, off_t pos) {
+  struct stat st;
+  t -> fd = -1;
+  t -> writing = writing;
+  t -> pos = t -> dropped = t -> flushed = pos;
+  if (!io_nocache || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  t -> fd = fd;
+  if (!writing) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+/* n more bytes went through at the trail's position. a reader drops
+ * each window once it is past it. a writer starts writeback of each
+ * window as it fills, and drops the one before once that is on disk,
+ * so there is only ever a window or two of it in the cache */
+void io_trail_moved(io_trail *t, off_t n) {
+  t -> pos += n;
+  if (t -> fd == -1) {
+    return;
+  }
+  if (!t -> writing) {
+    if (t -> pos - t -> dropped >= IO_WINDOW) {
+      posix_fadvise(t -> fd, t -> dropped, t -> pos - t -> dropped, POSIX_FADV_DONTNEED);
+      t -> dropped = t -> pos;
+    }
+    return;
+  }
+  if (t -> pos - t -> flushed < IO_WINDOW) {
+    return;
+  }
+  sync_file_range(t -> fd, t -> flushed, t -> pos - t -> flushed, SYNC_FILE_RANGE_WRITE);
+  if (t -> flushed > t -> dropped) {
+    sync_file_range(t -> fd, t -> dropped, t -> flushed - t -> dropped,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(t -> fd, t -> dropped, t -> flushed - t -> dropped, POSIX_FADV_DONTNEED);
+    t -> dropped = t -> flushed;
+  }
+  t -> flushed = t -> pos;
+}
+
+/* done with the fd. a reader drops the rest of it. a writer starts
+ * writeback of the rest and drops whatever is clean already, or with
+ * wait set waits for all of it to get to disk and drops it all */
+void io_trail_end(io_trail *t, int wait) {
+  if (t -> fd == -1) {
+    return;
+  }
+  if (t -> writing) {
+    sync_file_range(t -> fd, wait ? t -> dropped : t -> flushed, 0,
+		    wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		    SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE);
+  }
+  posix_fadvise(t -> fd, t -> dropped, 0, POSIX_FADV_DONTNEED);
+  t -> fd = -1;
+}
+
+/* path is coming up soon, have the kernel start on its first window */
+void io_prefetch(char *path, off_t size) {
+  int fd;
+  if (!io_nocache || (fd = open(path, O_RDONLY)) == -1) {
+    return;
+  }
+  posix_fadvise(fd, 0, size < IO_WINDOW ? size : IO_WINDOW, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+/* [off, off + len) of fd won't be needed again */
+void io_drop(int fd, off_t off, off_t len) {
+  if (io_nocache && len > 0) {
+    posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+  }
+}
+
+/* [off, off + len) of fd is about to be read */
+void io_willneed(int fd, off_t off, off_t len) {
+  if (io_nocache && len > 0) {
+    posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+  }
+}
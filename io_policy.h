@@ -0,0 +1,39 @@
+#ifndef IO_POLICY
+#define IO_POLICY
+
+#include <sys/types.h>
+
+/* how far ahead of a reader the kernel is asked to fetch, and how much
+ * of a file piles up behind us before it is dropped */
+#define IO_WINDOW (8 << 20)
+
+/* files past the one being read that get a WILLNEED */
+#define IO_AHEAD 4
+
+/* --no-cache: read and write around the page cache as much as the
+ * kernel lets us, so archiving on a busy box doesn't push everyone
+ * else's data out. everything below does nothing when it is off */
+extern int io_nocache;
+
+/* one fd being read or written front to back. pages behind it are
+ * dropped a window at a time, writes are pushed out first */
+typedef struct io_trail {
+  int fd;            /* -1 when there is nothing to do */
+  int writing;
+  off_t pos;         /* offset of the next byte read or written */
+  off_t dropped;     /* everything before this is out of the cache */
+  off_t flushed;     /* writes: writeback started up to here */
+} io_trail;
+
+void io_trail_init(io_trail *t, int fd, int writing, off_t pos);
+
+void io_trail_moved(io_trail *t, off_t n);
+
+void io_trail_end(io_trail *t, int wait);
+
+void io_prefetch(char *path, off_t size);
+
+void io_drop(int fd, off_t off, off_t len);
+
+void io_willneed(int fd, off_t off, off_t len);
+#endif
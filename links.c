@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "links.h"
+
+typedef struct link_slot {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t name_off;   /* + 1, 0 for an empty slot */
+} link_slot;
+
+/* open addressed on (dev, ino), slots keep offsets into one packed
+ * names buffer so it can be grown without fixing them up */
+struct link_table {
+  link_slot *slots;
+  uint64_t mask;
+  uint64_t count;
+  char *names;
+  uint64_t names_len;
+  uint64_t names_cap;
+};
+
+static uint64_t hash_id(uint64_t dev, uint64_t ino) {
+  uint64_t h = ino * 0x9E3779B97F4A7C15ULL ^ dev;
+  return h ^ (h >> 29);
+}
+
+static link_slot *slot_for(link_slot *slots, uint64_t mask, uint64_t dev, uint64_t ino) {
+  uint64_t i;
+  for (i = hash_id(dev, ino) & mask; slots[i].name_off; i = (i + 1) & mask) {
+    if (slots[i].dev == dev && slots[i].ino == ino) {
+      break;
+    }
+  }
+  return &slots[i];
+}
+
+/* returns the table on success NULL on failure */
+link_table *links_new(void) {
+  link_table *lt;
+  if ((lt = calloc(1, sizeof(link_table))) == NULL ||
+      (lt -> slots = calloc(256, sizeof(link_slot))) == NULL) {
+    perror("calloc");
+    free(lt);
+    return NULL;
+  }
+  lt -> mask = 255;
+  return lt;
+}
+
+/* the name st's file first went in under, NULL if it hasn't yet */
+char *links_find(link_table *lt, struct stat *st) {
+  link_slot *s = slot_for(lt -> slots, lt -> mask, st -> st_dev, st -> st_ino);
+  return s -> name_off ? lt -> names + s -> name_off - 1 : NULL;
+}
+
+/* remember path as the name st's file went in under
+ * 0 on success -1 on failure */
+int links_add(link_table *lt, struct stat *st, char *path) {
+  size_t len = strlen(path) + 1;
+  link_slot *s, *grown;
+  uint64_t i;
+
+  /* keep it at most half full */
+  if (2 * (lt -> count + 1) > lt -> mask + 1) {
+    if ((grown = calloc(2 * (lt -> mask + 1), sizeof(link_slot))) == NULL) {
+      perror("calloc");
+      return -1;
+    }
+    for (i = 0; i <= lt -> mask; i++) {
+      if (lt -> slots[i].name_off) {
+	*slot_for(grown, 2 * lt -> mask + 1, lt -> slots[i].dev, lt -> slots[i].ino) = lt -> slots[i];
+      }
+    }
+    free(lt -> slots);
+    lt -> slots = grown;
+    lt -> mask = 2 * lt -> mask + 1;
+  }
+  if (lt -> names_len + len > lt -> names_cap) {
+    lt -> names_cap = lt -> names_cap ? lt -> names_cap * 2 : 64 * 1024;
+    while (lt -> names_len + len > lt -> names_cap) {
+      lt -> names_cap *= 2;
+    }
+    char *names;
+    if ((names = realloc(lt -> names, lt -> names_cap)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    lt -> names = names;
+  }
+
+  s = slot_for(lt -> slots, lt -> mask, st -> st_dev, st -> st_ino);
+  if (s -> name_off == 0) {
+    lt -> count++;
+  }
+  s -> dev = st -> st_dev;
+  s -> ino = st -> st_ino;
+  s -> name_off = lt -> names_len + 1;
+  memcpy(lt -> names + lt -> names_len, path, len);
+  lt -> names_len += len;
+  return 0;
+}
+
+void links_free(link_table *lt) {
+  free(lt -> slots);
+  free(lt -> names);
+  free(lt);
+}
@@ -0,0 +1,17 @@
+#ifndef LINKS
+#define LINKS
+
+#include <sys/stat.h>
+
+/* files with more than one name that went into the archive, by
+ * (st_dev, st_ino), so later names can be stored as links to the first */
+typedef struct link_table link_table;
+
+link_table *links_new(void);
+
+char *links_find(link_table *lt, struct stat *st);
+
+int links_add(link_table *lt, struct stat *st, char *path);
+
+void links_free(link_table *lt);
+#endif
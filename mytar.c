@@ -1,6 +1,4 @@
-#include <math.h>
 #include <fcntl.h>
-#include <stdint.h>
 #include "arch_head.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -8,15 +6,98 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <string.h>
 #include <pwd.h>
 #include <grp.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include "extract_pool.h"
+#include "arch_buf.h"
+#include "arch_map.h"
+#include "arch_index.h"
+#include "walk.h"
+#include "id_cache.h"
+#include "arena.h"
+#include "select.h"
+#include "gz.h"
+#include "uring.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "pax.h"
+#include "sparse.h"
+#include "links.h"
+#include "dir_cache.h"
+#include "pattern.h"
+#include "read_pool.h"
+#include "directory_tree.h"
+#include "io_policy.h"
+#include <sys/mman.h>
 
-// for the current working directory absolute path
-#define CWD_PATHMAX 2048
 #define BLOCK_SIZE 512
-#define PATHMAX 256
+#define PATHMAX 4096
+
+/* size of the staging buffer in front of the archive (--buffer-size) */
+size_t buf_size = ARCH_BUF_DEFAULT;
+
+/* hand large bodies to copy_file_range/sendfile (--no-zero-copy) */
+int zero_copy = 1;
+
+/* members of the archive being created, written out as a sidecar
+ * <archive>.idx when asked for (--index) */
+int make_index = 0;
+arch_index *member_index = NULL;
+
+/* threads for walking and extracting, 0 means one per cpu (--threads) */
+long nthreads = 0;
+
+/* batch the opens and reads of small files through io_uring when the
+ * kernel has it (--io-uring) */
+int use_uring = 0;
+uring *ring = NULL;
+
+/* previous run of an incremental create (--snapshot), only new and
+ * changed files go in */
+char *snap_name = NULL;
+snapshot *snap = NULL;
+
+/* carry out the removals an incremental archive lists on x
+ * (--incremental). without it the list is just another file */
+int incremental = 0;
+
+/* the members already in the archive when updating (u) */
+int update_newer = 0;
+arch_index *archived = NULL;
+
+/* files with several names already in the archive being written,
+ * the later names go in as hard links */
+link_table *links = NULL;
+
+/* bodies read ahead of the archive writer on their own threads, at
+ * most this many bytes of them. 0 reads every body on the writer
+ * (--read-buffer) */
+size_t read_buf = READ_POOL_DEFAULT;
+read_pool *readers = NULL;
+
+/* order c archives in (--sort). anything but SORT_NONE catalogs the
+ * whole tree before the first body is read */
+int sort_order = SORT_NONE;
+
+/* --exclude/--include globs, NULL when there are none. c never even
+ * opens a directory they leave out, t and x skip members by name */
+pattern_set *patterns = NULL;
+
+/* members that went in short or not at all. the archive still comes
+ * out whole, but the exit status says so */
+int members_failed = 0;
+
+/* where verbose create output goes, stderr when the archive itself
+ * is going to stdout */
+FILE *vout = NULL;
+
+/* print where the time went on stderr when done, as json with
+ * --stats=json */
+int stats_json = 0;
 
 #ifndef BITMASKS
 #define BITMASKS
@@ -26,26 +107,16 @@
 #define VMASK 0x04
 #define SMASK 0x02
 #define FMASK 0x01
+#define ZMASK 0x40
+#define RMASK 0x80
 #endif
 
-int ceiling(float num) {
-  float whole_num;
-  float frac_num;
-  frac_num = modff(num, &whole_num);
-  
-  if (frac_num > 0) {
-    return (int) (whole_num + 1);
-  } else {
-    return (int) whole_num;
-  }
-}
-
 uint8_t get_param_mask(char* params) {
   if (!params) {
-    printf("usage: mytar [ctxvS]f tarfile [ path [ ... ] ]");
+    printf("usage: mytar [ctxruvSz]f tarfile [ path [ ... ] ]");
     exit(EXIT_FAILURE);
   }
-  uint8_t mask;
+  uint8_t mask = 0;
   int i;
   for (i = 0; params[i]; i++) {
     switch (params[i]) {
@@ -61,26 +132,41 @@ uint8_t get_param_mask(char* params) {
       break;
     case 'f': mask = mask | FMASK;
       break;
+    case 'z': mask = mask | ZMASK;
+      break;
+    case 'r': mask = mask | RMASK;
+      break;
+    case 'u': mask = mask | RMASK;
+      update_newer = 1;
+      break;
     default: 
-      printf("usage: mytar [ctxvS]f tarfile [ path [ ... ] ]");
+      printf("usage: mytar [ctxruvSz]f tarfile [ path [ ... ] ]");
       exit(EXIT_FAILURE);
       break;
     }
   }
   if (!(mask & 0x01)) {
-    printf("usage: mytar [ctxvS]f tarfile [ path [ ... ] ]");
+    printf("usage: mytar [ctxruvSz]f tarfile [ path [ ... ] ]");
     exit(EXIT_FAILURE);
   }
   return mask;
 }
 
 
+int thread_count(void) {
+  long n = nthreads;
+  if (n < 1 && (n = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+    n = 1;
+  }
+  return n;
+}
+
 /* sets end of directory name to '/' regardless if already present
  * or not */
 char *set_dir_name(char dir_name[]) {
   int len;
   len = strlen(dir_name);
-  if(len >= PATHMAX) {
+  if(len + 1 >= PATHMAX) {
     fprintf(stderr, "dir_name too long");
     return NULL;
   } else {
@@ -94,372 +180,1693 @@ char *set_dir_name(char dir_name[]) {
   }
 }
 
-/* 0 on success, -1 on failure */
-int append_file(char *fname, char *path, int arch_fd, uint8_t params) {
-  header *h;
-  if ((h = create_header(fname, path, params)) == NULL) {
+/* note a member whose first header is at offset in the index, if
+ * there is one. size runs from the end of that header to the end of
+ * the body, so it takes in any headers in between */
+void index_member(char *path, off_t offset, off_t size, header *h) {
+  if (member_index && index_add(member_index, path, offset, size, (h -> typeflag)[0],
+				  HEADER_NUM(h, mtime))) {
+    fprintf(stderr, "%s: unable to index, dropping the index\n", path);
+    index_free(member_index);
+    member_index = NULL;
+  }
+}
+
+/* last part of path, for the names of extra headers */
+char *base_name(char *path) {
+  char *p = path + strlen(path);
+  /* a directory's trailing '/' stays with it */
+  while (p > path && p[-1] == '/') {
+    p--;
+  }
+  while (p > path && p[-1] != '/') {
+    p--;
+  }
+  return p;
+}
+
+/* queue an extended header ahead of h for what its ustar fields
+ * couldn't hold: a path that didn't split into name and prefix, a link
+ * target over 100 chars or a size past 8G. the usual member needs
+ * none, which is told by a byte or two init_name_pre and put_num left
+ * 0 on success -1 on failure */
+int queue_pax(header *h, char *path, char *link, arch_buf *out) {
+  char recs[2 * PATHMAX + 128], num[24], name[sizeof(h -> name) + 1];
+  size_t len = 0;
+  header *x;
+
+  if (h -> name[sizeof(h -> name) - 1] && strcmp(get_str_fname(h), path)) {
+    len += pax_record(recs + len, sizeof(recs) - len, "path", path);
+  }
+  if (link && strlen(link) > sizeof(h -> linkname)) {
+    len += pax_record(recs + len, sizeof(recs) - len, "linkpath", link);
+  }
+  if (h -> size[0] & 0x80) {
+    snprintf(num, sizeof(num), "%lld", (long long) HEADER_NUM(h, size));
+    len += pax_record(recs + len, sizeof(recs) - len, "size", num);
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  snprintf(name, sizeof(name), "PaxHeaders.0/%s", base_name(path));
+  if ((x = derive_header(h, name, 'x', len)) == NULL ||
+      buf_append(out, x, sizeof(header)) || buf_append(out, recs, len) ||
+      buf_zeros(out, BLOCK_ROUND(len) - len)) {
     return -1;
   }
-  write(arch_fd, h, sizeof(header));
-  
+  return 0;
+}
+
+/* index h, queue it behind an extended header if it needs one and say
+ * so if verbose. link is the full target of a link member, NULL when
+ * the linkname field has all of it. 0 on success -1 on failure */
+int queue_header(header *h, char *path, char *link, arch_buf *out, uint8_t params) {
+  off_t start = out -> pos;
+  if (queue_pax(h, path, link, out)) {
+    return -1;
+  }
+  index_member(path, start, out -> pos - start + HEADER_NUM(h, size), h);
+  if (buf_append(out, h, sizeof(header))) {
+    return -1;
+  }
+
   /* if verbose print name */
   if (params & VMASK) {
-    printf("%s\n", path);
+    fprintf(vout, "%s\n", path);
   }
+  return 0;
+}
 
-  struct stat st;
-  if (stat(fname, &st)) {
-    perror("stat");
+/* move len bytes of src_fd from where it is into the archive. exactly
+ * len bytes go in even if the file changed under us, whatever can't be
+ * read is zero filled so the header stays true. src follows the reads
+ * for --no-cache, NULL if they aren't in order
+ * 0 on success, -1 on failure */
+int copy_body(int src_fd, char *path, arch_buf *out, off_t len, io_trail *src) {
+  uint8_t *dst;
+  size_t avail;
+  ssize_t num_read;
+  off_t left = len;
+  int err = 0;
+  off_t moved, want, before;
+  uint64_t t0;
+
+  /* big bodies go file to file inside the kernel, anything it
+   * can't move gets read through the buffer below. a window at a
+   * time when what was read is being dropped */
+  if (zero_copy && len >= ZERO_COPY_MIN) {
+    do {
+      want = src && src -> fd != -1 && left > IO_WINDOW ? IO_WINDOW : left;
+      before = out -> pos;
+      if ((moved = buf_copy_fd(out, src_fd, want)) == -1) {
+	/* some of it may have gone in, where src_fd is now is
+	 * anyone's guess. zero fill the rest */
+	left -= out -> pos - before;
+	err = -1;
+	break;
+      }
+      left -= moved;
+      if (src) {
+	io_trail_moved(src, moved);
+      }
+    } while (left > 0 && moved == want);
+  }
+  while (!err && left > 0) {
+    if ((dst = buf_space(out, &avail)) == NULL) {
+      return -1;
+    }
+    if ((off_t) avail > left) {
+      avail = left;
+    }
+    t0 = STATS_START();
+    if ((num_read = read(src_fd, dst, avail)) == -1) {
+      /* header is already queued, so pad out the body to
+       * keep the archive walkable */
+      perror("read src");
+      err = -1;
+      break;
+    }
+    STATS_END(PH_READ, t0, 1, num_read);
+    if (num_read == 0) {
+      fprintf(stderr, "%s: file shrank, padding with zeros\n", path);
+      break;
+    }
+    buf_commit(out, num_read);
+    left -= num_read;
+    if (src) {
+      io_trail_moved(src, num_read);
+    }
+  }
+  if (buf_zeros(out, left)) {
     return -1;
   }
+  return err;
+}
 
-  /* if not a regular file then done since not
-   * writing anything else */
-  if (!(S_ISREG(st.st_mode))) {
-    free(h);
-    printf("fname: %s\n", fname);
-    return 0;
+/* store a sparse file as GNU sparse 1.0: an extended header with the
+ * real name and size, then a member whose body is the map of the data
+ * runs followed by the runs themselves, holes left out. h is the
+ * file's own header. 0 on success, -1 on failure */
+int append_sparse(header *h, char *path, int src_fd, arch_buf *out, uint8_t params,
+		  sparse_ext *exts, int n, off_t realsize) {
+  char recs[PAX_NAME_MAX + 256], num[24], name[101], *map, *base;
+  size_t len = 0, map_len;
+  off_t stored, start = out -> pos;
+  header *x, *member;
+  int i, err = 0;
+
+  snprintf(num, sizeof(num), "%lld", (long long) realsize);
+  len += pax_record(recs + len, sizeof(recs) - len, "GNU.sparse.major", "1");
+  len += pax_record(recs + len, sizeof(recs) - len, "GNU.sparse.minor", "0");
+  len += pax_record(recs + len, sizeof(recs) - len, "GNU.sparse.name", path);
+  len += pax_record(recs + len, sizeof(recs) - len, "GNU.sparse.realsize", num);
+
+  if ((map = sparse_map_text(exts, n, &map_len)) == NULL) {
+    return -1;
   }
-  
-  /* write contents to file */
-  char buff[BLOCK_SIZE];
-  int num_read, num_write, src_fd;
-  memset(buff, '\0', BLOCK_SIZE);
-  if ((src_fd = open(fname, O_RDONLY)) == -1) {
-    perror("open src");
+  for (i = 0, stored = map_len; i < n; i++) {
+    stored += exts[i].size;
+  }
+
+  /* the names are only seen by readers that don't know the format,
+   * they get the map and the data runs back as a plain file */
+  base = base_name(path);
+  snprintf(name, sizeof(name), "PaxHeaders.0/%s", base);
+  if ((x = derive_header(h, name, 'x', len)) == NULL) {
+    free(map);
     return -1;
   }
-  
-  while((num_read = read(src_fd, buff, BLOCK_SIZE)) > 0) {
-    if ((num_write = write(arch_fd, buff, BLOCK_SIZE)) == -1) {
-      perror("write");
-      return -1;
-    }
-    memset(buff, '\0', BLOCK_SIZE);
+  snprintf(name, sizeof(name), "GNUSparseFile.0/%s", base);
+  if ((member = derive_header(h, name, '0', stored)) == NULL) {
+    free(map);
+    return -1;
   }
-  
-  if (num_read == -1) {
-    perror("read src");
+  if (buf_append(out, x, sizeof(header)) || buf_append(out, recs, len) ||
+      buf_zeros(out, BLOCK_ROUND(len) - len) || buf_append(out, member, sizeof(header)) ||
+      buf_append(out, map, map_len)) {
+    free(map);
     return -1;
   }
+  free(map);
+  if (params & VMASK) {
+    fprintf(vout, "%s\n", path);
+  }
 
-  free(h);
-  close(src_fd);  
-  return 0;
+  for (i = 0; i < n; i++) {
+    if (lseek(src_fd, exts[i].offset, SEEK_SET) == -1) {
+      perror("lseek");
+      err = -1;
+      if (buf_zeros(out, exts[i].size)) {
+	return -1;
+      }
+    } else if (copy_body(src_fd, path, out, exts[i].size, NULL)) {
+      err = -1;
+    }
+  }
+  if (buf_zeros(out, BLOCK_ROUND(stored) - stored)) {
+    return -1;
+  }
+  index_member(path, start, out -> pos - start - BLOCK_SIZE, h);
+  return err;
 }
 
+/* 0 on success, -1 on failure */
+int append_member(char *fname, char *path, arch_buf *out, uint8_t params, struct stat *st) {
+  /* the header only lives until it is copied into the buffer */
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  header *h;
+  if ((h = create_header(fname, path, params, st)) == NULL) {
+    arena_release(scratch, mark);
+    return -1;
+  }
+  off_t fsize = HEADER_NUM(h, size);
+  int is_reg = (h -> typeflag)[0] == '0';
+  int src_fd = -1;
+  uint64_t t0;
 
-int input_DIR(char *dir_name, char *path,int arch_fd, uint8_t params) {
-  //add the current file to tht archive (print if verbose)
-  if (strlen(path) < PATHMAX) {
-    dir_name = set_dir_name(dir_name);
-    path = set_dir_name(path);
-    append_file(dir_name, path, arch_fd, params);
-  } else {
-    fprintf(stderr, "path excedes PATHMAX (256) chars");
+  /* open before queueing the header so a file we can't read
+   * doesn't leave a header with no body behind */
+  t0 = STATS_START();
+  if (is_reg && (src_fd = open(fname, O_RDONLY)) == -1) {
+    perror("open src");
+    arena_release(scratch, mark);
     return -1;
   }
-  
-  // save the cwd so can get back to it at the end
-  char cwd[CWD_PATHMAX];
-  if (getcwd(cwd, sizeof(cwd)) == NULL) {
-    perror("input_DIR; getcwd");
+  io_trail src;
+  if (is_reg) {
+    STATS_END(PH_OPEN, t0, 1, 0);
+    io_trail_init(&src, src_fd, 0, 0);
+  }
+  /* a file with fewer blocks than its size has holes, ask where */
+  sparse_ext *exts = NULL;
+  int nexts = 0;
+  if (is_reg && (off_t) st -> st_blocks * 512 < fsize &&
+      (nexts = sparse_scan(src_fd, fsize, &exts)) > 0) {
+    int err = append_sparse(h, path, src_fd, out, params, exts, nexts, fsize);
+    arena_release(scratch, mark);
+    free(exts);
+    io_trail_end(&src, 0);
+    close(src_fd);
+    return err;
+  }
+  if (nexts == -1) {
+    arena_release(scratch, mark);
+    close(src_fd);
     return -1;
   }
 
-  DIR *dir;
-  struct dirent *entry;
-  if(chdir(dir_name)) {
-    perror("input_DIR; chdir failure");
-    return -1;  // return -1 since file was unwritable (skip and continue)
+  /* a full linkname may have been cut short, then the extended
+   * header needs the whole target */
+  char target[PATHMAX], *link = NULL;
+  ssize_t n;
+  if ((h -> typeflag)[0] == '2' && h -> linkname[sizeof(h -> linkname) - 1] &&
+      (n = readlink(fname, target, sizeof(target) - 1)) > 0) {
+    target[n] = '\0';
+    link = target;
   }
-  
-  if((dir = opendir(".")) == NULL) {
-    perror("input_DIR; opendir failure");
+  if (queue_header(h, path, link, out, params)) {
+    arena_release(scratch, mark);
+    if (src_fd != -1) {
+      close(src_fd);
+    }
     return -1;
-  } 
+  }
+  arena_release(scratch, mark);
 
-  struct stat st;
-  char fpath[PATHMAX];
-  char dname[PATHMAX];
-  while ((entry = readdir(dir))) {
-    if ((strcmp(entry -> d_name, ".") != 0) && (strcmp(entry -> d_name, "..") != 0)) {
-      if ((strlen(entry -> d_name) + strlen(path)) < PATHMAX) {
-	memset(fpath, '\0', PATHMAX);
-	strcat(fpath, path);
-	strcat(fpath, entry -> d_name);
-      } else {
-	fprintf(stderr, "path excedes PATHMAX (256) chars");
-	return -1;
+  /* if not a regular file then done since not
+   * writing anything else */
+  if (!is_reg) {
+    return 0;
+  }
+
+  int err = copy_body(src_fd, path, out, fsize, &src);
+  io_trail_end(&src, 0);
+  t0 = STATS_START();
+  close(src_fd);
+  STATS_END(PH_OPEN, t0, 1, 0);
+
+  /* the block padding */
+  if (buf_zeros(out, BLOCK_ROUND(fsize) - fsize)) {
+    return -1;
+  }
+  return err;
+}
+
+
+/* append path as a hard link to target, 0 on success -1 on failure */
+int append_link(char *fname, char *path, char *target, arch_buf *out, uint8_t params,
+		struct stat *st) {
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  header *h;
+  int err = 0;
+  if ((h = create_link_header(fname, path, target, params, st)) == NULL ||
+      queue_header(h, path, target, out, params)) {
+    err = -1;
+  }
+  arena_release(scratch, mark);
+  return err;
+}
+
+/* 1 if path can stay out of the archive: left out by the patterns,
+ * unchanged since the last snapshot (carried over into the new one), or
+ * with u already in the archive at least as new */
+int skip_member(char *path, struct stat *st) {
+  if (patterns && pattern_skip(patterns, path)) {
+    return 1;
+  }
+  if (snap && !S_ISDIR(st -> st_mode) && snap_unchanged(snap, path, st)) {
+    /* the writer builds the new snapshot, in archive order */
+    if (readers) {
+      rpool_submit(readers, path, path, st, RM_KEEP, 0);
+    } else {
+      snap_add(snap, path, st, 0);
+    }
+    return 1;
+  }
+  return archived && index_newest(archived, path) >= st -> st_mtime;
+}
+
+/* what the walker gets to pass over unseen */
+int prune_member(char *path) {
+  return pattern_prune(patterns, path);
+}
+
+/* append fname as path and note it in the snapshot if there is one
+ * 0 on success, -1 on failure */
+int append_file(char *fname, char *path, arch_buf *out, uint8_t params, struct stat *st) {
+  uint64_t t0 = STATS_START();
+  int multi = links && !S_ISDIR(st -> st_mode) && st -> st_nlink > 1;
+  char *target;
+  int err;
+  /* the body is already in under another name, a link header will do */
+  if (multi && (target = links_find(links, st)) != NULL) {
+    err = append_link(fname, path, target, out, params, st);
+  } else {
+    err = append_member(fname, path, out, params, st);
+    if (multi && !err) {
+      links_add(links, st, path);
+    }
+  }
+  STATS_MEMBER(t0);
+  if (snap) {
+    snap_add(snap, path, st, err);
+  }
+  members_failed += err != 0;
+  return err;
+}
+
+/* append a regular file whose body the read pool has been loading
+ * 0 on success, -1 on failure */
+int append_read(read_pool *rp, read_member *m, arch_buf *out, uint8_t params) {
+  uint64_t t0 = STATS_START();
+  off_t fsize = m -> st.st_size, left = fsize;
+  uint8_t *data;
+  ssize_t n;
+  header *h;
+  int err = 0;
+
+  /* the first piece says whether it opened, like append_member a file
+   * we can't read gets no header */
+  if ((n = rpool_next(rp, m, &data)) == -1) {
+    errno = m -> err;
+    perror("open src");
+    err = -1;
+  } else {
+    arena *scratch = thread_arena();
+    arena_mark mark = arena_save(scratch);
+    if ((h = create_header(m -> fname, m -> path, params, &m -> st)) == NULL ||
+	queue_header(h, m -> path, NULL, out, params)) {
+      err = -1;
+    }
+    arena_release(scratch, mark);
+
+    for (; !err && n > 0 && left > 0; n = rpool_next(rp, m, &data)) {
+      if (n > left) {
+	n = left;
+      }
+      if (buf_append(out, data, n)) {
+	err = -1;
       }
-      if (lstat(entry -> d_name, &st)) {
-	perror("create_arch lstat failure"); //ask about this (need to skip this or just give up)
-      } else if (S_ISDIR(st.st_mode)) {
-	//traverse directory and input files in preorder DSF
-	memset(dname, '\0', PATHMAX);
-	strcat(dname, entry -> d_name);
-        input_DIR(dname, fpath, arch_fd, params);
-      } else if (S_ISREG(st.st_mode)) {
-	//input file into arhive
-	append_file(entry -> d_name, fpath, arch_fd, params);
-      } else if (S_ISLNK(st.st_mode)) {
-	//input symlink into archive
-	append_file(entry -> d_name, fpath, arch_fd, params);
+      left -= n;
+    }
+    if (!err && left > 0) {
+      if (m -> err) {
+	errno = m -> err;
+	perror("read src");
+	err = -1;
+      } else {
+	fprintf(stderr, "%s: file shrank, padding with zeros\n", m -> path);
       }
     }
+    /* the rest of the body, then the block padding */
+    if (h && buf_zeros(out, left + BLOCK_ROUND(fsize) - fsize)) {
+      err = -1;
+    }
+  }
+  STATS_MEMBER(t0);
+  if (snap) {
+    snap_add(snap, m -> path, &m -> st, err);
+  }
+  members_failed += err != 0;
+  return err;
+}
+
+/* 1 if the read pool can load st's body ahead of the writer. big
+ * bodies the kernel copies, files with holes and files with several
+ * names are left to append_file */
+int read_ahead(struct stat *st) {
+  return S_ISREG(st -> st_mode) && st -> st_nlink == 1 &&
+    !(zero_copy && st -> st_size >= ZERO_COPY_MIN) &&
+    (off_t) st -> st_blocks * 512 >= st -> st_size;
+}
+
+/* append fname as path now, or queue it for the read pool's writer
+ * when there is one. 0 on success, -1 on failure */
+int add_file(char *fname, char *path, arch_buf *out, uint8_t params, struct stat *st) {
+  if (readers) {
+    return rpool_submit(readers, fname, path, st, RM_ADD, read_ahead(st));
+  }
+  return append_file(fname, path, out, params, st);
+}
+
+typedef struct emit_ctx {
+  arch_buf *out;
+  uint8_t params;
+} emit_ctx;
+
+/* the read pool's writer, every member comes through here in
+ * archive order */
+void emit_member(read_pool *rp, read_member *m, void *arg) {
+  emit_ctx *ec = arg;
+  if (m -> kind == RM_KEEP) {
+    snap_add(snap, m -> path, &m -> st, 0);
+  } else if (m -> prefetch) {
+    append_read(rp, m, ec -> out, ec -> params);
+  } else {
+    append_file(m -> fname, m -> path, ec -> out, ec -> params, &m -> st);
+  }
+}
+
+/* append a regular file whose body was already read into body
+ * 0 on success, -1 on failure */
+int append_loaded(char *path, arch_buf *out, uint8_t params, struct stat *st, uint8_t *body) {
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  header *h;
+  int err = 0;
+  if ((h = create_header(path, path, params, st)) == NULL ||
+      queue_header(h, path, NULL, out, params)) {
+    err = -1;
+  }
+  arena_release(scratch, mark);
+  if (!err && (buf_append(out, body, st -> st_size) ||
+	       buf_zeros(out, BLOCK_ROUND(st -> st_size) - st -> st_size))) {
+    err = -1;
+  }
+  if (snap) {
+    snap_add(snap, path, st, err);
+  }
+  members_failed += err != 0;
+  return err;
+}
+
+/* append the n small regular files in ents, in order, with all their
+ * opens and reads in flight together. anything the batch couldn't
+ * read whole goes through append_file like usual */
+int append_batch(walk_node *node, walk_entry **ents, int n, arch_buf *out, uint8_t params) {
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  char *paths[URING_BATCH];
+  uint8_t *bufs[URING_BATCH];
+  size_t sizes[URING_BATCH];
+  ssize_t got[URING_BATCH];
+  uint64_t t0, bytes = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    size_t len = strlen(node -> path) + strlen(ents[i] -> name) + 1;
+    paths[i] = arena_alloc(scratch, len);
+    snprintf(paths[i], len, "%s%s", node -> path, ents[i] -> name);
+    sizes[i] = ents[i] -> st.st_size;
+    bufs[i] = arena_alloc(scratch, sizes[i] ? sizes[i] : 1);
+  }
+  t0 = STATS_START();
+  if (uring_load(ring, paths, bufs, sizes, got, n)) {
+    fprintf(stderr, "io_uring failed, going back to plain reads\n");
+    uring_free(ring);
+    ring = NULL;
+    for (i = 0; i < n; i++) {
+      got[i] = -1;
+    }
   }
 
-  // if this fails give up "were lost :("
-  if(chdir(cwd)) {
-    perror("input_DIR; chdir failure");
-    exit(EXIT_FAILURE);  
+  for (i = 0; i < n; i++) {
+    bytes += got[i] > 0 ? got[i] : 0;
   }
+  /* an open, a read and a close each */
+  STATS_END(PH_READ, t0, 3 * n, bytes);
 
+  for (i = 0; i < n; i++) {
+    t0 = STATS_START();
+    if (got[i] == (ssize_t) sizes[i]) {
+      append_loaded(paths[i], out, params, &ents[i] -> st, bufs[i]);
+      STATS_MEMBER(t0);
+    } else {
+      append_file(paths[i], paths[i], out, params, &ents[i] -> st);
+    }
+  }
+  arena_release(scratch, mark);
   return 0;
 }
 
-int insert_EOA(int arch_fd) {
-  char buff[BLOCK_SIZE];
-  memset(buff, '\0', BLOCK_SIZE);
-  if (write(arch_fd, buff, BLOCK_SIZE) != BLOCK_SIZE) {
-    perror("write EOA");
+/* add the directory node and everything under it in preorder DFS.
+ * the walker lists directories ahead of us on its own threads, this
+ * just emits the entries in readdir order so the archive comes out the
+ * same no matter how the listing was scheduled */
+int input_DIR(walker *w, walk_node *node, struct stat *st, arch_buf *out, uint8_t params) {
+  //add the current directory to the archive (print if verbose)
+  if (!skip_member(node -> path, st)) {
+    add_file(node -> path, node -> path, out, params, st);
+  }
+  walk_wait(w, node);
+
+  /* the path buffer comes out of the arena, this recurses once per
+   * level and PATHMAX deep trees would eat the stack */
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  walk_entry *e, *batch[URING_BATCH];
+  char *fpath;
+  int i, n = 0;
+  if ((fpath = arena_alloc(scratch, PATHMAX)) == NULL) {
+    walk_node_free(w, node);
     return -1;
   }
-  if (write(arch_fd, buff, BLOCK_SIZE) != BLOCK_SIZE) {
-    perror("write EOA");
+  for (i = 0; i < node -> nents; i++) {
+    e = &node -> ents[i];
+    snprintf(fpath, PATHMAX, "%s%s", node -> path, e -> name);
+    if (!S_ISDIR(e -> st.st_mode) && skip_member(fpath, &e -> st)) {
+      continue;
+    }
+    /* small files queue up and go through the ring in one go */
+    if (ring && S_ISREG(e -> st.st_mode) && e -> st.st_size < ZERO_COPY_MIN &&
+	e -> st.st_nlink == 1) {
+      batch[n++] = e;
+      if (n == URING_BATCH) {
+	append_batch(node, batch, n, out, params);
+	n = 0;
+      }
+      continue;
+    }
+    /* anything else has to wait for the queued ones, the archive
+     * stays in readdir order */
+    if (n) {
+      append_batch(node, batch, n, out, params);
+      n = 0;
+    }
+    if (S_ISDIR(e -> st.st_mode)) {
+      //traverse directory and input files in preorder DSF
+      if (e -> child) {
+	input_DIR(w, e -> child, &e -> st, out, params);
+      }
+    } else if (S_ISREG(e -> st.st_mode) || S_ISLNK(e -> st.st_mode)) {
+      //input file or symlink into archive
+      add_file(fpath, fpath, out, params, &e -> st);
+    }
+  }
+  if (n) {
+    append_batch(node, batch, n, out, params);
+  }
+
+  arena_release(scratch, mark);
+  walk_node_free(w, node);
+  return 0;
+}
+
+/* archive everything in the catalog in the order --sort asked for,
+ * with the archive file grown to the size they add up to first
+ * 0 on success, -1 on failure */
+int add_tree(dir_tree *t, arch_buf *out, uint8_t params) {
+  struct stat st;
+  tree_ent *e;
+  uint64_t i;
+
+  tree_sort(t, sort_order);
+  /* plus the EOA, anything else past that is cut off when done */
+  buf_reserve(out, t -> total + 2 * BLOCK_SIZE);
+  for (i = 0; i < t -> count; i++) {
+    e = &t -> ents[i];
+    tree_stat(e, &st);
+    add_file(TREE_PATH(t, e), TREE_PATH(t, e), out, params, &st);
+  }
+  return 0;
+}
+
+/* list everything that went away since the snapshot in a SNAP_DELETED
+ * member, 0 on success (or nothing to list) -1 on failure */
+int append_deleted(arch_buf *out, uint8_t params) {
+  char *list;
+  size_t len;
+  if ((len = snap_deleted(snap, &list)) == 0) {
+    return 0;
+  }
+
+  struct stat st;
+  memset(&st, '\0', sizeof(st));
+  st.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  st.st_size = len;
+  st.st_mtime = time(NULL);
+  st.st_uid = getuid();
+  st.st_gid = getgid();
+
+  arena *scratch = thread_arena();
+  arena_mark mark = arena_save(scratch);
+  header *h;
+  int err = 0;
+  if ((h = create_header(SNAP_DELETED, SNAP_DELETED, params, &st)) == NULL ||
+      queue_header(h, SNAP_DELETED, NULL, out, params) ||
+      buf_append(out, list, len) ||
+      buf_zeros(out, BLOCK_ROUND(len) - len)) {
+    err = -1;
+  }
+  arena_release(scratch, mark);
+  free(list);
+  return err;
+}
+
+int insert_EOA(arch_buf *out) {
+  if (buf_zeros(out, 2 * BLOCK_SIZE)) {
+    fprintf(stderr, "write EOA\n");
     return -1;
   }
   return 0;
 }
 
-/* return fd of new arhive on success, -1 on failure */
-int create_arch(char *archname, uint8_t param_mask, char *argv[]) {
-  int arch_fd;
-  if ((arch_fd = open(archname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | 
-		      S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) == -1) {
-    perror("create_arch");
-    exit(EXIT_FAILURE);
+/* add every path in argv to the archive open on arch_fd, starting at
+ * offset start (0 for a new archive, the old EOA when appending), and
+ * close it off with an EOA. 0 on success, 1 if the archive is whole but
+ * some members couldn't be put in it, -1 on failure */
+int add_members(int arch_fd, off_t start, uint8_t param_mask, char *argv[]) {
+  if (use_uring && (ring = uring_init()) == NULL) {
+    fprintf(stderr, "create_arch: no io_uring here, using plain reads\n");
+  }
+  if (snap_name && (snap = snap_open(snap_name)) == NULL) {
+    return -1;
+  }
+  if ((links = links_new()) == NULL) {
+    return -1;
+  }
+
+  /* with z the tar stream goes through the compressor on its way out,
+   * member offsets no longer mean anything in the file so no index */
+  gz_writer *gz = NULL;
+  if (param_mask & ZMASK) {
+    if (member_index) {
+      fprintf(stderr, "create_arch: no index for a compressed archive\n");
+      index_free(member_index);
+      member_index = NULL;
+    }
+    if ((gz = gz_start(arch_fd, thread_count(), GZ_LEVEL)) == NULL) {
+      return -1;
+    }
+  }
+
+  arch_buf *out;
+  if ((out = buf_init(gz ? gz_fd(gz) : arch_fd, buf_size)) == NULL) {
+    if (gz) {
+      gz_finish(gz);
+    }
+    return -1;
+  }
+  out -> pos = start;
+
+  /* reading ahead on other threads keeps the next bodies coming while
+   * this one is written. io_uring already has the reads in flight */
+  emit_ctx ec = { out, param_mask };
+  if (!ring && read_buf &&
+      (readers = rpool_start(thread_count(), read_buf, emit_member, &ec)) == NULL) {
+    fprintf(stderr, "create_arch: reading on one thread\n");
   }
   
+  dir_tree *tree = NULL;
+  if (sort_order != SORT_NONE && (tree = tree_new()) == NULL) {
+    fprintf(stderr, "create_arch: archiving in walk order\n");
+  }
+
   struct stat st;
   char path[PATHMAX];
-  char dname[PATHMAX];
+  walker *w = NULL;
+  walk_node *node;
   for (; argv[optind]; optind++) {
     if (strlen(argv[optind]) < PATHMAX) {
       memset(path, '\0', PATHMAX);
       strcat(path, argv[optind]);
     } else {
-      fprintf(stderr, "path excedes PATHMAX (256) chars");
+      fprintf(stderr, "path excedes PATHMAX (%d) chars\n", PATHMAX);
       return -1;
     }
+    if (patterns && pattern_prune(patterns, path)) {
+      continue;
+    }
     if (lstat(argv[optind], &st)) {
       perror("create_arch lstat failure"); //ask about this (need to skip this or just give up)
+      members_failed++;
     } else if (S_ISDIR(st.st_mode)) {
       //traverse directory and input files in preorder DSF
-      memcpy(dname, path, PATHMAX);
-      input_DIR(dname, path, arch_fd, param_mask);
+      if (w == NULL && (w = walk_start(thread_count(), patterns ? prune_member : NULL)) == NULL) {
+	if (readers) {
+	  rpool_finish(readers);
+	  readers = NULL;
+	}
+	buf_free(out);
+	if (gz) {
+	  gz_finish(gz);
+	}
+	return -1;
+      }
+      if (set_dir_name(path) && !(patterns && pattern_prune(patterns, path)) &&
+	  (node = walk_submit(w, path)) != NULL) {
+	if (tree) {
+	  build_dir_tree(tree, w, node, &st, skip_member);
+	} else {
+	  input_DIR(w, node, &st, out, param_mask);
+	}
+      }
+    } else if (skip_member(path, &st)) {
+      continue;
+    } else if (tree && (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+      tree_add(tree, path, &st);
     } else if (S_ISREG(st.st_mode)) {
       //input file into arhive
-      append_file(argv[optind], path, arch_fd, param_mask);
+      add_file(argv[optind], path, out, param_mask, &st);
     } else if (S_ISLNK(st.st_mode)) {
       //input symlink into archive
-      append_file(argv[optind], path, arch_fd, param_mask);
+      add_file(argv[optind], path, out, param_mask, &st);
     }
   }
+  if (tree) {
+    add_tree(tree, out, param_mask);
+    tree_free(tree);
+  }
+  if (w) {
+    walk_stop(w);
+  }
+  /* everything queued is in the buffer once this returns */
+  if (readers) {
+    rpool_finish(readers);
+    readers = NULL;
+  }
+  if (ring) {
+    uring_free(ring);
+    ring = NULL;
+  }
+  links_free(links);
+  links = NULL;
   
-  if (insert_EOA(arch_fd) == -1) {
+  int err = 0;
+  if (snap && append_deleted(out, param_mask)) {
+    err = -1;
+  }
+  if (insert_EOA(out)) {
+    err = -1;
+  }
+  if (buf_free(out) == -1) {
+    err = -1;
+  }
+  if (gz && gz_finish(gz)) {
+    err = -1;
+  }
+  if (snap) {
+    /* only a complete archive moves the snapshot forward */
+    if (!err && snap_write(snap)) {
+      fprintf(stderr, "create_arch: unable to write snapshot\n");
+    }
+    snap_free(snap);
+    snap = NULL;
+  }
+  if (!err && members_failed) {
+    fprintf(stderr, "create_arch: %d member%s could not be archived\n", members_failed,
+	    members_failed == 1 ? "" : "s");
+    return 1;
+  }
+  return err;
+}
+
+/* write the index for the now complete archive, if there is one */
+void finish_index(char *archname) {
+  if (member_index) {
+    if (index_write(member_index, archname)) {
+      fprintf(stderr, "create_arch: unable to write index\n");
+    }
+    index_free(member_index);
+    member_index = NULL;
+  }
+}
+
+/* return fd of new arhive on success, -1 on failure. an archname
+ * of "-" writes the archive to stdout */
+int create_arch(char *archname, uint8_t param_mask, char *argv[]) {
+  int arch_fd;
+  vout = stdout;
+  if (strcmp(archname, "-") == 0) {
+    arch_fd = STDOUT_FILENO;
+    vout = stderr;
+    if (make_index) {
+      fprintf(stderr, "create_arch: no index for an archive on stdout\n");
+      make_index = 0;
+    }
+  } else if ((arch_fd = open(archname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | 
+		      S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) == -1) {
+    perror("create_arch");
+    exit(EXIT_FAILURE);
+  }
+  if (make_index && (member_index = index_new()) == NULL) {
+    fprintf(stderr, "create_arch: continuing without an index\n");
+  }
+
+  int ret;
+  if ((ret = add_members(arch_fd, 0, param_mask, argv)) == -1) {
     return -1;
   }
 
-  return arch_fd;
+  /* the archive is final now, pin the index to it */
+  finish_index(archname);
+  return ret ? -1 : arch_fd;
 }
 
-/* searches a list of strings for a matching string returns true 
- * if there is a string that matches false otherwise */
-int search_str_list(char *str, char **list, int size) {
-  int i;
-  char *str_dir = malloc(PATHMAX*sizeof(char));
-  char *list_dir = malloc(PATHMAX*sizeof(char));
-  for (i = 0; i < size; i++) {
-    if (strcmp(str, list[i]) == 0) {
-      free(list_dir);
-      free(str_dir);
-      return 1;
+/* the member map_next left m on goes by the name in its extended
+ * header if it has one */
+char *member_name(arch_map *m, header *h) {
+  if (m -> pax.present && m -> pax.name[0]) {
+    return m -> pax.name;
+  }
+  return get_str_fname(h);
+}
+
+/* and what it links to, for the link types */
+char *member_link(arch_map *m, header *h) {
+  static char linkname[sizeof(h -> linkname) + 1];
+  if (m -> pax.present && m -> pax.linkname[0]) {
+    return m -> pax.linkname;
+  }
+  memcpy(linkname, h -> linkname, sizeof(h -> linkname));
+  linkname[sizeof(h -> linkname)] = '\0';
+  return linkname;
+}
+
+/* and its size once extracted, which for a sparse file isn't what
+ * the archive holds */
+off_t member_size(arch_map *m) {
+  if (m -> pax.present && m -> pax.sparse) {
+    return m -> pax.realsize;
+  }
+  return m -> body_size;
+}
+
+/* find where the EOA of the archive on arch_fd starts and put every
+ * member in an index, taken from the sidecar index when there is a
+ * valid one and by walking the headers otherwise. *loaded says which
+ * returns the index sorted by name on success NULL on failure */
+arch_index *scan_members(char *archname, uint8_t params, off_t *eoa, int *loaded) {
+  arch_index *ix;
+  if ((ix = index_load(archname)) != NULL) {
+    *loaded = 1;
+    *eoa = index_end(ix);
+    return ix;
+  }
+  *loaded = 0;
+  if ((ix = index_new()) == NULL) {
+    return NULL;
+  }
+
+  arch_map *m;
+  if ((m = map_open(archname, MADV_SEQUENTIAL)) == NULL) {
+    index_free(ix);
+    return NULL;
+  }
+  if (m -> stream) {
+    fprintf(stderr, "%s: can only append to a plain archive file\n", archname);
+    map_close(m);
+    index_free(ix);
+    return NULL;
+  }
+
+  header *h;
+  off_t off = 0, hdr_off;
+  int ret = 0;
+  if (m -> size > 0) {
+    for (hdr_off = off; (ret = map_next(m, &off, &h, params)) == 1; hdr_off = off) {
+      if (index_add(ix, member_name(m, h), hdr_off,
+		    m -> body + m -> body_size - hdr_off - BLOCK_SIZE,
+		    h -> typeflag[0], HEADER_NUM(h, mtime))) {
+	ret = -1;
+	break;
+      }
+      map_release(m, off);
     }
-    str_dir = strcpy(str_dir, str);
-    str_dir = set_dir_name(str_dir);
-    list_dir = strcpy(list_dir, list[i]);
-    list_dir = set_dir_name(list_dir);
-    if (strstr(str_dir, list_dir) != NULL) {
-      free(list_dir);
-      free(str_dir);
-      return 1;
+    /* an archive that just stops after its last member is fine too */
+    if (ret == -1 && hdr_off == m -> size) {
+      ret = 0;
     }
+    off = hdr_off;
   }
-  free(list_dir);
-  free(str_dir);
-  return 0;
+  map_close(m);
+  if (ret == -1) {
+    index_free(ix);
+    return NULL;
+  }
+  *eoa = off;
+  index_sort(ix);
+  return ix;
+}
+
+/* append (r) the paths in argv to an existing archive, or with u only
+ * the ones newer than their copy in the archive. the old EOA is
+ * overwritten in place so only the new members get written
+ * returns fd of the archive on success, -1 on failure */
+int append_arch(char *archname, uint8_t param_mask, char *argv[]) {
+  int arch_fd, loaded;
+  off_t eoa;
+  arch_index *ix;
+  uint32_t r;
+
+  vout = stdout;
+  if (strcmp(archname, "-") == 0 || (param_mask & ZMASK)) {
+    fprintf(stderr, "append_arch: can only append to an uncompressed archive file\n");
+    return -1;
+  }
+  if ((arch_fd = open(archname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | 
+		      S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) == -1) {
+    perror("append_arch");
+    return -1;
+  }
+  if ((ix = scan_members(archname, param_mask, &eoa, &loaded)) == NULL) {
+    close(arch_fd);
+    return -1;
+  }
+
+  /* an index that was there stays up to date, the old members go in
+   * first and add_members adds the rest */
+  if ((loaded || make_index) && (member_index = index_new()) != NULL) {
+    for (r = 0; r < ix -> count; r++) {
+      if (index_add(member_index, ix -> names + ix -> recs[r].name_off, ix -> recs[r].offset,
+		    ix -> recs[r].size, ix -> recs[r].type, ix -> recs[r].mtime)) {
+	index_free(member_index);
+	member_index = NULL;
+	break;
+      }
+    }
+  }
+  if (update_newer) {
+    archived = ix;
+  }
+
+  int err = 0, ret = 0;
+  if (lseek(arch_fd, eoa, SEEK_SET) == -1) {
+    perror("append_arch lseek");
+    err = -1;
+  } else if ((ret = add_members(arch_fd, eoa, param_mask, argv)) == -1) {
+    err = -1;
+  } else if (ftruncate(arch_fd, lseek(arch_fd, 0, SEEK_CUR))) {
+    /* drop whatever padding the old archive had past its EOA */
+    perror("append_arch ftruncate");
+  }
+  archived = NULL;
+  index_free(ix);
+  if (err) {
+    if (member_index) {
+      index_free(member_index);
+      member_index = NULL;
+    }
+    return -1;
+  }
+  finish_index(archname);
+  return ret ? -1 : arch_fd;
+}
+
+/* print one member, in long form if verbose */
+void print_member(arch_map *m, header *h, char *fname_str, uint8_t params) {
+  char *perm_str, *ugname_str, *mtime_str;
+  /* if verbose then talk more otherwise bare minimum */
+  if (params & VMASK) {
+    perm_str = get_str_perm(h);
+    ugname_str = get_str_ugname(h);
+    mtime_str = get_str_mtime(h);
+    printf("%10s %17s %8lld %16s %s", perm_str, ugname_str, (long long) member_size(m),
+	   mtime_str, fname_str);
+    if (h -> typeflag[0] == '1') {
+      printf(" link to %s", member_link(m, h));
+    }
+    printf("\n");
+  } else {
+    printf("%s\n", fname_str);
+  }
+}
+
+/* false if --exclude/--include leave the member called name out */
+int member_wanted(char *name) {
+  return patterns == NULL || !pattern_skip(patterns, name);
 }
 
 /* list only the contents of the archive given as parameters 
  * and the decendents of said parameters */
 int list_arch_sel(char *arch_name, uint8_t params, char *argv[]) {
-  int arch_fd;
-  if ((arch_fd = open(arch_name, O_RDONLY)) == -1) {
-    perror("list open");
+  arch_map *m;
+  if ((m = map_open(arch_name, MADV_SEQUENTIAL)) == NULL) {
     return -1;
   }
 
-  /* init list of all files that need to be checked for */
-  int size = 10; // arbitrary selection for size of list of files
-  int i;
-  char **LOF = malloc(size*sizeof(char *));
-  for (i = 0; argv[optind] != NULL; i++) {
-    LOF[i] = argv[optind++];
-    if (i == size) {
-      size += 10;
-      LOF = realloc(LOF, size*sizeof(char *));
+  /* list of all files that need to be checked for */
+  char **LOF = &argv[optind];
+  int size;
+  for (size = 0; LOF[size]; size++);
+
+  char *fname_str;
+  header *h;
+  off_t off = 0;
+  int ret;
+
+  /* with an index only the selected headers get touched, a stream
+   * has to be read front to back anyway */
+  arch_index *ix;
+  if (!m -> stream && (ix = index_load(arch_name)) != NULL) {
+    off_t *offs;
+    int n, i;
+    madvise(m -> base, m -> size, MADV_RANDOM);
+    if ((n = index_select(ix, LOF, size, &offs)) == -1) {
+      index_free(ix);
+      map_close(m);
+      return -1;
+    }
+    for (i = 0, ret = 0; i < n && ret == 0; i++) {
+      off = offs[i];
+      if (map_next(m, &off, &h, params) != 1) {
+	ret = -1;
+      } else if (member_wanted(member_name(m, h))) {
+	print_member(m, h, member_name(m, h), params);
+      }
     }
+    free(offs);
+    index_free(ix);
+    map_close(m);
+    return ret;
   }
-  size = i;
-  LOF = realloc(LOF, size*sizeof(char *));
-  
-  uint8_t *nul_block = calloc(sizeof(header), sizeof(uint8_t));
-  char *perm_str, *ugname_str, *mtime_str, *fname_str;
-  int num_read;
-  float offset;
-  header *h = malloc(sizeof(header));
-  while((num_read = read(arch_fd, h, BLOCK_SIZE)) > 0) {
-    if (num_read == -1) {
-      perror("read");
+
+  path_set *sel;
+  if ((sel = select_compile(LOF, size)) == NULL) {
+    map_close(m);
+    return -1;
+  }
+  uint64_t t0 = STATS_START();
+  while ((ret = map_next(m, &off, &h, params)) == 1) {
+    /* check if this is one of the files in LOF or a decendent of
+     * one and if yes then list said file */
+    fname_str = member_name(m, h);
+    if (select_match(sel, fname_str) && member_wanted(fname_str)) {
+      print_member(m, h, fname_str, params);
+    }
+    map_release(m, off);
+    STATS_MEMBER(t0);
+    t0 = STATS_START();
+  }
+
+  select_free(sel);
+  map_close(m);
+  return ret;
+}
+
+
+/* list all the contents of a given archive */
+int list_arch(char *arch_name, uint8_t params) {
+  arch_map *m;
+  if ((m = map_open(arch_name, MADV_SEQUENTIAL)) == NULL) {
+    return -1;
+  }
+
+  header *h;
+  off_t off = 0;
+  int ret;
+  uint64_t t0 = STATS_START();
+  while ((ret = map_next(m, &off, &h, params)) == 1) {
+    if (member_wanted(member_name(m, h))) {
+      print_member(m, h, member_name(m, h), params);
+    }
+    map_release(m, off);
+    STATS_MEMBER(t0);
+    t0 = STATS_START();
+  }
+
+  map_close(m);
+  return ret;
+}
+
+/* the directory the last component of path goes in, walked down to
+ * from the cwd a component at a time without following a symlink, so
+ * one the archive planted can't lead out of it. missing directories
+ * are made along the way when make is set. *name is pointed at the
+ * last component. returns AT_FDCWD when path has no '/', else the
+ * directory open for the caller to close, -1 on failure */
+int open_parent(char *path, char **name, int make) {
+  char comp[PATHMAX];
+  char *p = path, *slash;
+  int fd = AT_FDCWD, next;
+  while ((slash = strchr(p, '/')) != NULL) {
+    if (slash == p) {
+      p++;
+      continue;
+    }
+    next = -1;
+    if (slash - p >= PATHMAX) {
+      fprintf(stderr, "%s: name too long\n", path);
+    } else {
+      memcpy(comp, p, slash - p);
+      comp[slash - p] = '\0';
+      if ((make && mkdirat(fd, comp, S_IRWXU) && errno != EEXIST) ||
+	  (next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+	perror(path);
+      }
+    }
+    if (fd != AT_FDCWD) {
+      close(fd);
+    }
+    if (next == -1) {
       return -1;
     }
-    
-    /* if we are at EOA then quit successfully */
-    if (memcmp(h, nul_block, BLOCK_SIZE) == 0) {
-      if (read(arch_fd, h, BLOCK_SIZE) == -1) {
-	perror("read");
-	return -1;
-      } 
-      if (memcmp(h, nul_block, BLOCK_SIZE) == 0) {
-	free(nul_block);
-	free(h);
-	close(arch_fd);
-	return 0;
-      } else {
-	fprintf(stderr, "bad header: lost and quiting...\n");
-	exit(EXIT_FAILURE);
+    fd = next;
+    p = slash + 1;
+  }
+  *name = p;
+  return fd;
+}
+
+/* after the dir cache gave up on path: 1 if that was a symlink or a
+ * file where a directory had to be, reported here, as going by path
+ * would only find the same thing */
+int not_dir(char *path) {
+  if (errno == ELOOP || errno == ENOTDIR) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+/* refuse member names that would land outside of the cwd */
+int unsafe_name(char *path) {
+  char *p;
+  if (path[0] == '/') {
+    return 1;
+  }
+  for (p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+    if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* directory whose mode and mtime get fixed up after everything
+ * below it has been written */
+typedef struct dir_fixup {
+  char *path;
+  mode_t mode;
+  time_t mtime;
+  uid_t uid;
+  gid_t gid;
+} dir_fixup;
+
+/* hard link made once every body is out, so the file it
+ * points at is sure to be there */
+typedef struct hard_link {
+  char *path;
+  char *target;
+} hard_link;
+
+/* state shared by every member of one extraction */
+typedef struct extract_ctx {
+  extract_pool *pool;
+  dir_cache *dirs;
+  dir_fixup *fixups;
+  int fix_count;
+  int fix_size;
+  hard_link *links;
+  int link_count;
+  int link_size;
+  int same_owner;
+  uint8_t params;
+  arch_map *m;
+} extract_ctx;
+
+/* owner of the member as this host knows it: by name when the name
+ * exists here, by the numeric id in the header otherwise */
+void member_owner(header *h, uid_t *uid, gid_t *gid) {
+  char name[ID_NAME_LEN + 1];
+  memcpy(name, h -> uname, ID_NAME_LEN);
+  name[ID_NAME_LEN] = '\0';
+  if (name_to_uid(name, uid)) {
+    *uid = HEADER_NUM(h, uid);
+  }
+  memcpy(name, h -> gname, ID_NAME_LEN);
+  name[ID_NAME_LEN] = '\0';
+  if (name_to_gid(name, gid)) {
+    *gid = HEADER_NUM(h, gid);
+  }
+}
+
+/* remove what an incremental archive says went away since the run
+ * before it, only with --incremental. the size is taken before the
+ * body is read, a stream moves under it
+ * 0 on success, -1 on failure */
+int apply_deleted(extract_ctx *ctx, off_t body_off) {
+  off_t size = ctx -> m -> body_size, got;
+  ssize_t n;
+  size_t len;
+  char *list, *p, *next, *end, *name;
+  int dfd, dir;
+
+  if ((list = malloc(size + 1)) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (got = 0; got < size; got += n) {
+    if ((n = map_read(ctx -> m, body_off + got, (uint8_t *) list + got, size - got)) <= 0) {
+      fprintf(stderr, "%s: archive truncated\n", SNAP_DELETED);
+      free(list);
+      return -1;
+    }
+  }
+  list[size] = '\0';
+
+  /* the list is deepest first so directories are empty by the time
+   * they come up */
+  for (p = list, end = list + size; p < end; p = next) {
+    next = p + strlen(p) + 1;
+    if (*p == '\0' || unsafe_name(p) || !member_wanted(p)) {
+      continue;
+    }
+    if (ctx -> params & VMASK) {
+      printf("removing %s\n", p);
+    }
+    /* a trailing '/' marks a directory. the parent is opened the way
+     * extract_member opens it, not through a symlink */
+    len = strlen(p);
+    dir = p[len - 1] == '/';
+    while (len > 1 && p[len - 1] == '/') {
+      p[--len] = '\0';
+    }
+    if ((dfd = open_parent(p, &name, 0)) == -1) {
+      continue;
+    }
+    if (unlinkat(dfd, name, dir ? AT_REMOVEDIR : 0) && errno != ENOENT) {
+      perror(p);
+    }
+    if (dfd != AT_FDCWD) {
+      close(dfd);
+    }
+  }
+  free(list);
+  /* directories the cache has open may be among the ones just gone */
+  dcache_flush(ctx -> dirs);
+  return 0;
+}
+
+/* recreate the member described by h, whose body starts at body_off.
+ * regular files are only queued here, the pool writes them. names are
+ * made relative to their parent directory, held open in the cache
+ * 0 on success, -1 on failure */
+int extract_member(extract_ctx *ctx, header *h, off_t body_off) {
+  char *fname_str, *name;
+  char *linkname;
+  char dpath[PATHMAX];
+  extract_job job;
+  dir_slot *dir = NULL;
+  int dfd = AT_FDCWD, err = 0;
+  size_t len;
+  uid_t uid = 0;
+  gid_t gid = 0;
+
+  fname_str = member_name(ctx -> m, h);
+  if (unsafe_name(fname_str)) {
+    fprintf(stderr, "%s: unsafe member name, skipping\n", fname_str);
+    return 0;
+  }
+  if (incremental && h -> typeflag[0] == '0' && strcmp(fname_str, SNAP_DELETED) == 0) {
+    return apply_deleted(ctx, body_off);
+  }
+  if (!member_wanted(fname_str)) {
+    return 0;
+  }
+
+  if (ctx -> params & VMASK) {
+    printf("%s\n", fname_str);
+  }
+
+  /* a directory is made through the cache and kept open, what is in
+   * it usually comes right after. anything else is made in its parent */
+  if (h -> typeflag[0] == '5') {
+    if ((len = strlen(fname_str)) >= PATHMAX) {
+      fprintf(stderr, "%s: name too long\n", fname_str);
+      return -1;
+    }
+    memcpy(dpath, fname_str, len + 1);
+    while (len > 1 && dpath[len - 1] == '/') {
+      dpath[--len] = '\0';
+    }
+    if ((dir = dcache_get(ctx -> dirs, dpath)) == NULL && not_dir(dpath)) {
+      return -1;
+    }
+    if (dir == NULL && (dfd = open_parent(dpath, &name, 1)) == -1) {
+      return -1;
+    }
+  } else if ((dfd = dcache_parent(ctx -> dirs, fname_str, &dir, &name)) == -1) {
+    if (not_dir(fname_str) || (dfd = open_parent(fname_str, &name, 1)) == -1) {
+      return -1;
+    }
+  }
+  if (ctx -> same_owner) {
+    member_owner(h, &uid, &gid);
+  }
+  uint64_t t0 = STATS_START();
+  if (h -> typeflag[0] == '5') {
+    if (dir == NULL && mkdirat(dfd, name, S_IRWXU) && errno != EEXIST) {
+      perror(fname_str);
+      err = -1;
+    } else {
+      STATS_END(PH_SET_META, t0, 1, 0);
+      STATS_MEMBER(t0);
+      if (ctx -> fix_count == ctx -> fix_size) {
+	ctx -> fix_size = ctx -> fix_size ? ctx -> fix_size * 2 : 16;
+	ctx -> fixups = realloc(ctx -> fixups, ctx -> fix_size * sizeof(dir_fixup));
       }
+      ctx -> fixups[ctx -> fix_count].path = strdup(dpath);
+      ctx -> fixups[ctx -> fix_count].mode = HEADER_NUM(h, mode);
+      ctx -> fixups[ctx -> fix_count].mtime = HEADER_NUM(h, mtime);
+      ctx -> fixups[ctx -> fix_count].uid = uid;
+      ctx -> fixups[ctx -> fix_count].gid = gid;
+      ctx -> fix_count++;
     }
-    
-    /* if bad header then we are lost so quit */
-    if (check_valid(h, params)) {
-      fprintf(stderr, "bad header: lost and quiting...\n");
-      exit(EXIT_FAILURE);
+  } else if (h -> typeflag[0] == '2') {
+    linkname = member_link(ctx -> m, h);
+    /* an earlier copy of the name may still be being written */
+    pool_settle(ctx -> pool, fname_str);
+    unlinkat(dfd, name, 0);
+    if (symlinkat(linkname, dfd, name)) {
+      perror(fname_str);
+      err = -1;
+    } else {
+      if (ctx -> same_owner && fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW)) {
+	perror(fname_str);
+      }
+      STATS_END(PH_SET_META, t0, ctx -> same_owner ? 3 : 2, 0);
+      STATS_MEMBER(t0);
     }
-    
-    /* check if this is one of the files in LOF or if any of the 
-     * file in the LOF are a substring of the current file and if 
-     * yes then list said file*/
-    fname_str = get_str_fname(h);
-    if (search_str_list(fname_str, LOF, size)) {
-      /* if verbose then talk more otherwise bare minimum */
-      if (params & VMASK) {
-	perm_str = get_str_perm(h);
-	ugname_str = get_str_ugname(h);
-	mtime_str = get_str_mtime(h);
-	printf("%10s %17s %8ld %16s %s\n", perm_str, ugname_str, strtol((char *) (h -> size), NULL, 8), 
-	       mtime_str, fname_str);
-      } else {
-	printf("%s\n", fname_str);
+  } else if (h -> typeflag[0] == '1') {
+    linkname = member_link(ctx -> m, h);
+    if (unsafe_name(linkname)) {
+      fprintf(stderr, "%s: unsafe link target, skipping\n", fname_str);
+    } else {
+      if (ctx -> link_count == ctx -> link_size) {
+	ctx -> link_size = ctx -> link_size ? ctx -> link_size * 2 : 16;
+	ctx -> links = realloc(ctx -> links, ctx -> link_size * sizeof(hard_link));
       }
-    }    
-    
-    /* seek to the next header */
-    offset = (float) strtol((char *) (h -> size), NULL, 8);
-    offset = lseek(arch_fd, ceiling(offset / BLOCK_SIZE) * BLOCK_SIZE, SEEK_CUR);
+      ctx -> links[ctx -> link_count].path = strdup(fname_str);
+      ctx -> links[ctx -> link_count].target = strdup(linkname);
+      ctx -> link_count++;
+    }
+  } else if (h -> typeflag[0] == '0' || h -> typeflag[0] == '\0') {
+    strcpy(job.path, fname_str);
+    /* the worker hands the directory back once the file is open */
+    job.dir = dir;
+    job.dfd = dfd;
+    job.name_off = name - fname_str;
+    dir = NULL;
+    dfd = AT_FDCWD;
+    job.offset = body_off;
+    job.size = ctx -> m -> body_size;
+    job.sparse = ctx -> m -> pax.present && ctx -> m -> pax.sparse;
+    job.realsize = ctx -> m -> pax.realsize;
+    job.mode = HEADER_NUM(h, mode);
+    job.mtime = HEADER_NUM(h, mtime);
+    job.same_owner = ctx -> same_owner;
+    job.uid = uid;
+    job.gid = gid;
+    pool_submit(ctx -> pool, &job);
+  } else {
+    fprintf(stderr, "%s: unsupported type '%c', skipping\n", fname_str, h -> typeflag[0]);
   }
-  
-  fprintf(stderr, "arch_list error, should not quit here");
-  free(nul_block);
-  free(h);
-  close(arch_fd);
-  return -1;
+  if (dir == NULL && dfd != AT_FDCWD) {
+    close(dfd);
+  }
+  dcache_put(dir);
+  return err;
 }
 
+/* extract all files in tar file (or just the ones given as parameters
+ * and their decendents). the current thread walks the headers, making
+ * directories and symlinks itself and handing regular file bodies to a
+ * pool of workers that copy them straight out of the mapped archive.
+ * when a valid index sits next to the archive a selective extract only
+ * visits the members it names. a streamed archive ("-") is read in
+ * order and bodies are written as their headers go by */
+int extract_arch(char *arch_name, uint8_t params, char *argv[]) {
+  char **LOF = &argv[optind];
+  int size;
+  for (size = 0; LOF[size]; size++);
 
-/* list all the contents of a given archive */
-int list_arch(char *arch_name, uint8_t params) {
-  int arch_fd;
-  if ((arch_fd = open(arch_name, O_RDONLY)) == -1) {
-    perror("list open");
+  arch_map *m;
+  if ((m = map_open(arch_name, MADV_SEQUENTIAL)) == NULL) {
     return -1;
   }
-  
-  uint8_t *nul_block = calloc(sizeof(header), sizeof(uint8_t));
-  char *perm_str, *ugname_str, *mtime_str, *fname_str;
-  int num_read;
-  float offset;
-  header *h = malloc(sizeof(header));
-  memset(h, '\0', sizeof(header));
-  while((num_read = read(arch_fd, h, BLOCK_SIZE)) > 0) {
-    /* if we are at EOA then quit successfully */
-    if (memcmp(h, nul_block, BLOCK_SIZE) == 0) {
-      if (read(arch_fd, h, BLOCK_SIZE) == -1) {
-	perror("read");
-	return -1;
-      } 
-      if (memcmp(h, nul_block, BLOCK_SIZE) == 0) {
-	free(nul_block);
-	free(h);
-	close(arch_fd);
-	return 0;
-      } else {
-	fprintf(stderr, "bad header: lost and quiting...\n");
-	exit(EXIT_FAILURE);
+  arch_index *ix = size && !m -> stream ? index_load(arch_name) : NULL;
+  if (ix) {
+    madvise(m -> base, m -> size, MADV_RANDOM);
+  }
+
+  extract_ctx ctx;
+  memset(&ctx, '\0', sizeof(ctx));
+  ctx.params = params;
+  ctx.m = m;
+  ctx.same_owner = geteuid() == 0;
+  if ((ctx.dirs = dcache_new()) == NULL) {
+    map_close(m);
+    return -1;
+  }
+  if ((ctx.pool = pool_init(m, thread_count())) == NULL) {
+    dcache_free(ctx.dirs);
+    map_close(m);
+    return -1;
+  }
+
+  header *h;
+  off_t off = 0;
+  int err = 0, ret;
+  if (ix) {
+    off_t *offs;
+    int n, i;
+    if ((n = index_select(ix, LOF, size, &offs)) == -1) {
+      err = -1;
+    }
+    for (i = 0; i < n; i++) {
+      off = offs[i];
+      if (map_next(m, &off, &h, params) != 1) {
+	err = -1;
+	break;
+      }
+      if (extract_member(&ctx, h, m -> body)) {
+	err = -1;
       }
     }
-    
-    /* if bad header then we are lost so quit */
-    if (check_valid(h, params)) {
-      fprintf(stderr, "bad header: lost and quiting...\n");
-      exit(EXIT_FAILURE);
+    if (n != -1) {
+      free(offs);
     }
-    /* if verbose then talk more otherwise bare minimum */
-    if (params & VMASK) {
-      perm_str = get_str_perm(h);
-      ugname_str = get_str_ugname(h);
-      mtime_str = get_str_mtime(h);
-      fname_str = get_str_fname(h);
-      printf("%10s %17s %8ld %16s %s\n", perm_str, ugname_str, strtol((char *) (h -> size), NULL, 8), 
-	     mtime_str, fname_str);
+    index_free(ix);
+  } else {
+    path_set *sel = NULL;
+    if (size && (sel = select_compile(LOF, size)) == NULL) {
+      ret = -1;
     } else {
-      printf("%s\n", get_str_fname(h));
+      while ((ret = map_next(m, &off, &h, params)) == 1) {
+	if (sel && !select_match(sel, member_name(m, h))) {
+	  map_release(m, pool_low(ctx.pool, off));
+	  continue;
+	}
+	if (extract_member(&ctx, h, m -> body)) {
+	  err = -1;
+	}
+	/* bodies still queued for the workers have to stay */
+	map_release(m, pool_low(ctx.pool, off));
+      }
+    }
+    if (ret == -1) {
+      err = -1;
+    }
+    if (sel) {
+      select_free(sel);
     }
-    /* seek to the next header */
-    offset = (float) strtol((char *) (h -> size), NULL, 8);
-    offset = lseek(arch_fd, ceiling(offset / BLOCK_SIZE) * BLOCK_SIZE, SEEK_CUR);
   }
-  
-  fprintf(stderr, "arch_list error, should not quit here");
-  free(nul_block);
-  free(h);
-  close(arch_fd);
-  return -1;
+
+  if (pool_finish(ctx.pool)) {
+    err = -1;
+  }
+  dcache_free(ctx.dirs);
+
+  /* the files are all out, link the other names in */
+  struct timespec times[2];
+  int i;
+  uint64_t t0 = STATS_START();
+  char *name, *tname;
+  int dfd, tfd, fd;
+  for (i = 0; i < ctx.link_count; i++) {
+    /* both ends are reached the same way members are, never through
+     * a symlink */
+    if ((dfd = open_parent(ctx.links[i].path, &name, 1)) == -1) {
+      err = -1;
+    } else {
+      if ((tfd = open_parent(ctx.links[i].target, &tname, 0)) == -1) {
+	err = -1;
+      } else {
+	unlinkat(dfd, name, 0);
+	if (linkat(tfd, tname, dfd, name, 0)) {
+	  perror(ctx.links[i].path);
+	  err = -1;
+	}
+	if (tfd != AT_FDCWD) {
+	  close(tfd);
+	}
+      }
+      if (dfd != AT_FDCWD) {
+	close(dfd);
+      }
+    }
+    free(ctx.links[i].path);
+    free(ctx.links[i].target);
+  }
+  STATS_END(PH_SET_META, t0, 2 * ctx.link_count, 0);
+  free(ctx.links);
+
+  /* children are all in place, fix up the directories deepest first */
+  t0 = STATS_START();
+  for (i = ctx.fix_count - 1; i >= 0; i--) {
+    times[0].tv_sec = ctx.fixups[i].mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    fd = -1;
+    if ((dfd = open_parent(ctx.fixups[i].path, &name, 0)) != -1) {
+      if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+	perror(ctx.fixups[i].path);
+      }
+      if (dfd != AT_FDCWD) {
+	close(dfd);
+      }
+    }
+    if (fd != -1) {
+      if (ctx.same_owner && fchown(fd, ctx.fixups[i].uid, ctx.fixups[i].gid)) {
+	perror(ctx.fixups[i].path);
+      }
+      if (fchmod(fd, ctx.fixups[i].mode)) {
+	perror(ctx.fixups[i].path);
+      }
+      if (futimens(fd, times)) {
+	perror(ctx.fixups[i].path);
+      }
+      close(fd);
+    }
+    free(ctx.fixups[i].path);
+  }
+  STATS_END(PH_SET_META, t0, ctx.fix_count * (ctx.same_owner ? 3 : 2), 0);
+
+  free(ctx.fixups);
+  map_close(m);
+  return err;
 }
 
-/* extract all files in tar file */
-int extract_arch(int arch_fd, uint8_t params) {
-  
+
+/* parse a byte count with an optional K, M or G suffix
+ * returns the size on success, 0 on failure */
+size_t parse_size(char *str) {
+  char *end;
+  unsigned long long val;
+  val = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': val <<= 10;
+    /* fall through */
+  case 'M': case 'm': val <<= 10;
+    /* fall through */
+  case 'K': case 'k': val <<= 10;
+    end++;
+    break;
+  }
+  if (end == str || *end != '\0') {
+    return 0;
+  }
+  return (size_t) val;
 }
 
+enum long_only {
+  OPT_BUFFER_SIZE = 256,
+  OPT_NO_ZERO_COPY,
+  OPT_INDEX,
+  OPT_THREADS,
+  OPT_IO_URING,
+  OPT_SNAPSHOT,
+  OPT_INCREMENTAL,
+  OPT_STATS,
+  OPT_READ_BUFFER,
+  OPT_SORT,
+  OPT_NO_CACHE,
+  OPT_EXCLUDE,
+  OPT_INCLUDE
+};
+
+static struct option long_opts[] = {
+  {"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+  {"no-zero-copy", no_argument, NULL, OPT_NO_ZERO_COPY},
+  {"index", no_argument, NULL, OPT_INDEX},
+  {"threads", required_argument, NULL, OPT_THREADS},
+  {"io-uring", no_argument, NULL, OPT_IO_URING},
+  {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+  {"incremental", no_argument, NULL, OPT_INCREMENTAL},
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"read-buffer", required_argument, NULL, OPT_READ_BUFFER},
+  {"sort", required_argument, NULL, OPT_SORT},
+  {"no-cache", no_argument, NULL, OPT_NO_CACHE},
+  {"exclude", required_argument, NULL, OPT_EXCLUDE},
+  {"include", required_argument, NULL, OPT_INCLUDE},
+  {NULL, 0, NULL, 0}
+};
 
 /* main descrip here... */
 int main(int argc, char *argv[]) {
   int opt;
-  while ((opt = getopt(argc, argv, ":")) != -1) {
-    if (opt == '?') {
-      fprintf(stderr, "usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+  while ((opt = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case OPT_BUFFER_SIZE:
+      if ((buf_size = parse_size(optarg)) == 0) {
+	fprintf(stderr, "mytar: bad --buffer-size '%s'\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_NO_ZERO_COPY:
+      zero_copy = 0;
+      break;
+    case OPT_INDEX:
+      make_index = 1;
+      break;
+    case OPT_THREADS:
+      if ((nthreads = strtol(optarg, NULL, 10)) < 1) {
+	fprintf(stderr, "mytar: bad --threads '%s'\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_IO_URING:
+      use_uring = 1;
+      break;
+    case OPT_SNAPSHOT:
+      snap_name = optarg;
+      break;
+    case OPT_INCREMENTAL:
+      incremental = 1;
+      break;
+    case OPT_STATS:
+      if (optarg && strcmp(optarg, "json")) {
+	fprintf(stderr, "mytar: bad --stats '%s'\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      stats_json = optarg != NULL;
+      stats_start();
+      break;
+    case OPT_READ_BUFFER:
+      /* 0 turns reading ahead off */
+      if ((read_buf = parse_size(optarg)) == 0 && strcmp(optarg, "0")) {
+	fprintf(stderr, "mytar: bad --read-buffer '%s'\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_SORT:
+      if (strcmp(optarg, "none") == 0) {
+	sort_order = SORT_NONE;
+      } else if (strcmp(optarg, "inode") == 0) {
+	sort_order = SORT_INODE;
+      } else if (strcmp(optarg, "extent") == 0) {
+	sort_order = SORT_EXTENT;
+      } else {
+	fprintf(stderr, "mytar: bad --sort '%s', want none, inode or extent\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_NO_CACHE:
+      io_nocache = 1;
+      break;
+    case OPT_EXCLUDE:
+    case OPT_INCLUDE:
+      if ((patterns == NULL && (patterns = pattern_new()) == NULL) ||
+	  pattern_add(patterns, optarg, opt == OPT_INCLUDE)) {
+	exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: mytar [ctxruvSz]f tarfile [ path [ ... ] ]\n");
       exit(EXIT_FAILURE);
     }
   }
@@ -468,7 +1875,7 @@ int main(int argc, char *argv[]) {
   param_mask = get_param_mask(argv[optind++]);
   char* archive_name;
   if (!(archive_name = argv[optind++])) {
-    fprintf(stderr, "usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+    fprintf(stderr, "usage: mytar [ctxruvSz]f tarfile [ path [ ... ] ]\n");
     exit(EXIT_FAILURE);
   }
   
@@ -478,6 +1885,11 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "error creating archive\n");
       exit(EXIT_FAILURE);
     }
+  } else if ((param_mask & RMASK)) {
+    if ((arch_fd = append_arch(archive_name, param_mask, argv)) == -1) {
+      fprintf(stderr, "error appending to archive\n");
+      exit(EXIT_FAILURE);
+    }
   } else if ((param_mask & TMASK)) {
     if (argv[optind] == NULL) {
       if (list_arch(archive_name, param_mask) == -1) {
@@ -491,7 +1903,14 @@ int main(int argc, char *argv[]) {
       }
     }
   } else if ((param_mask & XMASK)) {
-    //extract_arch(archive_name, param_mask);
+    if (extract_arch(archive_name, param_mask, argv) == -1) {
+      fprintf(stderr, "error extracting archive\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (stats_on) {
+    stats_report(stderr, stats_json);
   }
 
   return 0;
@@ -0,0 +1,407 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pattern.h"
+
+#define FNV_START 2166136261u
+#define FNV_PRIME 16777619u
+
+/* names deeper than this keep the rest in their last segment */
+#define MAX_SEGS 512
+
+#define SEG_MATCHED 1   /* the pattern took the name or a directory above it */
+#define SEG_BELOW 2     /* it ran past the name, something under could match */
+
+typedef struct seg {
+  char *s;
+  int len;
+} seg;
+
+/* a glob with a '/' in it, matched from the top of the name */
+typedef struct anchored {
+  seg *segs;
+  int nsegs;
+} anchored;
+
+/* the excludes or the includes. a component without wildcards is
+ * found by hash, so a long list of directory names to leave out costs
+ * one lookup per component */
+typedef struct pat_list {
+  seg *lits;           /* open addressed, s is NULL for an empty slot */
+  uint32_t *lit_hash;
+  uint32_t lit_mask;
+  int nlits;
+  seg *globs;          /* components with wildcards */
+  int nglobs;
+  anchored *anch;
+  int nanch;
+  int count;
+} pat_list;
+
+struct pattern_set {
+  pat_list ex;
+  pat_list in;
+  char **strs;         /* the patterns the segments point into */
+  int nstrs;
+};
+
+/* returns the empty set on success NULL on failure */
+pattern_set *pattern_new(void) {
+  pattern_set *ps;
+  if ((ps = calloc(1, sizeof(pattern_set))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  return ps;
+}
+
+static uint32_t hash_seg(char *s, int len) {
+  uint32_t h = FNV_START;
+  int i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t) s[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+/* cut name into its segments, dropping a leading "./", empty ones and
+ * "." ones. returns how many */
+static int split(char *name, seg *out, int max) {
+  int n = 0, len;
+  char *end;
+  while (*name) {
+    while (*name == '/') {
+      name++;
+    }
+    if (*name == '\0') {
+      break;
+    }
+    if (n == max - 1 || (end = strchr(name, '/')) == NULL) {
+      end = name + strlen(name);
+    }
+    len = end - name;
+    if (len != 1 || name[0] != '.') {
+      out[n].s = name;
+      out[n].len = len;
+      n++;
+    }
+    name = end;
+  }
+  return n;
+}
+
+/* length of the one character element at the front of p if it takes c,
+ * 0 if it doesn't. a '[' without its ']' is just a '[' */
+static int one_char(char *p, int plen, char c) {
+  int i, neg, first = 1, hit = 0;
+  char lo, hi;
+  switch (p[0]) {
+  case '?':
+    return 1;
+  case '\\':
+    if (plen > 1) {
+      return p[1] == c ? 2 : 0;
+    }
+    return c == '\\';
+  case '[':
+    i = 1;
+    neg = i < plen && (p[i] == '!' || p[i] == '^');
+    if (neg) {
+      i++;
+    }
+    /* a ']' straight after the '[' is one of the set */
+    for (; i < plen && (p[i] != ']' || first); first = 0) {
+      lo = p[i];
+      hi = lo;
+      if (i + 2 < plen && p[i + 1] == '-' && p[i + 2] != ']') {
+	hi = p[i + 2];
+	i += 3;
+      } else {
+	i++;
+      }
+      if (lo <= c && c <= hi) {
+	hit = 1;
+      }
+    }
+    if (i >= plen) {
+      return c == '[';
+    }
+    return hit != neg ? i + 1 : 0;
+  default:
+    return p[0] == c;
+  }
+}
+
+/* glob p against the one segment s. a '*' backs off to the last one
+ * seen when the rest fails, which is all a pattern without '/' needs */
+static int glob_seg(char *p, int plen, char *s, int slen) {
+  int pi = 0, si = 0, star_p = -1, star_s = 0, n;
+  while (si < slen) {
+    if (pi < plen && p[pi] == '*') {
+      star_p = ++pi;
+      star_s = si;
+      continue;
+    }
+    if (pi < plen && (n = one_char(p + pi, plen - pi, s[si])) > 0) {
+      pi += n;
+      si++;
+      continue;
+    }
+    if (star_p == -1) {
+      return 0;
+    }
+    pi = star_p;
+    si = ++star_s;
+  }
+  while (pi < plen && p[pi] == '*') {
+    pi++;
+  }
+  return pi == plen;
+}
+
+static int has_magic(char *s, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int lit_find(pat_list *l, char *s, int len, uint32_t hash) {
+  seg *slot;
+  uint32_t i;
+  if (l -> nlits == 0) {
+    return 0;
+  }
+  for (i = hash & l -> lit_mask; (slot = &l -> lits[i]) -> s; i = (i + 1) & l -> lit_mask) {
+    if (l -> lit_hash[i] == hash && slot -> len == len && memcmp(slot -> s, s, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 0 on success -1 on failure */
+static int lit_add(pat_list *l, seg *s) {
+  uint32_t old_cap = l -> lits ? l -> lit_mask + 1 : 0, cap, i, j, hash;
+  seg *old = l -> lits;
+  uint32_t *old_hash = l -> lit_hash;
+
+  /* keep it at most half full */
+  if ((uint32_t) (l -> nlits + 1) * 2 > old_cap) {
+    cap = old_cap ? old_cap * 2 : 16;
+    if ((l -> lits = calloc(cap, sizeof(seg))) == NULL ||
+	(l -> lit_hash = malloc(cap * sizeof(uint32_t))) == NULL) {
+      perror("pattern_add");
+      free(l -> lits);
+      l -> lits = old;
+      l -> lit_hash = old_hash;
+      return -1;
+    }
+    l -> lit_mask = cap - 1;
+    for (i = 0; i < old_cap; i++) {
+      if (old[i].s) {
+	for (j = old_hash[i] & l -> lit_mask; l -> lits[j].s; j = (j + 1) & l -> lit_mask);
+	l -> lits[j] = old[i];
+	l -> lit_hash[j] = old_hash[i];
+      }
+    }
+    free(old);
+    free(old_hash);
+  }
+  hash = hash_seg(s -> s, s -> len);
+  if (lit_find(l, s -> s, s -> len, hash)) {
+    return 0;
+  }
+  for (j = hash & l -> lit_mask; l -> lits[j].s; j = (j + 1) & l -> lit_mask);
+  l -> lits[j] = *s;
+  l -> lit_hash[j] = hash;
+  l -> nlits++;
+  return 0;
+}
+
+/* compile pat onto the excludes, or the includes with include set
+ * 0 on success -1 on failure */
+int pattern_add(pattern_set *ps, char *pat, int include) {
+  pat_list *l = include ? &ps -> in : &ps -> ex;
+  char *str, **strs;
+  seg *segs, *grown;
+  anchored *anch;
+  int n, max = 1;
+
+  if ((str = strdup(pat)) == NULL ||
+      (strs = realloc(ps -> strs, (ps -> nstrs + 1) * sizeof(char *))) == NULL) {
+    perror("pattern_add");
+    free(str);
+    return -1;
+  }
+  ps -> strs = strs;
+  ps -> strs[ps -> nstrs++] = str;
+  for (pat = str; *pat; pat++) {
+    max += *pat == '/';
+  }
+  if ((segs = malloc(max * sizeof(seg))) == NULL) {
+    perror("pattern_add");
+    return -1;
+  }
+  if ((n = split(str, segs, max)) == 0) {
+    fprintf(stderr, "'%s': empty pattern\n", str);
+    free(segs);
+    return -1;
+  }
+
+  /* a '/' anywhere but at the end ties it to the top of the name */
+  for (max = strlen(str); max > 1 && str[max - 1] == '/'; max--);
+  if (memchr(str, '/', max) == NULL) {
+    /* goes against every component */
+    if (has_magic(segs[0].s, segs[0].len)) {
+      if ((grown = realloc(l -> globs, (l -> nglobs + 1) * sizeof(seg))) == NULL) {
+	perror("pattern_add");
+	free(segs);
+	return -1;
+      }
+      l -> globs = grown;
+      l -> globs[l -> nglobs++] = segs[0];
+    } else if (lit_add(l, &segs[0])) {
+      free(segs);
+      return -1;
+    }
+    free(segs);
+  } else {
+    if ((anch = realloc(l -> anch, (l -> nanch + 1) * sizeof(anchored))) == NULL) {
+      perror("pattern_add");
+      free(segs);
+      return -1;
+    }
+    l -> anch = anch;
+    l -> anch[l -> nanch].segs = segs;
+    l -> anch[l -> nanch].nsegs = n;
+    l -> nanch++;
+  }
+  l -> count++;
+  return 0;
+}
+
+/* does l have a component pattern that takes s */
+static int component_match(pat_list *l, seg *s) {
+  int i;
+  if (lit_find(l, s -> s, s -> len, hash_seg(s -> s, s -> len))) {
+    return 1;
+  }
+  for (i = 0; i < l -> nglobs; i++) {
+    if (glob_seg(l -> globs[i].s, l -> globs[i].len, s -> s, s -> len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* run the pattern segments p along the name segments s. SEG_MATCHED
+ * once the pattern is used up, whatever is left of the name is under
+ * what it took. SEG_BELOW when the name runs out first */
+static int walk_segs(seg *p, int np, seg *s, int ns) {
+  int i, r;
+  if (np == 0) {
+    return SEG_MATCHED;
+  }
+  if (ns == 0) {
+    /* "**" can take nothing at all */
+    for (i = 0; i < np && p[i].len == 2 && memcmp(p[i].s, "**", 2) == 0; i++);
+    return i == np ? SEG_MATCHED | SEG_BELOW : SEG_BELOW;
+  }
+  if (p[0].len == 2 && memcmp(p[0].s, "**", 2) == 0) {
+    if ((r = walk_segs(p + 1, np - 1, s, ns)) & SEG_MATCHED) {
+      return r;
+    }
+    return r | walk_segs(p, np, s + 1, ns - 1);
+  }
+  if (!glob_seg(p[0].s, p[0].len, s[0].s, s[0].len)) {
+    return 0;
+  }
+  return walk_segs(p + 1, np - 1, s + 1, ns - 1);
+}
+
+/* SEG_MATCHED if some pattern in l takes the name in s or a directory
+ * above it, else SEG_BELOW if one could still take something under it */
+static int list_match(pat_list *l, seg *s, int ns) {
+  int i, r = 0;
+  for (i = 0; i < ns; i++) {
+    if (component_match(l, &s[i])) {
+      return SEG_MATCHED;
+    }
+  }
+  if (l -> nlits || l -> nglobs) {
+    r = SEG_BELOW;
+  }
+  for (i = 0; i < l -> nanch; i++) {
+    r |= walk_segs(l -> anch[i].segs, l -> anch[i].nsegs, s, ns);
+    if (r & SEG_MATCHED) {
+      return SEG_MATCHED;
+    }
+  }
+  return r;
+}
+
+/* 1 to leave name out, archiving or off an archive. a directory (name
+ * ending in '/') an --include could still take something under stays
+ * in, so what is included comes back with the mode, owner and mtime of
+ * the directories above it */
+int pattern_skip(pattern_set *ps, char *name) {
+  seg s[MAX_SEGS];
+  int n = split(name, s, MAX_SEGS), r;
+  size_t len = strlen(name);
+  if (ps -> ex.count && list_match(&ps -> ex, s, n) & SEG_MATCHED) {
+    return 1;
+  }
+  if (ps -> in.count == 0) {
+    return 0;
+  }
+  r = list_match(&ps -> in, s, n);
+  if (len && name[len - 1] == '/' && r & SEG_BELOW) {
+    return 0;
+  }
+  return !(r & SEG_MATCHED);
+}
+
+/* 1 if path can be passed over without even a stat. for a path ending
+ * in '/' that takes everything under the directory too: it is
+ * excluded, or no --include could take anything in it. anything else
+ * is only known to be out here when it is excluded, whether an include
+ * takes it can wait for pattern_skip */
+int pattern_prune(pattern_set *ps, char *path) {
+  seg s[MAX_SEGS];
+  int n = split(path, s, MAX_SEGS);
+  size_t len = strlen(path);
+  if (ps -> ex.count && list_match(&ps -> ex, s, n) & SEG_MATCHED) {
+    return 1;
+  }
+  if (len == 0 || path[len - 1] != '/' || ps -> in.count == 0) {
+    return 0;
+  }
+  return list_match(&ps -> in, s, n) == 0;
+}
+
+static void list_free(pat_list *l) {
+  int i;
+  for (i = 0; i < l -> nanch; i++) {
+    free(l -> anch[i].segs);
+  }
+  free(l -> anch);
+  free(l -> globs);
+  free(l -> lits);
+  free(l -> lit_hash);
+}
+
+void pattern_free(pattern_set *ps) {
+  int i;
+  list_free(&ps -> ex);
+  list_free(&ps -> in);
+  for (i = 0; i < ps -> nstrs; i++) {
+    free(ps -> strs[i]);
+  }
+  free(ps -> strs);
+  free(ps);
+}
@@ -0,0 +1,27 @@
+#ifndef PATTERN
+#define PATTERN
+
+/* --exclude and --include globs, compiled once. a pattern without a '/'
+ * is held up against every component of a name ("node_modules",
+ * "*.o"), one with a '/' against the name from the top a segment at a
+ * time ("src/gen"), where a "**" segment stands for any number of
+ * them. '*', '?' and [...] never match a '/'. a name matches when
+ * it or a directory above it does.
+ *
+ * a name is left out if any --exclude matches it, or if there are
+ * --includes and none of them does. a directory stays in as long as an
+ * include could take something under it, so the ones above an
+ * included name keep their own headers. safe to call from any thread
+ * once every pattern is in */
+typedef struct pattern_set pattern_set;
+
+pattern_set *pattern_new(void);
+
+int pattern_add(pattern_set *ps, char *pat, int include);
+
+int pattern_skip(pattern_set *ps, char *name);
+
+int pattern_prune(pattern_set *ps, char *path);
+
+void pattern_free(pattern_set *ps);
+#endif
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pax.h"
+
+/* write "len key=val\n" to dst, len counting its own digits
+ * returns the record's length, 0 if it doesn't fit in cap */
+size_t pax_record(char *dst, size_t cap, const char *key, const char *val) {
+  size_t body = strlen(key) + strlen(val) + 3, len = body, digits;
+  char num[24];
+  /* settle on a length that holds its own digits */
+  do {
+    digits = snprintf(num, sizeof(num), "%zu", len);
+    len = body + digits;
+  } while ((size_t) snprintf(num, sizeof(num), "%zu", len) != digits);
+  if (len >= cap) {
+    return 0;
+  }
+  snprintf(dst, cap, "%zu %s=%s\n", len, key, val);
+  return len;
+}
+
+/* forget everything, for the next member. the names are only
+ * cleared at the front, that is all anyone looks at */
+void pax_clear(pax_attrs *a) {
+  a -> present = 0;
+  a -> name[0] = '\0';
+  a -> linkname[0] = '\0';
+  a -> size = -1;
+  a -> sparse = 0;
+  a -> realsize = 0;
+}
+
+/* copy a value into one of the name buffers, 0 on success -1 if it
+ * is too long to take */
+static int take_name(char *dst, const char *val, size_t val_len) {
+  if (val_len > PAX_NAME_MAX) {
+    fprintf(stderr, "%.64s...: name too long, keeping the short one\n", val);
+    return -1;
+  }
+  memcpy(dst, val, val_len);
+  dst[val_len] = '\0';
+  return 0;
+}
+
+#define KEY_IS(k, key, len) ((len) == sizeof(k) - 1 && memcmp((key), (k), (len)) == 0)
+
+/* add the records of an extended header to a, keys we don't know
+ * are skipped. 0 on success -1 if the records are garbled */
+int pax_parse(const uint8_t *p, size_t len, pax_attrs *a) {
+  const char *rec = (const char *) p, *end = rec + len, *key, *val, *eq;
+  char *num_end;
+  size_t rec_len, val_len, key_len;
+
+  a -> present = 1;
+  while (rec < end && *rec) {
+    rec_len = strtoul(rec, &num_end, 10);
+    if (num_end == rec || *num_end != ' ' || rec_len == 0 ||
+	rec_len > (size_t) (end - rec) || rec[rec_len - 1] != '\n') {
+      return -1;
+    }
+    key = num_end + 1;
+    if ((eq = memchr(key, '=', rec + rec_len - key)) == NULL) {
+      return -1;
+    }
+    key_len = eq - key;
+    val = eq + 1;
+    val_len = rec + rec_len - 1 - val;
+
+    if (KEY_IS("path", key, key_len) || KEY_IS("GNU.sparse.name", key, key_len)) {
+      take_name(a -> name, val, val_len);
+    } else if (KEY_IS("linkpath", key, key_len)) {
+      take_name(a -> linkname, val, val_len);
+    } else if (KEY_IS("size", key, key_len)) {
+      a -> size = strtoll(val, NULL, 10);
+    } else if (KEY_IS("GNU.sparse.realsize", key, key_len)) {
+      a -> realsize = strtoll(val, NULL, 10);
+    } else if (KEY_IS("GNU.sparse.major", key, key_len)) {
+      /* only 1.0 keeps the map in the body, 0.x needs keys we don't read */
+      a -> sparse = strtol(val, NULL, 10) == 1;
+    }
+    rec += rec_len;
+  }
+  return 0;
+}
+
+/* the body of a GNU 'L' or 'K' member is just the name, nul
+ * terminated (or not, when it fills the body exactly) */
+void pax_long_name(const uint8_t *p, size_t len, char *dst) {
+  const uint8_t *nul = memchr(p, '\0', len);
+  take_name(dst, (const char *) p, nul ? (size_t) (nul - p) : len);
+}
@@ -0,0 +1,29 @@
+#ifndef PAX
+#define PAX
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PAX_NAME_MAX 4095     /* so a name fits a PATHMAX buffer */
+#define PAX_MAX (64 << 10)   /* biggest extended header we read */
+
+/* what an extended header ('x', or GNU's 'L'/'K') says about the
+ * member after it */
+typedef struct pax_attrs {
+  int present;
+  char name[PAX_NAME_MAX + 1];   /* empty to use the member's own */
+  char linkname[PAX_NAME_MAX + 1];
+  off_t size;                    /* -1 to use the member's own */
+  int sparse;                    /* GNU sparse 1.0, the body starts with the map */
+  off_t realsize;
+} pax_attrs;
+
+size_t pax_record(char *dst, size_t cap, const char *key, const char *val);
+
+void pax_clear(pax_attrs *a);
+
+int pax_parse(const uint8_t *p, size_t len, pax_attrs *a);
+
+void pax_long_name(const uint8_t *p, size_t len, char *dst);
+#endif
@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "read_pool.h"
+#include "stats.h"
+#include "io_policy.h"
+
+typedef struct read_chunk {
+  struct read_chunk *next;
+  size_t len;
+  uint8_t *data;
+} read_chunk;
+
+struct read_pool {
+  read_write_fn fn;
+  void *arg;
+  uint8_t *mem;          /* every chunk's data, carved out of one block */
+  read_chunk *chunks;
+
+  /* everything below is guarded by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  read_chunk *free;
+  int nfree;
+  read_member *members;  /* member seq lives in slot seq % READ_QUEUE */
+  long next_submit;      /* sequence number the producer fills next */
+  long next_read;        /* next one a reader picks up */
+  long next_write;       /* the one the writer is on */
+  long hinted;           /* next one to get a WILLNEED, with --no-cache */
+  int eof;
+
+  pthread_t writer;
+  pthread_t *readers;
+  int nreaders;
+};
+
+/* a free chunk for member seq. the member the writer is on can always
+ * have one, the others leave the last free chunk for it so big files
+ * read ahead can't starve the writer. called and returns locked */
+static read_chunk *take_chunk(read_pool *rp, long seq) {
+  read_chunk *c;
+  while (rp -> free == NULL || (seq != rp -> next_write && rp -> nfree < 2)) {
+    pthread_cond_wait(&rp -> cond, &rp -> lock);
+  }
+  c = rp -> free;
+  rp -> free = c -> next;
+  rp -> nfree--;
+  return c;
+}
+
+/* called locked */
+static void give_chunk(read_pool *rp, read_chunk *c) {
+  c -> next = rp -> free;
+  rp -> free = c;
+  rp -> nfree++;
+  pthread_cond_broadcast(&rp -> cond);
+}
+
+/* read m's body into chunks as they come free. exactly st_size bytes
+ * at most, a file that grew since the stat gets cut at that */
+static void load(read_pool *rp, read_member *m, long seq) {
+  off_t left = m -> st.st_size;
+  read_chunk *c;
+  io_trail trail;
+  ssize_t n;
+  int fd, err = 0;
+  uint64_t t0;
+
+  t0 = STATS_START();
+  if ((fd = open(m -> fname, O_RDONLY)) == -1) {
+    err = errno;
+  } else {
+    io_trail_init(&trail, fd, 0, 0);
+  }
+  STATS_END(PH_OPEN, t0, 1, 0);
+
+  while (fd != -1 && left > 0) {
+    pthread_mutex_lock(&rp -> lock);
+    c = take_chunk(rp, seq);
+    pthread_mutex_unlock(&rp -> lock);
+
+    t0 = STATS_START();
+    while ((n = read(fd, c -> data, left < READ_CHUNK ? left : READ_CHUNK)) == -1 &&
+	   errno == EINTR) {
+      ;
+    }
+    if (n == -1) {
+      err = errno;
+    }
+    STATS_END(PH_READ, t0, 1, n > 0 ? n : 0);
+
+    pthread_mutex_lock(&rp -> lock);
+    if (n <= 0) {
+      /* failed or shrank, the writer pads out the rest */
+      give_chunk(rp, c);
+      pthread_mutex_unlock(&rp -> lock);
+      break;
+    }
+    io_trail_moved(&trail, n);
+    c -> len = n;
+    c -> next = NULL;
+    if (m -> tail) {
+      m -> tail -> next = c;
+    } else {
+      m -> head = c;
+    }
+    m -> tail = c;
+    pthread_cond_broadcast(&rp -> cond);
+    pthread_mutex_unlock(&rp -> lock);
+    left -= n;
+  }
+  if (fd != -1) {
+    io_trail_end(&trail, 0);
+    t0 = STATS_START();
+    close(fd);
+    STATS_END(PH_OPEN, t0, 1, 0);
+  }
+
+  pthread_mutex_lock(&rp -> lock);
+  m -> err = err;
+  m -> unopened = fd == -1;
+  m -> loaded = 1;
+  pthread_cond_broadcast(&rp -> cond);
+  pthread_mutex_unlock(&rp -> lock);
+}
+
+/* take queued members in order and load the ones that want it */
+static void *rpool_read(void *arg) {
+  read_pool *rp = arg;
+  read_member *m;
+  long seq;
+
+  pthread_mutex_lock(&rp -> lock);
+  for (;;) {
+    if (rp -> next_read == rp -> next_submit) {
+      if (rp -> eof) {
+	break;
+      }
+      pthread_cond_wait(&rp -> cond, &rp -> lock);
+      continue;
+    }
+    seq = rp -> next_read++;
+    m = &rp -> members[seq % READ_QUEUE];
+    if (!m -> prefetch) {
+      continue;
+    }
+    pthread_mutex_unlock(&rp -> lock);
+    load(rp, m, seq);
+    pthread_mutex_lock(&rp -> lock);
+  }
+  pthread_mutex_unlock(&rp -> lock);
+  return NULL;
+}
+
+/* the bodies the writer reads itself don't come through the readers,
+ * get the kernel started on the next few of them. called locked */
+static void hint_ahead(read_pool *rp) {
+  read_member *ahead[IO_AHEAD], *m;
+  int n = 0, i;
+  if (rp -> hinted <= rp -> next_write) {
+    rp -> hinted = rp -> next_write + 1;
+  }
+  for (; rp -> hinted < rp -> next_submit && rp -> hinted <= rp -> next_write + IO_AHEAD;
+       rp -> hinted++) {
+    m = &rp -> members[rp -> hinted % READ_QUEUE];
+    if (m -> kind == RM_ADD && !m -> prefetch && S_ISREG(m -> st.st_mode)) {
+      ahead[n++] = m;
+    }
+  }
+  /* they stay put until the writer gets past them */
+  pthread_mutex_unlock(&rp -> lock);
+  for (i = 0; i < n; i++) {
+    io_prefetch(ahead[i] -> fname, ahead[i] -> st.st_size);
+  }
+  pthread_mutex_lock(&rp -> lock);
+}
+
+/* hand the members to fn in the order they were queued */
+static void *rpool_write(void *arg) {
+  read_pool *rp = arg;
+  read_member *m;
+  uint8_t *data;
+
+  pthread_mutex_lock(&rp -> lock);
+  for (;;) {
+    if (rp -> next_write == rp -> next_submit) {
+      if (rp -> eof) {
+	break;
+      }
+      pthread_cond_wait(&rp -> cond, &rp -> lock);
+      continue;
+    }
+    if (io_nocache) {
+      hint_ahead(rp);
+    }
+    m = &rp -> members[rp -> next_write % READ_QUEUE];
+    pthread_mutex_unlock(&rp -> lock);
+
+    rp -> fn(rp, m, rp -> arg);
+    /* whatever fn left of the body goes back to the pool */
+    if (m -> prefetch) {
+      while (rpool_next(rp, m, &data) > 0) {
+	;
+      }
+    }
+
+    pthread_mutex_lock(&rp -> lock);
+    rp -> next_write++;
+    pthread_cond_broadcast(&rp -> cond);
+  }
+  pthread_mutex_unlock(&rp -> lock);
+  return NULL;
+}
+
+/* start nreaders threads loading bodies into at most budget bytes of
+ * chunks, and a writer calling fn(rp, member, arg) for each member in
+ * the order they are submitted. returns the pool on success NULL on
+ * failure */
+read_pool *rpool_start(int nreaders, size_t budget, read_write_fn fn, void *arg) {
+  read_pool *rp;
+  int nchunks, i;
+
+  if ((rp = calloc(1, sizeof(read_pool))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  if (nreaders < 1) {
+    nreaders = 1;
+  }
+  /* two at least, one read ahead and one for the writer */
+  if ((nchunks = budget / READ_CHUNK) < 2) {
+    nchunks = 2;
+  }
+  rp -> fn = fn;
+  rp -> arg = arg;
+  if ((rp -> mem = malloc((size_t) nchunks * READ_CHUNK)) == NULL ||
+      (rp -> chunks = calloc(nchunks, sizeof(read_chunk))) == NULL ||
+      (rp -> members = calloc(READ_QUEUE, sizeof(read_member))) == NULL ||
+      (rp -> readers = calloc(nreaders, sizeof(pthread_t))) == NULL) {
+    perror("malloc");
+    free(rp -> mem);
+    free(rp -> chunks);
+    free(rp -> members);
+    free(rp);
+    return NULL;
+  }
+  for (i = 0; i < nchunks; i++) {
+    rp -> chunks[i].data = rp -> mem + (size_t) i * READ_CHUNK;
+    rp -> chunks[i].next = rp -> free;
+    rp -> free = &rp -> chunks[i];
+  }
+  rp -> nfree = nchunks;
+  pthread_mutex_init(&rp -> lock, NULL);
+  pthread_cond_init(&rp -> cond, NULL);
+
+  if (pthread_create(&rp -> writer, NULL, rpool_write, rp)) {
+    fprintf(stderr, "rpool_start: unable to start threads\n");
+    free(rp -> mem);
+    free(rp -> chunks);
+    free(rp -> members);
+    free(rp -> readers);
+    free(rp);
+    return NULL;
+  }
+  for (i = 0; i < nreaders; i++) {
+    if (pthread_create(&rp -> readers[i], NULL, rpool_read, rp)) {
+      break;
+    }
+  }
+  rp -> nreaders = i;
+  if (i == 0) {
+    /* the writer can't get anything loaded, take the bodies on it */
+    fprintf(stderr, "rpool_start: no readers, the writer reads everything\n");
+  }
+  return rp;
+}
+
+/* queue a member behind the ones already submitted, blocks while the
+ * queue is full. fname, path and st are copied
+ * 0 on success, -1 on failure */
+int rpool_submit(read_pool *rp, char *fname, char *path, struct stat *st, int kind,
+		 int prefetch) {
+  size_t flen = strlen(fname) + 1, plen = strlen(path) + 1;
+  read_member *m;
+  char *names;
+
+  pthread_mutex_lock(&rp -> lock);
+  while (rp -> next_submit - rp -> next_write == READ_QUEUE) {
+    pthread_cond_wait(&rp -> cond, &rp -> lock);
+  }
+  m = &rp -> members[rp -> next_submit % READ_QUEUE];
+  pthread_mutex_unlock(&rp -> lock);
+
+  /* the slot is ours alone until next_submit moves past it */
+  if (flen + plen > m -> names_cap) {
+    if ((names = realloc(m -> names, flen + plen)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    m -> names = names;
+    m -> names_cap = flen + plen;
+  }
+  m -> fname = memcpy(m -> names, fname, flen);
+  m -> path = memcpy(m -> names + flen, path, plen);
+  m -> st = *st;
+  m -> kind = kind;
+  m -> prefetch = prefetch && kind == RM_ADD && rp -> nreaders > 0;
+  m -> err = 0;
+  m -> loaded = 0;
+  m -> unopened = 0;
+  m -> head = m -> tail = m -> held = NULL;
+
+  pthread_mutex_lock(&rp -> lock);
+  rp -> next_submit++;
+  pthread_cond_broadcast(&rp -> cond);
+  pthread_mutex_unlock(&rp -> lock);
+  return 0;
+}
+
+/* the next piece of m's body, for the writer. waits on the reader if
+ * it hasn't got that far. returns the length of the piece, 0 once the
+ * body is all handed over (short if the file shrank or a read failed,
+ * m -> err says which) and -1 if the file couldn't be opened, errno in
+ * m -> err. *data stays good until the next call */
+ssize_t rpool_next(read_pool *rp, read_member *m, uint8_t **data) {
+  read_chunk *c;
+  uint64_t t0;
+
+  pthread_mutex_lock(&rp -> lock);
+  if (m -> held) {
+    give_chunk(rp, m -> held);
+    m -> held = NULL;
+  }
+  if (m -> head == NULL && !m -> loaded) {
+    t0 = STATS_START();
+    while (m -> head == NULL && !m -> loaded) {
+      pthread_cond_wait(&rp -> cond, &rp -> lock);
+    }
+    STATS_END(PH_READ_WAIT, t0, 1, 0);
+  }
+  if ((c = m -> head) == NULL) {
+    pthread_mutex_unlock(&rp -> lock);
+    return m -> unopened ? -1 : 0;
+  }
+  if ((m -> head = c -> next) == NULL) {
+    m -> tail = NULL;
+  }
+  m -> held = c;
+  pthread_mutex_unlock(&rp -> lock);
+  *data = c -> data;
+  return c -> len;
+}
+
+/* no more members, wait for the writer to take the last one and free
+ * everything. 0 on success, -1 on failure */
+int rpool_finish(read_pool *rp) {
+  int i;
+  pthread_mutex_lock(&rp -> lock);
+  rp -> eof = 1;
+  pthread_cond_broadcast(&rp -> cond);
+  pthread_mutex_unlock(&rp -> lock);
+
+  for (i = 0; i < rp -> nreaders; i++) {
+    pthread_join(rp -> readers[i], NULL);
+  }
+  pthread_join(rp -> writer, NULL);
+
+  for (i = 0; i < READ_QUEUE; i++) {
+    free(rp -> members[i].names);
+  }
+  pthread_mutex_destroy(&rp -> lock);
+  pthread_cond_destroy(&rp -> cond);
+  free(rp -> mem);
+  free(rp -> chunks);
+  free(rp -> members);
+  free(rp -> readers);
+  free(rp);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef READ_POOL
+#define READ_POOL
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define READ_CHUNK (64 << 10)
+#define READ_POOL_DEFAULT (32 << 20)
+#define READ_QUEUE 1024
+
+#define RM_ADD 0     /* goes into the archive */
+#define RM_KEEP 1    /* unchanged since the snapshot, only carried over */
+
+struct read_chunk;
+
+/* one member on its way into the archive. the producer queues them in
+ * archive order, the readers load the bodies of the ones marked
+ * prefetch as far ahead as the chunks allow, and a single writer
+ * takes them off in the same order they went in */
+typedef struct read_member {
+  char *fname;       /* where to read it from */
+  char *path;        /* its name in the archive */
+  struct stat st;
+  int kind;
+  int prefetch;      /* the readers load the body, else the writer does */
+  int err;           /* errno of a failed open or read, 0 if none */
+
+  /* the rest is the pool's, guarded by its lock */
+  int loaded;        /* the reader is done with it */
+  int unopened;
+  struct read_chunk *head;
+  struct read_chunk *tail;
+  struct read_chunk *held;   /* last piece handed to the writer */
+  char *names;               /* fname and path, reused slot to slot */
+  size_t names_cap;
+} read_member;
+
+typedef struct read_pool read_pool;
+
+/* called on the writer thread for every member, in order */
+typedef void (*read_write_fn)(read_pool *rp, read_member *m, void *arg);
+
+read_pool *rpool_start(int nreaders, size_t budget, read_write_fn fn, void *arg);
+
+int rpool_submit(read_pool *rp, char *fname, char *path, struct stat *st, int kind,
+		 int prefetch);
+
+ssize_t rpool_next(read_pool *rp, read_member *m, uint8_t **data);
+
+int rpool_finish(read_pool *rp);
+#endif
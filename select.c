@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "select.h"
+
+#define FNV_START 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct path_slot {
+  char *path;        /* NULL for an empty slot */
+  uint32_t hash;
+  uint32_t len;
+} path_slot;
+
+struct path_set {
+  path_slot *slots;
+  uint32_t mask;
+  char *strs;
+};
+
+/* length of path without trailing slashes, "dir/" and "dir" select
+ * the same thing */
+static size_t trimmed_len(char *path) {
+  size_t len = strlen(path);
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+  }
+  return len;
+}
+
+static uint32_t hash_bytes(char *p, size_t len) {
+  uint32_t h = FNV_START;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t) p[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+static int lookup(path_set *ps, char *p, uint32_t len, uint32_t hash) {
+  path_slot *s;
+  uint32_t i;
+  for (i = hash & ps -> mask; (s = &ps -> slots[i]) -> path; i = (i + 1) & ps -> mask) {
+    if (s -> hash == hash && s -> len == len && memcmp(s -> path, p, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* returns the compiled set on success NULL on failure */
+path_set *select_compile(char **LOF, int size) {
+  path_set *ps;
+  size_t total = 0, len, cap = 16;
+  int i;
+  char *p;
+  uint32_t hash;
+
+  for (i = 0; i < size; i++) {
+    total += trimmed_len(LOF[i]) + 1;
+  }
+  /* keep it at most half full */
+  while (cap < (size_t) size * 2) {
+    cap *= 2;
+  }
+  if ((ps = malloc(sizeof(path_set))) == NULL ||
+      (ps -> slots = calloc(cap, sizeof(path_slot))) == NULL ||
+      (ps -> strs = malloc(total + 1)) == NULL) {
+    perror("select_compile");
+    return NULL;
+  }
+  ps -> mask = cap - 1;
+
+  for (i = 0, p = ps -> strs; i < size; i++) {
+    len = trimmed_len(LOF[i]);
+    memcpy(p, LOF[i], len);
+    p[len] = '\0';
+    hash = hash_bytes(p, len);
+    if (!lookup(ps, p, len, hash)) {
+      uint32_t j;
+      for (j = hash & ps -> mask; ps -> slots[j].path; j = (j + 1) & ps -> mask);
+      ps -> slots[j].path = p;
+      ps -> slots[j].hash = hash;
+      ps -> slots[j].len = len;
+    }
+    p += len + 1;
+  }
+  return ps;
+}
+
+/* true if name is one of the selected paths or lies underneath one.
+ * the hash runs along the name once and every prefix ending at a '/'
+ * (and the whole name) is looked up as it goes by, so "a/b" picks up
+ * "a/b", "a/b/" and "a/b/c" but never "a/bc" or "x/a/b" */
+int select_match(path_set *ps, char *name) {
+  uint32_t h = FNV_START;
+  size_t i, len = trimmed_len(name);
+  for (i = 0; i < len; i++) {
+    if (name[i] == '/' && i > 0 && lookup(ps, name, i, h)) {
+      return 1;
+    }
+    h = (h ^ (uint8_t) name[i]) * FNV_PRIME;
+  }
+  return len > 0 && lookup(ps, name, len, h);
+}
+
+void select_free(path_set *ps) {
+  free(ps -> slots);
+  free(ps -> strs);
+  free(ps);
+}
@@ -0,0 +1,13 @@
+#ifndef SELECT
+#define SELECT
+
+/* the paths named on the command line compiled into a hash set, so a
+ * member is checked against all of them in one pass over its name */
+typedef struct path_set path_set;
+
+path_set *select_compile(char **LOF, int size);
+
+int select_match(path_set *ps, char *name);
+
+void select_free(path_set *ps);
+#endif
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+#define PATHMAX 4096
+
+#define FNV_START 2166136261u
+#define FNV_PRIME 16777619u
+
+/* open addressed table over the previous run's records */
+typedef struct snap_slot {
+  uint32_t rec;      /* record + 1, 0 for an empty slot */
+  uint32_t hash;
+} snap_slot;
+
+struct snapshot {
+  char name[PATHMAX];
+
+  /* the previous run, mapped read only */
+  void *map;
+  size_t map_len;
+  snap_rec *old;
+  char *old_names;
+  uint32_t old_count;
+  uint8_t *seen;
+  snap_slot *slots;
+  uint32_t mask;
+
+  /* this run, written out by snap_write */
+  snap_rec *recs;
+  uint64_t count;
+  uint64_t cap;
+  char *names;
+  uint64_t names_len;
+  uint64_t names_cap;
+};
+
+static uint32_t hash_str(char *p) {
+  uint32_t h = FNV_START;
+  for (; *p; p++) {
+    h = (h ^ (uint8_t) *p) * FNV_PRIME;
+  }
+  return h;
+}
+
+/* the previous record for path, NULL if it is new */
+static snap_rec *lookup(snapshot *snap, char *path) {
+  uint32_t hash, i;
+  snap_slot *s;
+  if (snap -> old_count == 0) {
+    return NULL;
+  }
+  hash = hash_str(path);
+  for (i = hash & snap -> mask; (s = &snap -> slots[i]) -> rec; i = (i + 1) & snap -> mask) {
+    if (s -> hash == hash && strcmp(snap -> old_names + snap -> old[s -> rec - 1].name_off, path) == 0) {
+      return &snap -> old[s -> rec - 1];
+    }
+  }
+  return NULL;
+}
+
+/* every record of the mapped snapshot names a path inside the names,
+ * which end in a nul. the head has already been checked against the
+ * file size */
+static int recs_valid(snapshot *snap, uint64_t names_len) {
+  uint64_t i;
+  if (names_len && snap -> old_names[names_len - 1] != '\0') {
+    return 0;
+  }
+  for (i = 0; i < snap -> old_count; i++) {
+    if (snap -> old[i].name_off >= names_len) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* map the previous snapshot and hash it by path */
+static int load_old(snapshot *snap, int fd) {
+  struct stat st;
+  snap_head *head;
+  uint64_t cap = 16, i, left;
+  uint32_t j;
+
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(snap_head)) {
+    fprintf(stderr, "%s: not a snapshot\n", snap -> name);
+    return -1;
+  }
+  if ((snap -> map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    snap -> map = NULL;
+    perror("snapshot mmap");
+    return -1;
+  }
+  snap -> map_len = st.st_size;
+  head = snap -> map;
+  /* sizes as they are in the file, nothing added up that could wrap */
+  left = st.st_size - sizeof(snap_head);
+  if (memcmp(head -> magic, SNAP_MAGIC, sizeof(head -> magic)) ||
+      head -> version != SNAP_VERSION || head -> count >= UINT32_MAX ||
+      head -> count > left / sizeof(snap_rec) ||
+      head -> names_len != left - head -> count * sizeof(snap_rec)) {
+    fprintf(stderr, "%s: not a snapshot\n", snap -> name);
+    return -1;
+  }
+  snap -> old_count = head -> count;
+  snap -> old = (snap_rec *) ((char *) snap -> map + sizeof(snap_head));
+  snap -> old_names = (char *) (snap -> old + snap -> old_count);
+  if (!recs_valid(snap, head -> names_len)) {
+    fprintf(stderr, "%s: not a snapshot\n", snap -> name);
+    snap -> old_count = 0;
+    return -1;
+  }
+
+  /* keep it at most half full */
+  while (cap < 2 * (uint64_t) snap -> old_count) {
+    cap *= 2;
+  }
+  if ((snap -> slots = calloc(cap, sizeof(snap_slot))) == NULL ||
+      (snap -> seen = calloc(snap -> old_count + 1, 1)) == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  snap -> mask = cap - 1;
+  for (i = 0; i < snap -> old_count; i++) {
+    uint32_t hash = hash_str(snap -> old_names + snap -> old[i].name_off);
+    for (j = hash & snap -> mask; snap -> slots[j].rec; j = (j + 1) & snap -> mask);
+    snap -> slots[j].rec = i + 1;
+    snap -> slots[j].hash = hash;
+  }
+  return 0;
+}
+
+/* start a run against the snapshot in snap_name. a missing file is a
+ * first (full) run. returns the snapshot on success NULL on failure */
+snapshot *snap_open(char *snap_name) {
+  snapshot *snap;
+  int fd;
+  if ((snap = calloc(1, sizeof(snapshot))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  if (strlen(snap_name) + 5 > PATHMAX) {
+    fprintf(stderr, "%s: snapshot name too long\n", snap_name);
+    free(snap);
+    return NULL;
+  }
+  strcpy(snap -> name, snap_name);
+  if ((fd = open(snap_name, O_RDONLY)) == -1) {
+    if (errno == ENOENT) {
+      return snap;
+    }
+    perror(snap_name);
+    free(snap);
+    return NULL;
+  }
+  if (load_old(snap, fd)) {
+    close(fd);
+    snap_free(snap);
+    return NULL;
+  }
+  close(fd);
+  return snap;
+}
+
+/* 1 if path was archived by the previous run and hasn't changed since */
+int snap_unchanged(snapshot *snap, char *path, struct stat *st) {
+  snap_rec *r;
+  if ((r = lookup(snap, path)) == NULL) {
+    return 0;
+  }
+  return r -> dev == (uint64_t) st -> st_dev && r -> ino == (uint64_t) st -> st_ino &&
+    r -> size == st -> st_size && r -> mtime_sec == st -> st_mtim.tv_sec &&
+    r -> mtime_nsec == st -> st_mtim.tv_nsec;
+}
+
+/* record path for the next run, archived or skipped as unchanged. a
+ * failed member is recorded so it can't match and gets retried
+ * 0 on success -1 on failure */
+int snap_add(snapshot *snap, char *path, struct stat *st, int failed) {
+  size_t len = strlen(path);
+  snap_rec *r;
+  if ((r = lookup(snap, path)) != NULL) {
+    snap -> seen[r - snap -> old] = 1;
+  }
+
+  if (snap -> count == snap -> cap) {
+    snap -> cap = snap -> cap ? snap -> cap * 2 : 1024;
+    if ((snap -> recs = realloc(snap -> recs, snap -> cap * sizeof(snap_rec))) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+  }
+  if (snap -> names_len + len + 1 > snap -> names_cap) {
+    snap -> names_cap = snap -> names_cap ? snap -> names_cap * 2 : 64 * 1024;
+    while (snap -> names_len + len + 1 > snap -> names_cap) {
+      snap -> names_cap *= 2;
+    }
+    if ((snap -> names = realloc(snap -> names, snap -> names_cap)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+  }
+
+  r = &snap -> recs[snap -> count++];
+  r -> dev = st -> st_dev;
+  r -> ino = st -> st_ino;
+  r -> size = failed ? -1 : st -> st_size;
+  r -> mtime_sec = st -> st_mtim.tv_sec;
+  r -> mtime_nsec = st -> st_mtim.tv_nsec;
+  r -> name_off = snap -> names_len;
+  memcpy(snap -> names + snap -> names_len, path, len + 1);
+  snap -> names_len += len + 1;
+  return 0;
+}
+
+static int desc_cmp(const void *a, const void *b) {
+  return strcmp(*(char **) b, *(char **) a);
+}
+
+/* everything the previous run had that this one never came across,
+ * as nul terminated paths deepest first in a malloc'd *list
+ * returns the length of the list, 0 if nothing went away */
+size_t snap_deleted(snapshot *snap, char **list) {
+  char **gone;
+  size_t n = 0, len = 0, i, l;
+  uint32_t r;
+
+  *list = NULL;
+  if (snap -> old_count == 0) {
+    return 0;
+  }
+  if ((gone = malloc(snap -> old_count * sizeof(char *))) == NULL) {
+    perror("malloc");
+    return 0;
+  }
+  for (r = 0; r < snap -> old_count; r++) {
+    if (!snap -> seen[r]) {
+      gone[n] = snap -> old_names + snap -> old[r].name_off;
+      len += strlen(gone[n++]) + 1;
+    }
+  }
+  /* reverse order puts "dir/file" ahead of "dir/" */
+  qsort(gone, n, sizeof(char *), desc_cmp);
+  if (n && (*list = malloc(len)) != NULL) {
+    for (i = 0, len = 0; i < n; i++) {
+      l = strlen(gone[i]);
+      memcpy(*list + len, gone[i], l);
+      (*list)[len + l] = '\0';
+      len += l + 1;
+    }
+  } else {
+    len = 0;
+  }
+  free(gone);
+  return len;
+}
+
+/* replace the snapshot on disk with this run, 0 on success -1 on failure */
+int snap_write(snapshot *snap) {
+  char tmp_name[PATHMAX + sizeof(".tmp")];
+  snap_head head;
+  FILE *fp;
+
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", snap -> name);
+  memset(&head, '\0', sizeof(head));
+  memcpy(head.magic, SNAP_MAGIC, sizeof(head.magic));
+  head.version = SNAP_VERSION;
+  head.count = snap -> count;
+  head.names_len = snap -> names_len;
+
+  if ((fp = fopen(tmp_name, "w")) == NULL) {
+    perror(tmp_name);
+    return -1;
+  }
+  if (fwrite(&head, sizeof(head), 1, fp) != 1 ||
+      fwrite(snap -> recs, sizeof(snap_rec), snap -> count, fp) != snap -> count ||
+      fwrite(snap -> names, 1, snap -> names_len, fp) != snap -> names_len) {
+    perror("snapshot write");
+    fclose(fp);
+    unlink(tmp_name);
+    return -1;
+  }
+  if (fclose(fp)) {
+    perror("snapshot close");
+    unlink(tmp_name);
+    return -1;
+  }
+  /* the old snapshot stays until the new one is complete */
+  if (rename(tmp_name, snap -> name)) {
+    perror("snapshot rename");
+    unlink(tmp_name);
+    return -1;
+  }
+  return 0;
+}
+
+void snap_free(snapshot *snap) {
+  if (snap -> map) {
+    munmap(snap -> map, snap -> map_len);
+  }
+  free(snap -> slots);
+  free(snap -> seen);
+  free(snap -> recs);
+  free(snap -> names);
+  free(snap);
+}
@@ -0,0 +1,47 @@
+#ifndef SNAPSHOT
+#define SNAPSHOT
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SNAP_MAGIC "MYTARSNP"
+#define SNAP_VERSION 1
+
+/* member an incremental archive lists what went away in, nul
+ * terminated paths deepest first. x --incremental removes them again */
+#define SNAP_DELETED ".mytar-deleted"
+
+/* on disk layout of a snapshot (--snapshot), host byte order:
+ * snap_head, count snap_recs, then the paths nul terminated */
+typedef struct snap_head {
+  char magic[8];
+  uint32_t version;
+  uint32_t pad;
+  uint64_t count;
+  uint64_t names_len;
+} snap_head;
+
+typedef struct snap_rec {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;        /* -1 for a file that didn't make it in */
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t name_off;
+} snap_rec;
+
+typedef struct snapshot snapshot;
+
+snapshot *snap_open(char *snap_name);
+
+int snap_unchanged(snapshot *snap, char *path, struct stat *st);
+
+int snap_add(snapshot *snap, char *path, struct stat *st, int failed);
+
+size_t snap_deleted(snapshot *snap, char **list);
+
+int snap_write(snapshot *snap);
+
+void snap_free(snapshot *snap);
+#endif
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sparse.h"
+
+#define BLOCK_SIZE 512
+
+/* find the data runs of fd with SEEK_DATA/SEEK_HOLE, the caller frees
+ * *exts. a hole at the end gets an empty run at size so readers that
+ * only follow the map still end up with the full length
+ * returns the number of runs, 0 if the file isn't sparse (or the
+ * filesystem can't say), -1 on failure */
+int sparse_scan(int fd, off_t size, sparse_ext **exts) {
+  off_t off = 0, data, hole;
+  int n = 0, cap = 0;
+  sparse_ext *e = NULL, *grown;
+
+  *exts = NULL;
+  while (off < size) {
+    if ((data = lseek(fd, off, SEEK_DATA)) == -1) {
+      if (errno == ENXIO) {
+	break;
+      }
+      free(e);
+      return 0;
+    }
+    if (data >= size) {
+      break;
+    }
+    if ((hole = lseek(fd, data, SEEK_HOLE)) == -1 || hole > size) {
+      hole = size;
+    }
+    /* one spare for the trailing empty run */
+    if (n + 2 > cap) {
+      cap = cap ? cap * 2 : 16;
+      if ((grown = realloc(e, cap * sizeof(sparse_ext))) == NULL) {
+	perror("realloc");
+	free(e);
+	return -1;
+      }
+      e = grown;
+    }
+    e[n].offset = data;
+    e[n].size = hole - data;
+    n++;
+    off = hole;
+  }
+  lseek(fd, 0, SEEK_SET);
+
+  if (n == 1 && e[0].offset == 0 && e[0].size == size) {
+    free(e);
+    return 0;
+  }
+  if (n == 0 || e[n - 1].offset + e[n - 1].size < size) {
+    if (n == 0 && (e = malloc(sizeof(sparse_ext))) == NULL) {
+      perror("malloc");
+      return -1;
+    }
+    e[n].offset = size;
+    e[n].size = 0;
+    n++;
+  }
+  *exts = e;
+  return n;
+}
+
+/* the map at the front of a GNU 1.0 sparse body: the number of runs
+ * then offset and size of each, one decimal per line, nul padded out
+ * to a whole block. returns it malloc'd, its padded length in *len */
+char *sparse_map_text(sparse_ext *exts, int n, size_t *len) {
+  size_t cap = (2 * (size_t) n + 1) * 21 + BLOCK_SIZE, used;
+  char *text;
+  int i;
+  if ((text = malloc(cap)) == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  used = sprintf(text, "%d\n", n);
+  for (i = 0; i < n; i++) {
+    used += sprintf(text + used, "%lld\n%lld\n", (long long) exts[i].offset,
+		    (long long) exts[i].size);
+  }
+  *len = (used + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  memset(text + used, '\0', *len - used);
+  return text;
+}
+
+/* read one decimal and its newline out of [*p, end)
+ * 1 on success, 0 if the buffer ran out first, -1 on garbage */
+static int next_num(const char **p, const char *end, long long *val) {
+  const char *q = *p;
+  *val = 0;
+  if (q == end) {
+    return 0;
+  }
+  if (*q < '0' || *q > '9') {
+    return -1;
+  }
+  for (; q < end && *q >= '0' && *q <= '9'; q++) {
+    if (*val > (INT64_MAX - 9) / 10) {
+      return -1;
+    }
+    *val = *val * 10 + (*q - '0');
+  }
+  if (q == end) {
+    return 0;
+  }
+  if (*q != '\n') {
+    return -1;
+  }
+  *p = q + 1;
+  return 1;
+}
+
+/* parse the map at the front of a sparse body out of its first len
+ * bytes, the caller frees *exts. returns the bytes the map takes up,
+ * 0 if it goes on past len, -1 if it is garbled */
+ssize_t sparse_map_parse(const uint8_t *p, size_t len, sparse_ext **exts, int *n) {
+  const char *q = (const char *) p, *end = q + len;
+  long long count, off, size, last = 0;
+  sparse_ext *e;
+  int i, r;
+
+  *exts = NULL;
+  if ((r = next_num(&q, end, &count)) != 1) {
+    return r;
+  }
+  /* every run takes at least four bytes of map */
+  if (count > INT32_MAX / 4) {
+    return -1;
+  }
+  if ((e = malloc((count ? count : 1) * sizeof(sparse_ext))) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if ((r = next_num(&q, end, &off)) != 1 || (r = next_num(&q, end, &size)) != 1) {
+      free(e);
+      return r;
+    }
+    if (off < last) {
+      free(e);
+      return -1;
+    }
+    e[i].offset = off;
+    e[i].size = size;
+    last = off + size;
+  }
+  *exts = e;
+  *n = count;
+  return (q - (const char *) p + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
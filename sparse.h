@@ -0,0 +1,19 @@
+#ifndef SPARSE
+#define SPARSE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* one run of data in a sparse file, everything between runs is hole */
+typedef struct sparse_ext {
+  off_t offset;
+  off_t size;
+} sparse_ext;
+
+int sparse_scan(int fd, off_t size, sparse_ext **exts);
+
+char *sparse_map_text(sparse_ext *exts, int n, size_t *len);
+
+ssize_t sparse_map_parse(const uint8_t *p, size_t len, sparse_ext **exts, int *n);
+#endif
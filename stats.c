@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+#include "id_cache.h"
+
+/* member latencies go in power of two buckets of nanoseconds */
+#define HIST_BUCKETS 40
+
+int stats_on = 0;
+
+typedef struct phase_stat {
+  uint64_t ns;
+  uint64_t count;
+  uint64_t calls;
+  uint64_t bytes;
+} phase_stat;
+
+/* every thread counts into its own block, nothing is shared until the
+ * report adds them up */
+typedef struct thread_stats {
+  phase_stat ph[PH_COUNT];
+  uint64_t hist[HIST_BUCKETS];
+  struct thread_stats *next;
+} thread_stats;
+
+static const char *phase_names[PH_COUNT] = {
+  "walk", "walk_wait", "header", "meta", "chksum", "open", "read", "read_wait",
+  "copy", "write", "compress", "inflate", "scan", "body", "set_meta"
+};
+
+static __thread thread_stats *mine;
+static thread_stats *all;
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t started;
+
+static thread_stats *local(void) {
+  if (mine == NULL) {
+    if ((mine = calloc(1, sizeof(thread_stats))) == NULL) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&all_lock);
+    mine -> next = all;
+    all = mine;
+    pthread_mutex_unlock(&all_lock);
+  }
+  return mine;
+}
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* switch counting on, the wall clock starts here */
+void stats_start(void) {
+  stats_on = 1;
+  started = stats_now();
+}
+
+/* charge the time since t0 to ph */
+void stats_add(stats_phase ph, uint64_t t0, uint64_t calls, uint64_t bytes) {
+  phase_stat *p = &local() -> ph[ph];
+  p -> ns += stats_now() - t0;
+  p -> count++;
+  p -> calls += calls;
+  p -> bytes += bytes;
+}
+
+/* one member done, t0 being when it was started on */
+void stats_member(uint64_t t0) {
+  uint64_t ns = stats_now() - t0;
+  int b = 0;
+  while (ns > 1 && b < HIST_BUCKETS - 1) {
+    ns >>= 1;
+    b++;
+  }
+  local() -> hist[b]++;
+}
+
+/* upper bound in microseconds of the bucket the q quantile falls in */
+static double quantile(uint64_t *hist, uint64_t total, double q) {
+  uint64_t seen = 0, want = total * q;
+  int b;
+  for (b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want) {
+      break;
+    }
+  }
+  return (double) ((uint64_t) 2 << b) / 1000;
+}
+
+/* add every thread up and print it, as a table or one json object */
+void stats_report(FILE *fp, int json) {
+  phase_stat sum[PH_COUNT] = {{0}};
+  uint64_t hist[HIST_BUCKETS] = {0}, members = 0;
+  unsigned long hits, misses;
+  double wall = (stats_now() - started) / 1e9, secs;
+  thread_stats *t;
+  int i, first;
+
+  pthread_mutex_lock(&all_lock);
+  for (t = all; t; t = t -> next) {
+    for (i = 0; i < PH_COUNT; i++) {
+      sum[i].ns += t -> ph[i].ns;
+      sum[i].count += t -> ph[i].count;
+      sum[i].calls += t -> ph[i].calls;
+      sum[i].bytes += t -> ph[i].bytes;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+      hist[i] += t -> hist[i];
+      members += t -> hist[i];
+    }
+  }
+  pthread_mutex_unlock(&all_lock);
+  id_cache_counts(&hits, &misses);
+
+  if (json) {
+    fprintf(fp, "{\"wall_s\":%.6f,\"phases\":{", wall);
+    for (i = 0, first = 1; i < PH_COUNT; i++) {
+      if (sum[i].count == 0) {
+	continue;
+      }
+      fprintf(fp, "%s\"%s\":{\"seconds\":%.6f,\"count\":%lu,\"calls\":%lu,\"bytes\":%lu}",
+	      first ? "" : ",", phase_names[i], sum[i].ns / 1e9,
+	      (unsigned long) sum[i].count, (unsigned long) sum[i].calls,
+	      (unsigned long) sum[i].bytes);
+      first = 0;
+    }
+    fprintf(fp, "},\"members\":%lu", (unsigned long) members);
+    if (members) {
+      fprintf(fp, ",\"latency_us\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"buckets\":[",
+	      quantile(hist, members, 0.5), quantile(hist, members, 0.9),
+	      quantile(hist, members, 0.99));
+      for (i = 0, first = 1; i < HIST_BUCKETS; i++) {
+	if (hist[i]) {
+	  fprintf(fp, "%s{\"le_us\":%.3f,\"count\":%lu}", first ? "" : ",",
+		  (double) ((uint64_t) 2 << i) / 1000, (unsigned long) hist[i]);
+	  first = 0;
+	}
+      }
+      fprintf(fp, "]}");
+    }
+    fprintf(fp, ",\"id_cache\":{\"hits\":%lu,\"misses\":%lu}}\n", hits, misses);
+    return;
+  }
+
+  fprintf(fp, "wall %.3fs\n", wall);
+  fprintf(fp, "%-10s %10s %10s %10s %14s %10s\n", "phase", "seconds", "count", "calls", "bytes", "MB/s");
+  for (i = 0; i < PH_COUNT; i++) {
+    if (sum[i].count == 0) {
+      continue;
+    }
+    secs = sum[i].ns / 1e9;
+    fprintf(fp, "%-10s %10.3f %10lu %10lu %14lu %10.1f\n", phase_names[i], secs,
+	    (unsigned long) sum[i].count, (unsigned long) sum[i].calls,
+	    (unsigned long) sum[i].bytes, secs > 0 ? sum[i].bytes / secs / 1048576 : 0.0);
+  }
+  if (members) {
+    fprintf(fp, "%lu members, latency p50 <%.1fus p90 <%.1fus p99 <%.1fus\n",
+	    (unsigned long) members, quantile(hist, members, 0.5),
+	    quantile(hist, members, 0.9), quantile(hist, members, 0.99));
+    for (i = 0; i < HIST_BUCKETS; i++) {
+      if (hist[i]) {
+	fprintf(fp, "  <%10.1fus %10lu\n", (double) ((uint64_t) 2 << i) / 1000,
+		(unsigned long) hist[i]);
+      }
+    }
+  }
+  if (hits + misses) {
+    fprintf(fp, "id cache: %lu lookups, %lu hits, %lu misses (%.1f%% hit rate)\n",
+	    hits + misses, hits, misses, 100.0 * hits / (hits + misses));
+  }
+}
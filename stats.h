@@ -0,0 +1,52 @@
+#ifndef STATS
+#define STATS
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* where the time goes, for --stats. nested phases are noted, their
+ * time is in the outer phase too */
+typedef enum stats_phase {
+  PH_WALK,        /* listing directories, on the walker threads */
+  PH_WALK_WAIT,   /* writer stalled waiting for a listing */
+  PH_HEADER,      /* create_header, includes meta and chksum */
+  PH_META,        /* init_stat and its passwd/group lookups */
+  PH_CHKSUM,
+  PH_OPEN,        /* opening and closing source files */
+  PH_READ,        /* reading source files into the buffer */
+  PH_READ_WAIT,   /* writer stalled waiting for the readers */
+  PH_COPY,        /* copy_file_range/sendfile/splice into the archive */
+  PH_WRITE,       /* writing the archive */
+  PH_COMPRESS,
+  PH_INFLATE,
+  PH_SCAN,        /* walking the archive headers */
+  PH_BODY,        /* writing extracted file bodies */
+  PH_SET_META,    /* mkdir, symlink, chown, chmod and times on extract */
+  PH_COUNT
+} stats_phase;
+
+extern int stats_on;
+
+/* cheap enough to leave in hot paths, nothing but a branch when off */
+#define STATS_START() (stats_on ? stats_now() : 0)
+#define STATS_END(ph, t0, calls, bytes) do {		\
+    if (stats_on) {					\
+      stats_add((ph), (t0), (calls), (bytes));		\
+    }							\
+  } while (0)
+#define STATS_MEMBER(t0) do {				\
+    if (stats_on) {					\
+      stats_member(t0);					\
+    }							\
+  } while (0)
+
+void stats_start(void);
+
+uint64_t stats_now(void);
+
+void stats_add(stats_phase ph, uint64_t t0, uint64_t calls, uint64_t bytes);
+
+void stats_member(uint64_t t0);
+
+void stats_report(FILE *fp, int json);
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+# update_extract.sh: a name put in again with u has to come back out of
+# x as its last copy, with the extraction spread over several threads.
+# the old copy is big so the worker writing it is still busy when the
+# new one is handed out. done once for the whole archive and once for
+# the name alone through the --index sidecar, which has both copies.
+#
+# usage: tests/update_extract.sh [mytar]
+#
+#   mytar  binary to test, built from the sources next to tests/ if
+#          not given
+#
+# prints ok and exits 0 when it passes, says what differed and exits 1
+# otherwise.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/mytar-test.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+CC=${CC:-cc}
+if [ $# -gt 0 ]; then
+  MYTAR=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+else
+  MYTAR=$WORK/mytar
+  $CC -O2 -o "$MYTAR" "$ROOT"/*.c -lm -lpthread -lz
+fi
+
+fail() {
+  echo "update_extract: $*" >&2
+  exit 1
+}
+
+cd "$WORK"
+mkdir -p dup
+head -c 100000000 /dev/urandom > dup/f
+"$MYTAR" --index cf dup.tar dup
+echo new > dup/f
+touch -d @$(($(date +%s) + 60)) dup/f
+"$MYTAR" --index uf dup.tar dup/f
+[ "$("$MYTAR" tf dup.tar | grep -c '^dup/f$')" = 2 ] || fail "u did not add the new copy"
+[ -f dup.tar.idx ] || fail "no index next to the archive"
+
+# the dup/f x left behind has to be the new copy, $1 says which run
+check() {
+  cmp -s out/dup/f dup/f || fail "$1: x left $(stat -c %s out/dup/f) bytes, not the last copy"
+  [ "$(stat -c %Y out/dup/f)" = "$(stat -c %Y dup/f)" ] || fail "$1: mtime of an older copy"
+}
+
+for run in 1 2 3; do
+  rm -rf out
+  mkdir out
+  (cd out && "$MYTAR" --threads 4 xf ../dup.tar) || fail "x failed"
+  check "run $run"
+  rm -rf out
+  mkdir out
+  (cd out && "$MYTAR" --threads 4 xf ../dup.tar dup/f) || fail "x dup/f failed"
+  check "run $run, by name"
+done
+echo ok
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+/* an open, a read and a close per file */
+#define RING_ENTRIES (2 * URING_BATCH)
+
+#define TAG_READ 0
+#define TAG_CLOSE 1
+#define TAG(i, kind) (((uint64_t) (i) << 1) | (kind))
+
+struct uring {
+  int fd;
+  void *sq_ring;
+  size_t sq_len;
+  void *cq_ring;
+  size_t cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned queued;     /* sqes filled in since the last enter */
+};
+
+static int ring_enter(uring *r, unsigned submit, unsigned wait) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, r -> fd, submit, wait,
+		  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  return ret;
+}
+
+/* next free sqe, zeroed. the batch is sized so this never runs out */
+static struct io_uring_sqe *ring_sqe(uring *r) {
+  unsigned tail = *r -> sq_tail + r -> queued;
+  struct io_uring_sqe *sqe;
+  if (tail - __atomic_load_n(r -> sq_head, __ATOMIC_ACQUIRE) > r -> sq_mask) {
+    return NULL;
+  }
+  sqe = &r -> sqes[tail & r -> sq_mask];
+  memset(sqe, '\0', sizeof(*sqe));
+  r -> sq_array[tail & r -> sq_mask] = tail & r -> sq_mask;
+  r -> queued++;
+  return sqe;
+}
+
+/* hand everything queued to the kernel and wait for wait completions */
+static int ring_submit(uring *r, unsigned wait) {
+  unsigned n = r -> queued;
+  __atomic_store_n(r -> sq_tail, *r -> sq_tail + n, __ATOMIC_RELEASE);
+  r -> queued = 0;
+  if (ring_enter(r, n, wait) == -1) {
+    perror("io_uring_enter");
+    return -1;
+  }
+  return 0;
+}
+
+/* pop one completion, 1 if there was one */
+static int ring_reap(uring *r, struct io_uring_cqe *out) {
+  unsigned head = *r -> cq_head;
+  if (head == __atomic_load_n(r -> cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  *out = r -> cqes[head & r -> cq_mask];
+  __atomic_store_n(r -> cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* wait for and pop one completion, 0 on success -1 on failure */
+static int ring_next(uring *r, struct io_uring_cqe *out) {
+  while (!ring_reap(r, out)) {
+    if (ring_enter(r, 0, 1) == -1) {
+      perror("io_uring_enter");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* the kernel has to know openat, read and close or there is no point */
+static int ring_probe(uring *r) {
+  size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p;
+  int ok;
+  if ((p = calloc(1, len)) == NULL) {
+    return 0;
+  }
+  ok = syscall(__NR_io_uring_register, r -> fd, IORING_REGISTER_PROBE, p, 256) == 0 &&
+    p -> last_op >= IORING_OP_READ &&
+    (p -> ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+    (p -> ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+    (p -> ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+  free(p);
+  return ok;
+}
+
+/* set up a ring, NULL (quietly) if the kernel doesn't have io_uring,
+ * has it switched off or is too old for the ops we use */
+uring *uring_init(void) {
+  struct io_uring_params p;
+  uring *r;
+  uint8_t *sq, *cq;
+
+  if ((r = calloc(1, sizeof(uring))) == NULL) {
+    return NULL;
+  }
+  memset(&p, '\0', sizeof(p));
+  if ((r -> fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) == -1) {
+    free(r);
+    return NULL;
+  }
+
+  r -> sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r -> cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r -> sq_len = r -> cq_len = r -> sq_len > r -> cq_len ? r -> sq_len : r -> cq_len;
+  }
+  r -> sq_ring = mmap(NULL, r -> sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      r -> fd, IORING_OFF_SQ_RING);
+  if (r -> sq_ring == MAP_FAILED) {
+    r -> sq_ring = NULL;
+    uring_free(r);
+    return NULL;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r -> cq_ring = r -> sq_ring;
+  } else if ((r -> cq_ring = mmap(NULL, r -> cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  r -> fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+    r -> cq_ring = NULL;
+    uring_free(r);
+    return NULL;
+  }
+  r -> sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  if ((r -> sqes = mmap(NULL, r -> sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r -> fd, IORING_OFF_SQES)) == MAP_FAILED) {
+    r -> sqes = NULL;
+    uring_free(r);
+    return NULL;
+  }
+
+  sq = r -> sq_ring;
+  cq = r -> cq_ring;
+  r -> sq_head = (unsigned *) (sq + p.sq_off.head);
+  r -> sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r -> sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  r -> sq_array = (unsigned *) (sq + p.sq_off.array);
+  r -> cq_head = (unsigned *) (cq + p.cq_off.head);
+  r -> cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r -> cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  r -> cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  if (!ring_probe(r)) {
+    uring_free(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* read the first sizes[i] bytes of paths[i] into bufs[i] for n <=
+ * URING_BATCH files. all the opens go in as one batch, then all the
+ * reads each linked to the close of its file. got[i] is the number of
+ * bytes read or -errno for that file
+ * returns 0 on success, -1 if the ring itself failed */
+int uring_load(uring *r, char **paths, uint8_t **bufs, size_t *sizes, ssize_t *got, int n) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+  int fds[URING_BATCH];
+  int i, k, wait;
+
+  for (i = 0; i < n; i++) {
+    sqe = ring_sqe(r);
+    sqe -> opcode = IORING_OP_OPENAT;
+    sqe -> fd = AT_FDCWD;
+    sqe -> addr = (uintptr_t) paths[i];
+    sqe -> open_flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    sqe -> user_data = i;
+  }
+  if (ring_submit(r, n)) {
+    return -1;
+  }
+  for (k = 0; k < n; k++) {
+    if (ring_next(r, &cqe)) {
+      return -1;
+    }
+    fds[cqe.user_data] = cqe.res;
+  }
+
+  wait = 0;
+  for (i = 0; i < n; i++) {
+    if (fds[i] < 0) {
+      got[i] = fds[i];
+      continue;
+    }
+    got[i] = 0;
+    sqe = ring_sqe(r);
+    sqe -> opcode = IORING_OP_READ;
+    sqe -> flags = IOSQE_IO_LINK;
+    sqe -> fd = fds[i];
+    sqe -> addr = (uintptr_t) bufs[i];
+    sqe -> len = sizes[i];
+    sqe -> off = 0;
+    sqe -> user_data = TAG(i, TAG_READ);
+    sqe = ring_sqe(r);
+    sqe -> opcode = IORING_OP_CLOSE;
+    sqe -> fd = fds[i];
+    sqe -> user_data = TAG(i, TAG_CLOSE);
+    wait += 2;
+  }
+  if (wait && ring_submit(r, wait)) {
+    return -1;
+  }
+  for (k = 0; k < wait; k++) {
+    if (ring_next(r, &cqe)) {
+      return -1;
+    }
+    i = cqe.user_data >> 1;
+    if ((cqe.user_data & 1) == TAG_READ) {
+      got[i] = cqe.res;
+    } else if (cqe.res == -ECANCELED) {
+      /* a failed read breaks the link, the close is on us */
+      close(fds[i]);
+    }
+  }
+  return 0;
+}
+
+void uring_free(uring *r) {
+  if (r -> sqes) {
+    munmap(r -> sqes, r -> sqes_len);
+  }
+  if (r -> cq_ring && r -> cq_ring != r -> sq_ring) {
+    munmap(r -> cq_ring, r -> cq_len);
+  }
+  if (r -> sq_ring) {
+    munmap(r -> sq_ring, r -> sq_len);
+  }
+  close(r -> fd);
+  free(r);
+}
@@ -0,0 +1,19 @@
+#ifndef URING
+#define URING
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define URING_BATCH 32
+
+/* just enough of io_uring, straight on the syscalls, to load a batch of
+ * small files with every open and read in flight at once instead of
+ * one open/read/close chain after another */
+typedef struct uring uring;
+
+uring *uring_init(void);
+
+int uring_load(uring *r, char **paths, uint8_t **bufs, size_t *sizes, ssize_t *got, int n);
+
+void uring_free(uring *r);
+#endif
@@ -0,0 +1,388 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "walk.h"
+#include "stats.h"
+
+/* bytes of listings the walkers may have waiting on the writer. past
+ * it they sleep until it frees some, it never waits on them for a
+ * directory nobody has started on since it lists that itself */
+#define WALK_AHEAD (32 << 20)
+
+/* per thread stack of directories still to list. the owner pushes and
+ * pops at the top (depth first, close to where the writer is), idle
+ * threads steal from the bottom */
+typedef struct deque {
+  pthread_mutex_t lock;
+  walk_node **nodes;
+  int bottom;
+  int top;
+  int cap;
+} deque;
+
+struct walker {
+  int nthreads;
+  int started;
+  pthread_t *threads;
+  deque *deques;
+  int next_home;            /* where the writer drops nodes it lists */
+
+  /* node states and refs, queued count, how far ahead and shutdown */
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t listed;
+  pthread_cond_t freed;     /* the writer let go of a listing */
+  int queued;
+  size_t ahead;             /* bytes listed and not freed yet */
+  int stop;
+  walk_prune_fn prune;      /* NULL to list everything */
+};
+
+typedef struct worker_arg {
+  walker *w;
+  int id;
+} worker_arg;
+
+static walk_node *node_new(char *path) {
+  walk_node *n;
+  if ((n = calloc(1, sizeof(walk_node) + strlen(path) + 1)) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  n -> path = (char *) (n + 1);
+  strcpy(n -> path, path);
+  n -> state = WN_QUEUED;
+  n -> refs = 2;
+  return n;
+}
+
+/* drop one reference, caller holds w -> lock */
+static void node_put(walk_node *n) {
+  if (--n -> refs == 0) {
+    free(n);
+  }
+}
+
+static void push(walker *w, int id, walk_node *n) {
+  deque *d = &w -> deques[id];
+  pthread_mutex_lock(&d -> lock);
+  if (d -> top == d -> cap) {
+    /* slide everything back down before growing */
+    memmove(d -> nodes, d -> nodes + d -> bottom, (d -> top - d -> bottom) * sizeof(walk_node *));
+    d -> top -= d -> bottom;
+    d -> bottom = 0;
+    if (d -> top == d -> cap) {
+      d -> cap = d -> cap ? d -> cap * 2 : 64;
+      d -> nodes = realloc(d -> nodes, d -> cap * sizeof(walk_node *));
+    }
+  }
+  d -> nodes[d -> top++] = n;
+  pthread_mutex_unlock(&d -> lock);
+
+  pthread_mutex_lock(&w -> lock);
+  w -> queued++;
+  pthread_cond_signal(&w -> work);
+  pthread_mutex_unlock(&w -> lock);
+}
+
+/* own work from the top, everyone else's from the bottom */
+static walk_node *take(walker *w, int id) {
+  walk_node *n = NULL;
+  deque *d;
+  int i;
+  for (i = 0; i < w -> nthreads && n == NULL; i++) {
+    d = &w -> deques[(id + i) % w -> nthreads];
+    pthread_mutex_lock(&d -> lock);
+    if (d -> top > d -> bottom) {
+      n = i == 0 ? d -> nodes[--d -> top] : d -> nodes[d -> bottom++];
+    }
+    pthread_mutex_unlock(&d -> lock);
+  }
+  if (n) {
+    pthread_mutex_lock(&w -> lock);
+    w -> queued--;
+    pthread_mutex_unlock(&w -> lock);
+  }
+  return n;
+}
+
+/* read one directory without touching the cwd: open it, readdir it and
+ * fstatat every entry relative to the directory fd. subdirectories
+ * become new nodes pushed onto deque id */
+static void list_node(walker *w, walk_node *n, int id) {
+  int fd, cap = 0, i;
+  size_t names_len = 0, names_cap = 0, len, plen;
+  size_t *name_offs = NULL;
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  char cpath[PATHMAX + 1];
+
+  if ((fd = openat(AT_FDCWD, n -> path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+    perror(n -> path);
+    return;
+  }
+  if ((dir = fdopendir(fd)) == NULL) {
+    perror(n -> path);
+    close(fd);
+    return;
+  }
+
+  plen = strlen(n -> path);
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0) {
+      continue;
+    }
+    len = strlen(entry -> d_name);
+    if (plen + len >= PATHMAX) {
+      fprintf(stderr, "%s%s: path excedes PATHMAX (%d) chars\n", n -> path, entry -> d_name, PATHMAX);
+      continue;
+    }
+    if (w -> prune) {
+      memcpy(cpath, n -> path, plen);
+      memcpy(cpath + plen, entry -> d_name, len + 1);
+      if (w -> prune(cpath)) {
+	continue;
+      }
+    }
+    if (fstatat(fd, entry -> d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      perror("create_arch fstatat failure");
+      continue;
+    }
+
+    if (n -> nents == cap) {
+      cap = cap ? cap * 2 : 16;
+      n -> ents = realloc(n -> ents, cap * sizeof(walk_entry));
+      name_offs = realloc(name_offs, cap * sizeof(size_t));
+    }
+    if (names_len + len + 1 > names_cap) {
+      names_cap = names_cap ? names_cap * 2 : 1024;
+      while (names_len + len + 1 > names_cap) {
+	names_cap *= 2;
+      }
+      n -> names = realloc(n -> names, names_cap);
+    }
+    memcpy(n -> names + names_len, entry -> d_name, len + 1);
+    name_offs[n -> nents] = names_len;
+    names_len += len + 1;
+    n -> ents[n -> nents].st = st;
+    n -> ents[n -> nents].child = NULL;
+    n -> nents++;
+  }
+  closedir(dir);
+
+  /* the names arena is done moving, hand out pointers into it */
+  for (i = 0; i < n -> nents; i++) {
+    n -> ents[i].name = n -> names + name_offs[i];
+  }
+  free(name_offs);
+  n -> bytes = cap * sizeof(walk_entry) + names_cap;
+
+  /* children go on in reverse so the first one comes off first */
+  for (i = n -> nents - 1; i >= 0; i--) {
+    if (!S_ISDIR(n -> ents[i].st.st_mode)) {
+      continue;
+    }
+    len = strlen(n -> ents[i].name);
+    if (plen + len + 1 >= PATHMAX) {
+      fprintf(stderr, "%s%s/: path excedes PATHMAX (%d) chars\n", n -> path, n -> ents[i].name, PATHMAX);
+      continue;
+    }
+    memcpy(cpath, n -> path, plen);
+    memcpy(cpath + plen, n -> ents[i].name, len);
+    cpath[plen + len] = '/';
+    cpath[plen + len + 1] = '\0';
+    /* left in the listing, but nothing under it is wanted */
+    if (w -> prune && w -> prune(cpath)) {
+      continue;
+    }
+    if ((n -> ents[i].child = node_new(cpath)) != NULL) {
+      push(w, id, n -> ents[i].child);
+    }
+  }
+}
+
+/* list n unless someone else already is, 1 if we did it */
+static int claim_and_list(walker *w, walk_node *n, int id) {
+  pthread_mutex_lock(&w -> lock);
+  if (n -> state != WN_QUEUED) {
+    pthread_mutex_unlock(&w -> lock);
+    return 0;
+  }
+  n -> state = WN_LISTING;
+  pthread_mutex_unlock(&w -> lock);
+
+  uint64_t t0 = STATS_START();
+  list_node(w, n, id);
+  /* openat, close and an fstatat per entry */
+  STATS_END(PH_WALK, t0, n -> nents + 2, 0);
+
+  pthread_mutex_lock(&w -> lock);
+  n -> state = WN_LISTED;
+  w -> ahead += n -> bytes;
+  pthread_cond_broadcast(&w -> listed);
+  pthread_mutex_unlock(&w -> lock);
+  return 1;
+}
+
+static void *worker(void *arg) {
+  walker *w = ((worker_arg *) arg) -> w;
+  int id = ((worker_arg *) arg) -> id;
+  walk_node *n;
+  free(arg);
+
+  for (;;) {
+    /* too far ahead of the writer, let it catch up */
+    pthread_mutex_lock(&w -> lock);
+    while (w -> ahead >= WALK_AHEAD && !w -> stop) {
+      pthread_cond_wait(&w -> freed, &w -> lock);
+    }
+    pthread_mutex_unlock(&w -> lock);
+    if ((n = take(w, id)) != NULL) {
+      claim_and_list(w, n, id);
+      pthread_mutex_lock(&w -> lock);
+      node_put(n);
+      pthread_mutex_unlock(&w -> lock);
+      continue;
+    }
+    pthread_mutex_lock(&w -> lock);
+    while (w -> queued == 0 && !w -> stop) {
+      pthread_cond_wait(&w -> work, &w -> lock);
+    }
+    if (w -> stop) {
+      pthread_mutex_unlock(&w -> lock);
+      break;
+    }
+    pthread_mutex_unlock(&w -> lock);
+  }
+  return NULL;
+}
+
+/* start nthreads listers, prune says what they can pass over
+ * returns the walker on success NULL on failure */
+walker *walk_start(int nthreads, walk_prune_fn prune) {
+  walker *w;
+  worker_arg *arg;
+  int i;
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if ((w = calloc(1, sizeof(walker))) == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  w -> threads = malloc(nthreads * sizeof(pthread_t));
+  w -> deques = calloc(nthreads, sizeof(deque));
+  pthread_mutex_init(&w -> lock, NULL);
+  pthread_cond_init(&w -> work, NULL);
+  pthread_cond_init(&w -> listed, NULL);
+  pthread_cond_init(&w -> freed, NULL);
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&w -> deques[i].lock, NULL);
+  }
+  w -> nthreads = nthreads;
+  w -> prune = prune;
+
+  for (i = 0; i < nthreads; i++) {
+    arg = malloc(sizeof(worker_arg));
+    arg -> w = w;
+    arg -> id = i;
+    if (pthread_create(&w -> threads[i], NULL, worker, arg)) {
+      free(arg);
+      break;
+    }
+  }
+  /* deques past the last running thread still get stolen from */
+  w -> started = i;
+  if (i == 0) {
+    fprintf(stderr, "walk_start: unable to start workers\n");
+    walk_stop(w);
+    return NULL;
+  }
+  return w;
+}
+
+/* queue the directory at path (must end in '/') for listing */
+walk_node *walk_submit(walker *w, char *path) {
+  walk_node *n;
+  if ((n = node_new(path)) == NULL) {
+    return NULL;
+  }
+  push(w, 0, n);
+  return n;
+}
+
+/* block until n has been listed, listing it right here if no worker
+ * has picked it up yet so the writer never sits idle behind the queue */
+int walk_wait(walker *w, walk_node *n) {
+  int id;
+  pthread_mutex_lock(&w -> lock);
+  id = w -> next_home;
+  w -> next_home = (w -> next_home + 1) % w -> nthreads;
+  pthread_mutex_unlock(&w -> lock);
+
+  if (claim_and_list(w, n, id)) {
+    return 0;
+  }
+  uint64_t t0 = STATS_START();
+  pthread_mutex_lock(&w -> lock);
+  while (n -> state != WN_LISTED) {
+    pthread_cond_wait(&w -> listed, &w -> lock);
+  }
+  pthread_mutex_unlock(&w -> lock);
+  STATS_END(PH_WALK_WAIT, t0, 0, 0);
+  return 0;
+}
+
+/* the writer is done with n (which has been waited on) */
+void walk_node_free(walker *w, walk_node *n) {
+  free(n -> ents);
+  free(n -> names);
+  n -> ents = NULL;
+  n -> names = NULL;
+  n -> nents = 0;
+  pthread_mutex_lock(&w -> lock);
+  if (w -> ahead >= WALK_AHEAD && w -> ahead - n -> bytes < WALK_AHEAD) {
+    pthread_cond_broadcast(&w -> freed);
+  }
+  w -> ahead -= n -> bytes;
+  node_put(n);
+  pthread_mutex_unlock(&w -> lock);
+}
+
+void walk_stop(walker *w) {
+  int i;
+  walk_node *n;
+  pthread_mutex_lock(&w -> lock);
+  w -> stop = 1;
+  pthread_cond_broadcast(&w -> work);
+  pthread_cond_broadcast(&w -> freed);
+  pthread_mutex_unlock(&w -> lock);
+  for (i = 0; i < w -> started; i++) {
+    pthread_join(w -> threads[i], NULL);
+  }
+
+  /* whatever never got taken still holds its queue reference */
+  for (i = 0; i < w -> nthreads; i++) {
+    while (w -> deques[i].top > w -> deques[i].bottom) {
+      n = w -> deques[i].nodes[--w -> deques[i].top];
+      node_put(n);
+    }
+    free(w -> deques[i].nodes);
+    pthread_mutex_destroy(&w -> deques[i].lock);
+  }
+  pthread_mutex_destroy(&w -> lock);
+  pthread_cond_destroy(&w -> work);
+  pthread_cond_destroy(&w -> listed);
+  pthread_cond_destroy(&w -> freed);
+  free(w -> deques);
+  free(w -> threads);
+  free(w);
+}
@@ -0,0 +1,49 @@
+#ifndef WALK
+#define WALK
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define PATHMAX 4096
+
+#define WN_QUEUED 0
+#define WN_LISTING 1
+#define WN_LISTED 2
+
+struct walk_node;
+
+/* one directory entry, in readdir order, with its lstat already done */
+typedef struct walk_entry {
+  char *name;
+  struct stat st;
+  struct walk_node *child;   /* set for directories we can descend */
+} walk_entry;
+
+/* a directory waiting to be (or already) listed. path always ends
+ * in '/' and is relative to the cwd mytar was started in */
+typedef struct walk_node {
+  char *path;                /* allocated along with the node */
+  int state;
+  int refs;                  /* tree + work queue, guarded by the walker */
+  walk_entry *ents;
+  int nents;
+  char *names;
+  size_t bytes;              /* what ents and names hold, until freed */
+} walk_node;
+
+typedef struct walker walker;
+
+/* 1 to pass path over without a stat, and for a directory (path ending
+ * in '/') without opening it either */
+typedef int (*walk_prune_fn)(char *path);
+
+walker *walk_start(int nthreads, walk_prune_fn prune);
+
+walk_node *walk_submit(walker *w, char *path);
+
+int walk_wait(walker *w, walk_node *n);
+
+void walk_node_free(walker *w, walk_node *n);
+
+void walk_stop(walker *w);
+#endif